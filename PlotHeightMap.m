@@ -1,3 +1,19 @@
-A = importdata('DME.txt',' ');
-tri = delaunay(A(:,1),A(:,2));
-h = trisurf(tri,A(:,1),A(:,2),A(:,3),A(:,4));
+% Plots the DEM exported by occupancy_mapping (binary export, see src/DEMFile.h)
+file = 'DEM.bin';
+header = memmapfile(file, 'Format', {'uint8', [1 4], 'magic'; 'uint32', [1 5], 'sizes'; 'double', [1 3], 'geometry'}, 'Repeat', 1);
+numLayers = double(header.Data.sizes(2));
+rows = double(header.Data.sizes(3));
+cols = double(header.Data.sizes(4));
+origin = header.Data.geometry(1:2);
+resolution = header.Data.geometry(3);
+layers = memmapfile(file, 'Offset', 48, 'Format', {'uint8', [1 24], 'name'; 'uint64', [1 1], 'offset'}, 'Repeat', numLayers);
+
+% The layers are row-major in the file, hence the transposition
+for k = 1:numLayers
+    name = deblank(char(layers.Data(k).name));
+    layer = memmapfile(file, 'Offset', double(layers.Data(k).offset), 'Format', {'single', [cols rows], 'values'}, 'Repeat', 1);
+    A.(name) = layer.Data.values';
+end
+
+[X, Y] = ndgrid(origin(1) + (0:rows-1)*resolution, origin(2) + (0:cols-1)*resolution);
+h = surf(X, Y, A.height, A.variance, 'EdgeColor', 'none');
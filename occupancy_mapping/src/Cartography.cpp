@@ -7,7 +7,12 @@
 #include "Cartography.h"
 #include "Cell.h"
 #include <float.h>
+#include <limits.h>
 #include <math.h>
+#include <algorithm>
+#include <iterator>
+#include <set>
+#include "DEMFileWriter.h"
 
 // We cap the maximum/minimum value for log odd
 #define MAX_LOG_ODD	log(FLT_MAX/2)
@@ -15,54 +20,70 @@
 
 using namespace std;
 
-struct BlockMatrixData
+struct CartographyBlock
 {
 	//! Coordinates (m,n) of the block matrix in m_pFinalMatrix
 	int m;
 	int n;
+	// Level of detail (see ResolutionLevels) and elements per side of the matrices
+	int level;
+	int size;
 	cv::Mat *pMatrix;
+	// Log odds added by the local updates since the last export, allocated on the first one
+	cv::Mat *pLocalMatrix;
+	// True if the block is in m_vLocalBlocks
+	bool bLocalChanged;
+	// Elements whose log odd reached MIN_LOG_ODD or MAX_LOG_ODD
+	ConvergenceMask saturated;
 
-	BlockMatrixData() : pMatrix(nullptr)	{}
+	CartographyBlock() : level(0), size(0), pMatrix(nullptr), pLocalMatrix(nullptr), bLocalChanged(false)	{}
 
-	~BlockMatrixData()
+	~CartographyBlock()
 	{
 		if(pMatrix)
 			delete pMatrix;
+		if(pLocalMatrix)
+			delete pLocalMatrix;
 	}
 };
 
-Cartography::Cartography(ros::NodeHandle &n, double dCellSize, unsigned int uiCellSize):
-	m_ImageTransport(n), m_dCellSize(dCellSize), m_uiCellSize(uiCellSize),
-	m_MinCellRow(INT_MAX), m_MaxCellRow(INT_MIN),
-	m_MinCellColumn(INT_MAX), m_MaxCellColumn(INT_MIN),
+Cartography::Cartography(double dCellSize, unsigned int uiCellSize):
 	m_pFinalMatrix(nullptr),
+	m_dCellSize(dCellSize), m_uiCellSize(uiCellSize),
+	m_MaxCellRow(INT_MIN), m_MinCellRow(INT_MAX),
+	m_MaxCellColumn(INT_MIN), m_MinCellColumn(INT_MAX),
 	m_OldMaxCellRow(0), m_OldMinCellRow(0),
-	m_OldMaxCellColumn(0), m_OldMinCellColumn(0)
+	m_OldMaxCellColumn(0), m_OldMinCellColumn(0), m_bFinalMatrixShared(false),
+	m_dStateThreshold(1.0), m_bTrackLocalChanges(false),
+	m_pLastBlock(nullptr), m_NumSkipped(0), m_Levels(dCellSize, uiCellSize)
 {
-	m_ImagePublisher = m_ImageTransport.advertise("image",1);
 }
 
 Cartography::~Cartography()
 {
 	for(auto it = m_CellMap.begin(); it != m_CellMap.end(); it++)
 		delete(it->second);
+	if(m_pFinalMatrix)
+		delete m_pFinalMatrix;
 }
 
-void Cartography::PublishImage()
+bool Cartography::Compose()
 {
 	if(m_MinCellRow == INT_MAX || m_MaxCellRow == INT_MIN || m_MinCellColumn == INT_MAX || m_MaxCellColumn == INT_MIN)
-		return;
+		return false;
 
 	int numRows = (m_MaxCellRow-m_MinCellRow+1)*m_uiCellSize;
 	int numColumns = (m_MaxCellColumn-m_MinCellColumn+1)*m_uiCellSize;
 
-	if(((m_MinCellColumn != m_OldMinCellColumn) || (m_MaxCellRow != m_OldMaxCellRow) || (m_MinCellRow != m_OldMinCellRow) || (m_MaxCellColumn != m_OldMaxCellColumn)))
+	if(!m_pFinalMatrix || m_bFinalMatrixShared || ((m_MinCellColumn != m_OldMinCellColumn) || (m_MaxCellRow != m_OldMaxCellRow) || (m_MinCellRow != m_OldMinCellRow) || (m_MaxCellColumn != m_OldMaxCellColumn)))
 	{
 		m_OldMaxCellRow = m_MaxCellRow;
 		m_OldMinCellColumn = m_MinCellColumn;
 		m_OldMinCellRow = m_MinCellRow;
 		m_OldMaxCellColumn = m_MaxCellColumn;
+		m_bFinalMatrixShared = false;
 
+		// A shared matrix lives on in its other headers
 		if(m_pFinalMatrix)
 			delete m_pFinalMatrix;
 		m_pFinalMatrix =  new cv::Mat(numRows,numColumns,CV_32F);
@@ -86,10 +107,26 @@ void Cartography::PublishImage()
 			{
 				int m = int(it->second->m-m_MinCellRow)*m_uiCellSize+i;
 				int n = int(it->second->n-m_MinCellColumn)*m_uiCellSize+j;
-				m_pFinalMatrix->at<float>(m, n) = it->second->pMatrix->at<float>(i, j);
+				int level = it->second->level;
+				m_pFinalMatrix->at<float>(m, n) = it->second->pMatrix->at<float>(i >> level, j >> level);
 			}
 		}
 	}
+	return true;
+}
+
+bool Cartography::ComposeImage(cv::Mat &image)
+{
+	if(!Compose())
+		return false;
+	ColorImage(*m_pFinalMatrix, image);
+	return true;
+}
+
+void Cartography::ColorImage(const cv::Mat &logOdds, cv::Mat &image)
+{
+	int numRows = logOdds.rows;
+	int numColumns = logOdds.cols;
 
 	auto imageMatrix = cv::Mat(numRows,numColumns,CV_32S);
 	// Prepare the colors before publishing the cvMat as an image
@@ -98,10 +135,10 @@ void Cartography::PublishImage()
 		for(int j = 0; j < numColumns; j++)
 		{
 			// Compute the probability associated with the log odd
-			double p = 1.0f-1.0f/(1.0f+exp(m_pFinalMatrix->at<float>(i, j)));
+			double p = 1.0f-1.0f/(1.0f+exp(logOdds.at<float>(i, j)));
 			// p close to 1 means that the certainty that the cell is traversable is very high.
 			// We return a color close to 255 (white) for such values.
-			//ROS_INFO("%f",m_pFinalMatrix->at<float>(i, j));
+			//ROS_INFO("%f",logOdds.at<float>(i, j));
 			int color=int(p*255.0);
 			//ROS_INFO("%f %d", p, color);
 			int finalColor = color;
@@ -111,39 +148,27 @@ void Cartography::PublishImage()
 		}
 	}
 
-
-	cv_bridge::CvImage out_msg;
-	out_msg.encoding = "rgba8";
-	out_msg.image    = imageMatrix;
-
-	// O.O This is really weird we did an infinite loop for Project 1, and it... worked ?
-
-	/*
-	ros::Rate loop_rate(5);
-	while (ros::ok())
-	{
-		m_ImagePublisher.publish(out_msg.toImageMsg());
-
-		loop_rate.sleep();
-	}*/
-
-	m_ImagePublisher.publish(out_msg.toImageMsg());
+	image = imageMatrix;
 }
 
-static void CapRange(float &value)
+// Returns true if the value reached one of the limits
+static bool CapRange(float &value)
 {
 	if(value >= MAX_LOG_ODD)
+	{
 		value = MAX_LOG_ODD;
+		return true;
+	}
 	if(value <= MIN_LOG_ODD)
+	{
 		value = MIN_LOG_ODD;
+		return true;
+	}
+	return false;
 }
 
-void Cartography::Update(double x, double y, double data)
+CartographyBlock* Cartography::GetBlock(int i, int j)
 {
-	int i, j;
-	i = floor(double(x)/m_dCellSize);
-	j = floor(double(y)/m_dCellSize);
-
 	m_MaxCellRow = std::max(m_MaxCellRow, i);
 	m_MinCellRow = std::min(m_MinCellRow, i);
 	m_MaxCellColumn = std::max(m_MaxCellColumn, j);
@@ -163,40 +188,378 @@ void Cartography::Update(double x, double y, double data)
 
 	// Fills in the new data
 	auto it = m_CellMap.find(idx);
-	BlockMatrixData *pData;
+	CartographyBlock *pData;
+	int level = m_Levels.GetLevel(i, j);
 	if(it == m_CellMap.end())
 	{
-		pData = new BlockMatrixData;
+		pData = new CartographyBlock;
 		pData->m = i;
 		pData->n = j;
-		pData->pMatrix = new cv::Mat(m_uiCellSize,m_uiCellSize,CV_32F);
+		pData->level = level;
+		pData->size = ResolutionLevels::GetSize(m_uiCellSize, level);
+		pData->pMatrix = new cv::Mat(pData->size,pData->size,CV_32F);
 
-		for(int i = 0; i < m_uiCellSize; i++)
+		for(int i = 0; i < pData->size; i++)
 		{
-			for(int j = 0; j < m_uiCellSize; j++)
+			for(int j = 0; j < pData->size; j++)
 			{
 				pData->pMatrix->at<float>(i,j)=0.0f;
 			}
 		}
+		pData->saturated.Resize(pData->size*pData->size);
 		m_CellMap[idx] = pData;
 	}
 	else
+	{
 		pData = it->second;
+		if(level < pData->level)
+			Refine(pData, level);
+	}
+	return pData;
+}
+
+void Cartography::Refine(CartographyBlock *pData, int level) const
+{
+	int shift = pData->level-level;
+	int size = ResolutionLevels::GetSize(m_uiCellSize, level);
+	cv::Mat *pMatrix = new cv::Mat(size, size, CV_32F);
+	cv::Mat *pLocalMatrix = pData->pLocalMatrix ? new cv::Mat(size, size, CV_32F) : nullptr;
+	pData->saturated.Resize(size*size);
+	for(int m = 0; m < size; m++)
+	{
+		for(int n = 0; n < size; n++)
+		{
+			float &fLogOdd = pMatrix->at<float>(m, n);
+			fLogOdd = pData->pMatrix->at<float>(m >> shift, n >> shift);
+			if(CapRange(fLogOdd))
+				pData->saturated.Set(m*size+n);
+			if(pLocalMatrix)
+				pLocalMatrix->at<float>(m, n) = pData->pLocalMatrix->at<float>(m >> shift, n >> shift);
+		}
+	}
+	delete pData->pMatrix;
+	pData->pMatrix = pMatrix;
+	if(pLocalMatrix)
+	{
+		delete pData->pLocalMatrix;
+		pData->pLocalMatrix = pLocalMatrix;
+	}
+	pData->level = level;
+	pData->size = size;
+}
+
+void Cartography::Update(double x, double y, double data)
+{
+	UpdateCell(ConvertWorldCoordToIndex(x), ConvertWorldCoordToIndex(y), data);
+}
+
+void Cartography::UpdateCell(int x, int y, double data)
+{
+	int i = FloorDiv(x, m_uiCellSize);
+	int j = FloorDiv(y, m_uiCellSize);
+	CartographyBlock *pData = m_pLastBlock;
+	if(!pData || pData->m != i || pData->n != j)
+		pData = m_pLastBlock = GetBlock(i, j);
 
-	// Take the decimal part of x and y
-	// For negative value it will take 1-decimal part
-	double _01x = x-double(i)*m_dCellSize; 
-	double _01y = y-double(j)*m_dCellSize;
 	// Convert to cvMat row and column
-	int m = int(_01x*m_uiCellSize);
-	int n = int(_01y*m_uiCellSize);
-	float fLogOdd = pData->pMatrix->at<float>(m, n);
-	fLogOdd = float(data) + fLogOdd;
-	CapRange(fLogOdd);
-	pData->pMatrix->at<float>(m, n) = fLogOdd;
+	int m = x-i*int(m_uiCellSize);
+	int n = y-j*int(m_uiCellSize);
+	ApplyLogOdd(pData, m, n, float(data));
+}
+
+float Cartography::GetCoarseLogOdd(const CartographyBlock *pData, int m, int n, float data) const
+{
+	// Negative log odds are obstacle evidence. The free evidence is averaged, so the log odds stay
+	// weighted by the range of their points, but an obstacle seen in any of the elements makes
+	// the coarse element as occupied as it would make that element alone.
+	if(pData->level == 0 || data < 0.0f)
+		return data;
+	return data/(ResolutionLevels::GetCoverage(m_uiCellSize, pData->level, m >> pData->level)
+		*ResolutionLevels::GetCoverage(m_uiCellSize, pData->level, n >> pData->level));
+}
+
+void Cartography::ApplyLogOdd(CartographyBlock *pData, int m, int n, float data)
+{
+	data = GetCoarseLogOdd(pData, m, n, data);
+	m >>= pData->level;
+	n >>= pData->level;
+	// Adding to a saturated log odd changes nothing, unless the observation contradicts it.
+	// A saturated element sends nothing more to the other robots either.
+	if(pData->saturated.Test(m*pData->size+n) && data*pData->pMatrix->at<float>(m, n) >= 0.0f)
+	{
+		m_NumSkipped++;
+		return;
+	}
+	AddLogOdd(pData, m, n, data, m_vStateChanges);
+	if(!m_bTrackLocalChanges)
+		return;
+	if(!pData->pLocalMatrix)
+		pData->pLocalMatrix = new cv::Mat(cv::Mat::zeros(pData->size, pData->size, CV_32F));
+	pData->pLocalMatrix->at<float>(m, n) += data;
+	if(!pData->bLocalChanged)
+	{
+		pData->bLocalChanged = true;
+		m_vLocalBlocks.push_back(pData);
+	}
+}
+
+void Cartography::AddLogOdd(CartographyBlock *pData, int m, int n, float data, std::vector<CellStateChange> &vChanges) const
+{
+	float &fLogOdd = pData->pMatrix->at<float>(m, n);
+	CellState previousState = GetState(fLogOdd);
+	fLogOdd = data + fLogOdd;
+	// Blocks are fused on different threads, so each thread only writes the mask of its block
+	if(CapRange(fLogOdd))
+		pData->saturated.Set(m*pData->size+n);
+	else
+		pData->saturated.Reset(m*pData->size+n);
+	CellState state = GetState(fLogOdd);
+	if(state != previousState)
+	{
+		int x0 = pData->m*int(m_uiCellSize)+(m << pData->level);
+		int y0 = pData->n*int(m_uiCellSize)+(n << pData->level);
+		int numRows = ResolutionLevels::GetCoverage(m_uiCellSize, pData->level, m);
+		int numColumns = ResolutionLevels::GetCoverage(m_uiCellSize, pData->level, n);
+		for(int x = x0; x < x0+numRows; x++)
+		{
+			for(int y = y0; y < y0+numColumns; y++)
+			{
+				CellStateChange change = {x, y, previousState, state};
+				vChanges.push_back(change);
+			}
+		}
+	}
+}
+
+void Cartography::ExportLocalChanges(std::map<long long, MapTileData> &tiles)
+{
+	for(size_t k = 0; k < m_vLocalBlocks.size(); k++)
+	{
+		CartographyBlock *pData = m_vLocalBlocks[k];
+		MapTileData &tile = tiles[PackIndices(pData->m, pData->n)];
+		tile.i = pData->m;
+		tile.j = pData->n;
+		tile.logOdds.resize(m_uiCellSize*m_uiCellSize);
+		ResolutionLevels::Expand(*pData->pLocalMatrix, pData->level, m_uiCellSize, &tile.logOdds[0]);
+		pData->pLocalMatrix->setTo(cv::Scalar(0));
+		pData->bLocalChanged = false;
+	}
+	m_vLocalBlocks.clear();
+}
+
+void Cartography::ExportBlocks(std::map<long long, MapTileData> &tiles) const
+{
+	for(auto it = m_CellMap.begin(); it != m_CellMap.end(); it++)
+	{
+		const CartographyBlock *pData = it->second;
+		MapTileData &tile = tiles[PackIndices(pData->m, pData->n)];
+		tile.i = pData->m;
+		tile.j = pData->n;
+		tile.logOdds.resize(m_uiCellSize*m_uiCellSize);
+		ResolutionLevels::Expand(*pData->pMatrix, pData->level, m_uiCellSize, &tile.logOdds[0]);
+	}
+}
+
+void Cartography::FuseBlock(CartographyBlock *pData, const MapTileData &tile, std::vector<CellStateChange> &vChanges) const
+{
+	// The tiles are at full resolution, aggregated into the coarse elements like the local updates
+	const int level = pData->level;
+	for(int m = 0; m < int(m_uiCellSize); m++)
+	{
+		for(int n = 0; n < int(m_uiCellSize); n++)
+		{
+			float data = tile.logOdds[m*m_uiCellSize+n];
+			if(data == 0.0f)
+				continue;
+			AddLogOdd(pData, m >> level, n >> level, GetCoarseLogOdd(pData, m, n, data), vChanges);
+		}
+	}
+}
+
+// Fuses tiles in parallel, each tile going to a different block
+class BlockFusion : public cv::ParallelLoopBody
+{
+	const Cartography &m_Cartography;
+	const std::vector<CartographyBlock*> &m_vBlocks;
+	const std::vector<const MapTileData*> &m_vTiles;
+	std::vector<std::vector<CellStateChange> > &m_vChanges;
+
+public:
+	BlockFusion(const Cartography &cartography, const std::vector<CartographyBlock*> &blocks,
+		const std::vector<const MapTileData*> &tiles, std::vector<std::vector<CellStateChange> > &changes) :
+		m_Cartography(cartography), m_vBlocks(blocks), m_vTiles(tiles), m_vChanges(changes)	{}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		for(int k = range.start; k < range.end; k++)
+			m_Cartography.FuseBlock(m_vBlocks[k], *m_vTiles[k], m_vChanges[k]);
+	}
+};
+
+void Cartography::Fuse(const std::vector<const MapTileData*> &tiles)
+{
+	std::vector<const MapTileData*> remaining;
+	for(size_t k = 0; k < tiles.size(); k++)
+	{
+		if(tiles[k]->logOdds.size() == m_uiCellSize*m_uiCellSize)
+			remaining.push_back(tiles[k]);
+	}
+	// The blocks are created beforehand since the block map cannot be modified concurrently.
+	// Tiles of the same block are fused in successive passes so that no block is shared.
+	while(!remaining.empty())
+	{
+		std::vector<const MapTileData*> batch;
+		std::vector<const MapTileData*> duplicates;
+		std::vector<CartographyBlock*> blocks;
+		std::set<long long> keys;
+		for(size_t k = 0; k < remaining.size(); k++)
+		{
+			if(!keys.insert(PackIndices(remaining[k]->i, remaining[k]->j)).second)
+			{
+				duplicates.push_back(remaining[k]);
+				continue;
+			}
+			batch.push_back(remaining[k]);
+			blocks.push_back(GetBlock(remaining[k]->i, remaining[k]->j));
+		}
 
+		std::vector<std::vector<CellStateChange> > changes(batch.size());
+		cv::parallel_for_(cv::Range(0, int(batch.size())), BlockFusion(*this, blocks, batch, changes));
+		for(size_t k = 0; k < changes.size(); k++)
+			m_vStateChanges.insert(m_vStateChanges.end(), changes[k].begin(), changes[k].end());
+		remaining.swap(duplicates);
+	}
+}
+
+// Walks one ray per hit element with a DDA (Amanatides & Woo) and stores the elements crossed,
+// the hit element excluded. Each ray writes in its own vector so the rays can be walked in parallel.
+class RayTraversal : public cv::ParallelLoopBody
+{
+	const double m_dOriginX;
+	const double m_dOriginY;
+	const std::vector<long long> &m_vHits;
+	std::vector<std::vector<long long> > &m_vCrossed;
+
+public:
+	RayTraversal(double ox, double oy, const std::vector<long long> &hits, std::vector<std::vector<long long> > &crossed) :
+		m_dOriginX(ox), m_dOriginY(oy), m_vHits(hits), m_vCrossed(crossed)	{}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		for(int r = range.start; r < range.end; r++)
+		{
+			int endX, endY;
+			UnpackIndices(m_vHits[r], endX, endY);
+			// Aim at the center of the hit element
+			double dx = (double(endX)+0.5)-m_dOriginX;
+			double dy = (double(endY)+0.5)-m_dOriginY;
+			int x = int(floor(m_dOriginX));
+			int y = int(floor(m_dOriginY));
+			int stepX = (dx > 0) ? 1 : -1;
+			int stepY = (dy > 0) ? 1 : -1;
+			// Ray parameter at which the next vertical/horizontal border is crossed, and its increment
+			double tDeltaX = (dx != 0) ? fabs(1.0/dx) : DBL_MAX;
+			double tDeltaY = (dy != 0) ? fabs(1.0/dy) : DBL_MAX;
+			double tMaxX = (dx != 0) ? ((stepX > 0) ? (x+1-m_dOriginX) : (m_dOriginX-x))*tDeltaX : DBL_MAX;
+			double tMaxY = (dy != 0) ? ((stepY > 0) ? (y+1-m_dOriginY) : (m_dOriginY-y))*tDeltaY : DBL_MAX;
+
+			std::vector<long long> &crossed = m_vCrossed[r];
+			crossed.clear();
+			int numSteps = abs(endX-x)+abs(endY-y);
+			for(int k = 0; k < numSteps; k++)
+			{
+				crossed.push_back(PackIndices(x, y));
+				if(tMaxX < tMaxY)
+				{
+					tMaxX += tDeltaX;
+					x += stepX;
+				}
+				else
+				{
+					tMaxY += tDeltaY;
+					y += stepY;
+				}
+				if(x == endX && y == endY)
+					break;
+			}
+		}
+	}
+};
+
+void Cartography::GetFreeSpace(double ox, double oy, const std::vector<cv::Point2f> &hits, std::vector<long long> &freeKeys) const
+{
+	freeKeys.clear();
+	if(hits.empty())
+		return;
+
+	// Only one ray per hit element
+	std::vector<long long> hitKeys(hits.size());
+	for(size_t k = 0; k < hits.size(); k++)
+		hitKeys[k] = PackIndices(ConvertWorldCoordToIndex(hits[k].x), ConvertWorldCoordToIndex(hits[k].y));
+	std::sort(hitKeys.begin(), hitKeys.end());
+	hitKeys.erase(std::unique(hitKeys.begin(), hitKeys.end()), hitKeys.end());
+
+	// Origin expressed in matrix element units
+	double originX = ox*m_uiCellSize/m_dCellSize;
+	double originY = oy*m_uiCellSize/m_dCellSize;
+	std::vector<std::vector<long long> > crossed(hitKeys.size());
+	cv::parallel_for_(cv::Range(0, int(hitKeys.size())), RayTraversal(originX, originY, hitKeys, crossed));
+
+	// Merge the rays: an element crossed by several rays is only updated once,
+	// and elements where a point landed in this scan are left to Update
+	size_t numCrossed = 0;
+	for(size_t r = 0; r < crossed.size(); r++)
+		numCrossed += crossed[r].size();
+	std::vector<long long> crossedKeys;
+	crossedKeys.reserve(numCrossed);
+	for(size_t r = 0; r < crossed.size(); r++)
+		crossedKeys.insert(crossedKeys.end(), crossed[r].begin(), crossed[r].end());
+	std::sort(crossedKeys.begin(), crossedKeys.end());
+	crossedKeys.erase(std::unique(crossedKeys.begin(), crossedKeys.end()), crossedKeys.end());
+	std::set_difference(crossedKeys.begin(), crossedKeys.end(), hitKeys.begin(), hitKeys.end(),
+		std::back_inserter(freeKeys));
+}
+
+void Cartography::UpdateFreeSpace(double ox, double oy, const std::vector<cv::Point2f> &hits, double data)
+{
+	std::vector<long long> freeKeys;
+	GetFreeSpace(ox, oy, hits, freeKeys);
+
+	// Sorted keys visit the elements of a block row after row, so keep the last block at hand
+	CartographyBlock *pData = nullptr;
+	for(size_t k = 0; k < freeKeys.size(); k++)
+	{
+		int x, y;
+		UnpackIndices(freeKeys[k], x, y);
+		int i = FloorDiv(x, m_uiCellSize);
+		int j = FloorDiv(y, m_uiCellSize);
+		if(!pData || pData->m != i || pData->n != j)
+			pData = GetBlock(i, j);
+		ApplyLogOdd(pData, x-i*int(m_uiCellSize), y-j*int(m_uiCellSize), float(data));
+	}
+}
+
+bool Cartography::PublishToFile(const std::string &path)
+{
+	if(!Compose())
+		return false;
+	DEMFileData data;
+	data.resolution = getResolution();
+	data.originX = getMatOrigin().x*data.resolution;
+	data.originY = getMatOrigin().y*data.resolution;
+	data.names.push_back("log_odds");
+	data.layers.push_back(*m_pFinalMatrix);
+	return DEMFileWriter::Write(path, data);
 }
 
 cv::Mat* Cartography::getMat(){
 	return this->m_pFinalMatrix;
 }
+
+cv::Mat Cartography::ShareMat()
+{
+	if(!m_pFinalMatrix)
+		return cv::Mat();
+	m_bFinalMatrixShared = true;
+	return *m_pFinalMatrix;
+}
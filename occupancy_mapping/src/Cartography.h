@@ -1,29 +1,35 @@
 #pragma once
 
-#include <ros/ros.h>
-#include <sensor_msgs/Image.h>
-#include <sensor_msgs/image_encodings.h>
-#include <image_transport/image_transport.h>
-#include <cv_bridge/cv_bridge.h>
-#include <opencv2/imgproc/imgproc.hpp>
-#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/core/core.hpp>
 #include <map>
+#include <string>
+#include <vector>
 #include <math.h>
+#include "Cell.h"
+#include "ConvergenceMask.h"
+#include "MapTile.h"
+#include "ResolutionLevels.h"
 
 #define nullptr	0
 
 
 // Stores the block matrix row/column for easier access
-struct BlockMatrixData;
+struct CartographyBlock;
+
+// Change of the state of a matrix element, x and y being indices over the whole map
+struct CellStateChange
+{
+	int x;
+	int y;
+	CellState from;
+	CellState to;
+};
 
 class Cartography
 {
 protected:
-	image_transport::ImageTransport m_ImageTransport;
-	image_transport::Publisher m_ImagePublisher;
-
 	// Map = Cells. Cells = Fixed size matrices. Matrix elements = data about a world space square of dimension m_dCellSize.
-	std::map<int, BlockMatrixData*> m_CellMap;
+	std::map<int, CartographyBlock*> m_CellMap;
 	// Concatenates data from the map of cells.
 	 cv::Mat *m_pFinalMatrix;	// cvCreateMat(m,n,CV_64FC1);
 
@@ -43,14 +49,107 @@ protected:
 	int m_OldMinCellRow;
 	int m_OldMaxCellColumn;
 	int m_OldMinCellColumn;
+	// Set once the final matrix is shared by ShareMat, so that the next Compose writes a new one
+	bool m_bFinalMatrixShared;
+
+	// Log odd above which an element is Traversable, and below the opposite of which it is NonTraversable
+	double m_dStateThreshold;
+	// State changes since the last call to ClearStateChanges
+	std::vector<CellStateChange> m_vStateChanges;
+
+	// Keeps the log odds added by the local updates since the last export
+	bool m_bTrackLocalChanges;
+	// Blocks with local changes since the last export
+	std::vector<CartographyBlock*> m_vLocalBlocks;
+
+	// Block of the last update, successive updates usually falling in the same block
+	CartographyBlock *m_pLastBlock;
+	// Updates dropped since the last call to TakeNumSkipped, their element being saturated
+	size_t m_NumSkipped;
+	// Resolution of the blocks from their distance to the robot
+	ResolutionLevels m_Levels;
+
+	// Returns the block matrix (i, j), creating it if it does not exist yet, and refines it if the
+	// robot came closer since
+	CartographyBlock* GetBlock(int i, int j);
+	// Replicates the elements of a block into those of a finer level, each finer element being as
+	// occupied as the coarse one
+	void Refine(CartographyBlock *pData, int level) const;
+	// Share of data, added to the full resolution element (m, n) of a block, which goes to the
+	// element of the block standing for it. The free evidence is spread over the elements of a
+	// coarse element while the obstacle evidence is kept whole, so that a thin obstacle is not
+	// averaged away by the free space around it.
+	float GetCoarseLogOdd(const CartographyBlock *pData, int m, int n, float data) const;
+	// Converts a world coordinate to the index of the matrix element containing it
+	inline int ConvertWorldCoordToIndex(double d) const	{return int(floor(d*m_uiCellSize/m_dCellSize));}
+	// Adds data measured locally to the full resolution element (m, n) of a block.
+	// Elements saturated by the log odd range in the direction of data are left untouched.
+	void ApplyLogOdd(CartographyBlock *pData, int m, int n, float data);
+	// Adds data to the element (m, n) of a block, at the level of the block, and appends its state
+	// change to vChanges, once for each full resolution element it stands for
+	void AddLogOdd(CartographyBlock *pData, int m, int n, float data, std::vector<CellStateChange> &vChanges) const;
+	// Adds the log odds of a tile received from another robot to its block
+	void FuseBlock(CartographyBlock *pData, const MapTileData &tile, std::vector<CellStateChange> &vChanges) const;
+	friend class BlockFusion;
+	inline CellState GetState(float fLogOdd) const
+	{
+		if(fLogOdd >= m_dStateThreshold)
+			return Traversable;
+		if(fLogOdd <= -m_dStateThreshold)
+			return NonTraversable;
+		return Unknown;
+	}
 
 public:
-	Cartography(ros::NodeHandle &n, double dCellSize, unsigned int uiCellSize);
+	Cartography(double dCellSize, unsigned int uiCellSize);
 
 	~Cartography();
 
-	void PublishImage();
+	// Copies the blocks into the final matrix. Returns false if the map is empty.
+	bool Compose();
+	// Composes the map into an rgba8 image, white meaning traversable
+	bool ComposeImage(cv::Mat &image);
+	// Converts log odds into the image of ComposeImage
+	static void ColorImage(const cv::Mat &logOdds, cv::Mat &image);
+	// Final matrix of the last Compose, shared rather than copied. The next Compose leaves it as it
+	// is and writes a new final matrix, so it can be read once the map is unlocked.
+	cv::Mat ShareMat();
+	// Writes the log odds as a binary export (see DEMFile.h)
+	bool PublishToFile(const std::string &path);
 
 	void Update(double x, double y, double data);
+	// Adds data to the matrix element (x, y), x and y being indices over the whole map
+	void UpdateCell(int x, int y, double data);
+	// Walks the rays from the sensor (ox, oy) to the hits and adds data to every element crossed on the way.
+	// Hits falling in the same element share a single ray, and each crossed element is updated once.
+	void UpdateFreeSpace(double ox, double oy, const std::vector<cv::Point2f> &hits, double data);
+	// Elements crossed by the rays of UpdateFreeSpace and where no point landed, as sorted PackIndices keys
+	void GetFreeSpace(double ox, double oy, const std::vector<cv::Point2f> &hits, std::vector<long long> &freeKeys) const;
 	cv::Mat* getMat();
+	// Index over the whole map of the element (0, 0) of the final matrix
+	cv::Point2i getMatOrigin()	{return cv::Point2i(m_OldMinCellRow*int(m_uiCellSize), m_OldMinCellColumn*int(m_uiCellSize));}
+	double getResolution()	{return m_dCellSize/m_uiCellSize;}
+
+	void SetStateThreshold(double dThreshold)	{m_dStateThreshold = dThreshold;}
+	// Blocks beyond dFineRadius meters of the robot are held at coarser levels, see ResolutionLevels.
+	// An element of a coarse block holds the mean of the free evidence of the elements it stands
+	// for, and the whole of their obstacle evidence (see GetCoarseLogOdd).
+	void SetAdaptiveResolution(double dFineRadius, int iMaxLevel)	{m_Levels.Set(dFineRadius, iMaxLevel);}
+	// Position of the robot for the levels of the blocks, once per scan
+	void SetFocus(double x, double y)	{m_Levels.SetFocus(x, y); m_pLastBlock = nullptr;}
+	// Returns the number of updates dropped on saturated elements since the last call
+	size_t TakeNumSkipped()	{size_t numSkipped = m_NumSkipped; m_NumSkipped = 0; return numSkipped;}
+	const std::vector<CellStateChange>& GetStateChanges()	{return m_vStateChanges;}
+	void ClearStateChanges()	{m_vStateChanges.clear();}
+
+	// Map sharing between robots
+	void SetTrackLocalChanges(bool bTrack)	{m_bTrackLocalChanges = bTrack;}
+	// Adds the log odds of the blocks changed locally since the last export to tiles, indexed by
+	// the PackIndices of the block, and resets them
+	void ExportLocalChanges(std::map<long long, MapTileData> &tiles);
+	// Adds the log odds of every block to tiles, so that fusing them into an empty map copies this one
+	void ExportBlocks(std::map<long long, MapTileData> &tiles) const;
+	// Adds the log odds of the tiles received from other robots, one block per thread.
+	// The state changes are recorded like those of the local updates.
+	void Fuse(const std::vector<const MapTileData*> &tiles);
 };
@@ -2,7 +2,6 @@
 #define MAPPING_H_INCLUDED
 
 #include <Eigen/Core>
-#include <tf/transform_listener.h>
 
 // Flags for the data contained in the matrix
 // Unknow & Traversable = Traversable
@@ -14,6 +13,24 @@ enum CellState
 	Unknown = 3	// Default state
 };
 
+// Integer division rounding towards -infinity, so that negative indices fall in the right block
+static inline int FloorDiv(int a, int b)
+{
+	return (a >= 0) ? a/b : -((-a+b-1)/b);
+}
+
+// Packs a pair of matrix element indices in a single sortable key
+static inline long long PackIndices(int x, int y)
+{
+	return (long long)(((unsigned long long)(unsigned int)x << 32) | (unsigned int)y);
+}
+
+static inline void UnpackIndices(long long key, int &x, int &y)
+{
+	x = int(key >> 32);
+	y = int((unsigned int)(key & 0xffffffff));
+}
+
 class Cell{
 public:
 	double x;
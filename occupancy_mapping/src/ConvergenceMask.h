@@ -0,0 +1,20 @@
+#pragma once
+
+#include <vector>
+#include <stddef.h>
+
+// One bit per element of a map block, set while the element is converged: the observations
+// which agree with it no longer change it, so the updates can drop them before any math.
+// An observation which contradicts the element clears its bit.
+class ConvergenceMask
+{
+protected:
+	std::vector<unsigned long long> m_vWords;
+
+public:
+	void Resize(size_t numElements)	{m_vWords.assign((numElements+63)/64, 0);}
+
+	inline bool Test(size_t k) const	{return (m_vWords[k >> 6] >> (k & 63)) & 1;}
+	inline void Set(size_t k)	{m_vWords[k >> 6] |= 1ULL << (k & 63);}
+	inline void Reset(size_t k)	{m_vWords[k >> 6] &= ~(1ULL << (k & 63));}
+};
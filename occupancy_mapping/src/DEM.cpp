@@ -6,9 +6,11 @@
 
 #include "DEM.h"
 #include "Cell.h"
+#include "DEMFileWriter.h"
+#include <float.h>
 #include <limits.h>
 #include <math.h>
-#include <fstream>
+#include <set>
 
 // We cap the maximum number of measures to update recursively their mean
 #define MAX_NUM_MEASURES        INT_MAX/2
@@ -18,20 +20,37 @@
 
 using namespace std;
 
-struct BlockMatrixData
+struct DEMBlock
 {
         //! Coordinates (m,n) of the block matrix in m_pFinalMatrix
         int m;
         int n;
+        // Level of detail (see ResolutionLevels) and elements per side of the matrices
+        int level;
+        int size;
         // Stores the mean and the variance of the height, which follows a normal distribution
         cv::Mat *pHeightMatrix;
         cv::Mat *pVarianceMatrix;
         // Stores the number of measurements for a given cell
         cv::Mat *pNumMeasurementsMatrix;
-
-        BlockMatrixData() : pHeightMatrix(nullptr), pVarianceMatrix(nullptr), pNumMeasurementsMatrix(nullptr)   {}
-
-        ~BlockMatrixData()
+        // Derived layers: height gradient norm and height variance over the 3x3 neighbourhood
+        cv::Mat *pSlopeMatrix;
+        cv::Mat *pRoughnessMatrix;
+        // True if the block is in m_vDirtyBlocks
+        bool bDirty;
+        // Sum and number of the heights measured locally since the last export, allocated on the first one
+        cv::Mat *pLocalSumMatrix;
+        cv::Mat *pLocalCountMatrix;
+        // True if the block is in m_vLocalBlocks
+        bool bLocalChanged;
+        // Elements with enough measurements that the heights close to theirs change nothing
+        ConvergenceMask converged;
+
+        DEMBlock() : level(0), size(0), pHeightMatrix(nullptr), pVarianceMatrix(nullptr), pNumMeasurementsMatrix(nullptr),
+                pSlopeMatrix(nullptr), pRoughnessMatrix(nullptr), bDirty(false),
+                pLocalSumMatrix(nullptr), pLocalCountMatrix(nullptr), bLocalChanged(false)   {}
+
+        ~DEMBlock()
         {
                 if(pHeightMatrix)
                         delete pHeightMatrix;
@@ -39,21 +58,30 @@ struct BlockMatrixData
                         delete pVarianceMatrix;
                 if(pNumMeasurementsMatrix)
                         delete pNumMeasurementsMatrix;
+                if(pSlopeMatrix)
+                        delete pSlopeMatrix;
+                if(pRoughnessMatrix)
+                        delete pRoughnessMatrix;
+                if(pLocalSumMatrix)
+                        delete pLocalSumMatrix;
+                if(pLocalCountMatrix)
+                        delete pLocalCountMatrix;
         }
 };
 
-DEM::DEM(double dCellSize, unsigned int uiCellSize, ros::NodeHandle &nh):
-        m_ImageTransport(nh),
-        m_dCellSize(dCellSize), m_uiCellSize(uiCellSize),
-        m_MinCellRow(INT_MAX), m_MaxCellRow(INT_MIN),
-        m_MinCellColumn(INT_MAX), m_MaxCellColumn(INT_MIN),
+DEM::DEM(double dCellSize, unsigned int uiCellSize):
         m_pFinalMatrix(nullptr),
         m_pFinalVarianceMatrix(nullptr),
+        m_pFinalSlopeMatrix(nullptr), m_pFinalRoughnessMatrix(nullptr),
+        m_bTrackLocalChanges(false),
+        m_pLastBlock(nullptr), m_iConvergedMeasurements(0), m_fConvergenceTolerance(0.0f), m_NumSkipped(0),
+        m_Levels(dCellSize, uiCellSize),
+        m_dCellSize(dCellSize), m_uiCellSize(uiCellSize),
+        m_MaxCellRow(INT_MIN), m_MinCellRow(INT_MAX),
+        m_MaxCellColumn(INT_MIN), m_MinCellColumn(INT_MAX),
         m_OldMaxCellRow(0), m_OldMinCellRow(0),
-        m_OldMaxCellColumn(0), m_OldMinCellColumn(0)
+        m_OldMaxCellColumn(0), m_OldMinCellColumn(0), m_bFinalMatricesShared(false)
 {
-        m_DEMPublisher = m_ImageTransport.advertise("dem",1);
-//        m_DEMCovPublisher = m_ImageTransport.advertise("dem_covariance",1);
 }
 
 DEM::~DEM()
@@ -64,35 +92,49 @@ DEM::~DEM()
                 delete m_pFinalMatrix;
         if(m_pFinalVarianceMatrix)
                 delete m_pFinalVarianceMatrix;
+        if(m_pFinalSlopeMatrix)
+                delete m_pFinalSlopeMatrix;
+        if(m_pFinalRoughnessMatrix)
+                delete m_pFinalRoughnessMatrix;
 }
 
-void DEM::PublishToFile()
+bool DEM::Compose()
 {
         if(m_MinCellRow == INT_MAX || m_MaxCellRow == INT_MIN || m_MinCellColumn == INT_MAX || m_MaxCellColumn == INT_MIN)
-                return;
+                return false;
 
         int numRows = (m_MaxCellRow-m_MinCellRow+1)*m_uiCellSize;
         int numColumns = (m_MaxCellColumn-m_MinCellColumn+1)*m_uiCellSize;
 
-        if(((m_MinCellColumn != m_OldMinCellColumn) || (m_MaxCellRow != m_OldMaxCellRow) || (m_MinCellRow != m_OldMinCellRow) || (m_MaxCellColumn != m_OldMaxCellColumn)))
+        if(!m_pFinalMatrix || m_bFinalMatricesShared || ((m_MinCellColumn != m_OldMinCellColumn) || (m_MaxCellRow != m_OldMaxCellRow) || (m_MinCellRow != m_OldMinCellRow) || (m_MaxCellColumn != m_OldMaxCellColumn)))
         {
                 m_OldMaxCellRow = m_MaxCellRow;
                 m_OldMinCellColumn = m_MinCellColumn;
                 m_OldMinCellRow = m_MinCellRow;
                 m_OldMaxCellColumn = m_MaxCellColumn;
+                m_bFinalMatricesShared = false;
 
+                // Shared matrices live on in their other headers
                 if(m_pFinalMatrix)
                         delete m_pFinalMatrix;
                 if(m_pFinalVarianceMatrix)
                         delete m_pFinalVarianceMatrix;
+                if(m_pFinalSlopeMatrix)
+                        delete m_pFinalSlopeMatrix;
+                if(m_pFinalRoughnessMatrix)
+                        delete m_pFinalRoughnessMatrix;
                 m_pFinalMatrix =  new cv::Mat(numRows,numColumns,CV_32F);
                 m_pFinalVarianceMatrix =  new cv::Mat(numRows,numColumns,CV_32F);
+                m_pFinalSlopeMatrix =  new cv::Mat(numRows,numColumns,CV_32F);
+                m_pFinalRoughnessMatrix =  new cv::Mat(numRows,numColumns,CV_32F);
                 for(int i = 0; i < numRows; i++)
                 {
                         for(int j = 0; j < numColumns; j++)
                         {
-                                m_pFinalMatrix->at<float>(i, j) = 0.0f;
+                                m_pFinalMatrix->at<float>(i, j) = FLT_MIN;
                                 m_pFinalVarianceMatrix->at<float>(i, j) = 0.0f;
+                                m_pFinalSlopeMatrix->at<float>(i, j) = 0.0f;
+                                m_pFinalRoughnessMatrix->at<float>(i, j) = 0.0f;
                         }
                 }
         }
@@ -108,106 +150,69 @@ void DEM::PublishToFile()
                         {
                                 int m = int(it->second->m-m_MinCellRow)*m_uiCellSize+i;
                                 int n = int(it->second->n-m_MinCellColumn)*m_uiCellSize+j;
-                                m_pFinalMatrix->at<float>(m, n) = it->second->pHeightMatrix->at<float>(i, j);
-                                m_pFinalVarianceMatrix->at<float>(m, n) = it->second->pVarianceMatrix->at<float>(i, j);
+                                int level = it->second->level;
+                                m_pFinalMatrix->at<float>(m, n) = it->second->pHeightMatrix->at<float>(i >> level, j >> level);
+                                m_pFinalVarianceMatrix->at<float>(m, n) = it->second->pVarianceMatrix->at<float>(i >> level, j >> level);
+                                m_pFinalSlopeMatrix->at<float>(m, n) = it->second->pSlopeMatrix->at<float>(i >> level, j >> level);
+                                m_pFinalRoughnessMatrix->at<float>(m, n) = it->second->pRoughnessMatrix->at<float>(i >> level, j >> level);
                         }
                 }
         }
-        std::ofstream out("/tmp/DME.txt", std::ios_base::ate);
-        for(int i = 0; i < numRows; i++)
-        {
-                for(int j = 0; j < numColumns; j++)
-                        out << double(i)*m_dCellSize << " " << double(j)*m_dCellSize << " " << m_pFinalMatrix->at<float>(i, j) << " " << m_pFinalVarianceMatrix->at<float>(i, j) << std::endl;
-        }
-        out.close();
+        return true;
 }
 
-void DEM::PublishImage(){
-        if(m_MinCellRow == INT_MAX || m_MaxCellRow == INT_MIN || m_MinCellColumn == INT_MAX || m_MaxCellColumn == INT_MIN)
-                return;
-
-        int numRows = (m_MaxCellRow-m_MinCellRow+1)*m_uiCellSize;
-        int numColumns = (m_MaxCellColumn-m_MinCellColumn+1)*m_uiCellSize;
-
-        if(((m_MinCellColumn != m_OldMinCellColumn) || (m_MaxCellRow != m_OldMaxCellRow) || (m_MinCellRow != m_OldMinCellRow) || (m_MaxCellColumn != m_OldMaxCellColumn)))
-        {
-                m_OldMaxCellRow = m_MaxCellRow;
-                m_OldMinCellColumn = m_MinCellColumn;
-                m_OldMinCellRow = m_MinCellRow;
-                m_OldMaxCellColumn = m_MaxCellColumn;
+bool DEM::PublishToFile(const std::string &path)
+{
+        if(!Compose())
+                return false;
+        DEMFileData data;
+        data.resolution = getResolution();
+        data.originX = getMatOrigin().x*data.resolution;
+        data.originY = getMatOrigin().y*data.resolution;
+        data.names.push_back("height");
+        data.layers.push_back(*m_pFinalMatrix);
+        data.names.push_back("variance");
+        data.layers.push_back(*m_pFinalVarianceMatrix);
+        data.names.push_back("slope");
+        data.layers.push_back(*m_pFinalSlopeMatrix);
+        data.names.push_back("roughness");
+        data.layers.push_back(*m_pFinalRoughnessMatrix);
+        return DEMFileWriter::Write(path, data);
+}
 
-                if(m_pFinalMatrix)
-                        delete m_pFinalMatrix;
-                if(m_pFinalVarianceMatrix)
-                        delete m_pFinalVarianceMatrix;
-                m_pFinalMatrix =  new cv::Mat(numRows,numColumns,CV_32F);
-                m_pFinalVarianceMatrix =  new cv::Mat(numRows,numColumns,CV_32F);
-                for(int i = 0; i < numRows; i++)
-                {
-                        for(int j = 0; j < numColumns; j++)
-                        {
-                                m_pFinalMatrix->at<float>(i, j) = 0.0f;
-                                m_pFinalVarianceMatrix->at<float>(i, j) = 0.0f;
-                        }
-                }
-        }
+bool DEM::ComposeImage(cv::Mat &image){
+        if(!Compose())
+                return false;
+        ColorImage(*m_pFinalMatrix, image);
+        return true;
+}
 
-        // Copy the data from m_CellMap
-        // Note that the image has the Y axis inverted so we invert the rows in the final matrix
-        // to restore the correct orientation
-        for(auto it = m_CellMap.begin(); it != m_CellMap.end(); it++)
-        {
-                for(int i = 0; i < m_uiCellSize; i++)
-                {
-                        for(int j = 0; j < m_uiCellSize; j++)
-                        {
-                                int m = int(it->second->m-m_MinCellRow)*m_uiCellSize+i;
-                                int n = int(it->second->n-m_MinCellColumn)*m_uiCellSize+j;
-                                m_pFinalMatrix->at<float>(m, n) = it->second->pHeightMatrix->at<float>(i, j);
-                                m_pFinalVarianceMatrix->at<float>(m, n) = it->second->pVarianceMatrix->at<float>(i, j);
-                        }
-                }
-        }
+void DEM::ColorImage(const cv::Mat &height, cv::Mat &image)
+{
+        int numRows = height.rows;
+        int numColumns = height.cols;
 
         auto DEMImage = cv::Mat(numRows,numColumns,CV_32S);
-        auto DEMCovImage = cv::Mat(numRows, numColumns, CV_32S);
         // Prepare the colors before publishing the cvMat as an image
         for(int i = 0; i < numRows; i++)
         {
                 for(int j = 0; j < numColumns; j++)
                 {
                         // Compute the probability associated with the log odd
-                        double p = 1.0f-1.0f/(1.0f+exp(m_pFinalMatrix->at<float>(i, j)));
+                        double p = 1.0f-1.0f/(1.0f+exp(height.at<float>(i, j)));
                         // p close to 1 means that the certainty that the cell is traversable is very high.
                         // We return a color close to 255 (white) for such values.
-                        //ROS_INFO("%f",m_pFinalMatrix->at<float>(i, j));
+                        //ROS_INFO("%f",height.at<float>(i, j));
                         int color=int(p*255.0);
                         //ROS_INFO("%f %d", p, color);
                         int finalColor = color;
                         finalColor |= (color << 8);
                         finalColor |= (color << 16);
                         DEMImage.at<int>(i, j) =  finalColor;
-
-                        // Covariance image
-                        double pCov = 1.0f-1.0f/(1.0f+exp(m_pFinalVarianceMatrix->at<float>(i, j)));
-                        int colorCov = int(p*255.0);
-                        int finalColorCov = colorCov;
-                        finalColorCov |= (color << 8);
-                        finalColorCov |= (color << 16);
-                        DEMCovImage.at<int>(i,j) = finalColorCov;
                 }
         }
 
-        cv_bridge::CvImage out_msg;
-        out_msg.encoding = "rgba8";
-        out_msg.image    = DEMImage;
-
-        cv_bridge::CvImage out_msg_cov;
-        out_msg.encoding = "rgba8";
-        out_msg.image    = DEMCovImage;
-
-        m_DEMPublisher.publish(out_msg.toImageMsg());
-//        m_DEMCovPublisher.publish(out_msg_cov.toImageMsg());
+        image = DEMImage;
 }
 
 // Squared exponential kernel function
@@ -223,18 +228,18 @@ static float Mean(float newValue, float previousMean, int numMeasurements)
         return (float(numMeasurements)/(numMeasurements+1))*previousMean+newValue/(numMeasurements+1);
 }
 
-void DEM::Update(double x, double y, double data)
+// Share of count measurements of an element standing for whole full resolution elements, credited
+// to part of them, at least one if there was any
+static int SplitCount(int count, int part, int whole)
 {
-        int i, j;
-        i = floor(double(x)/m_dCellSize);
-        j = floor(double(y)/m_dCellSize);
-
-        m_MaxCellRow = std::max(m_MaxCellRow, i);
-        m_MinCellRow = std::min(m_MinCellRow, i);
-        m_MaxCellColumn = std::max(m_MaxCellColumn, j);
-        m_MinCellColumn = std::min(m_MinCellColumn, j);
+        if(count <= 0)
+                return 0;
+        return std::max(int((long long)count*part/whole), 1);
+}
 
-        // Compute the bijection between Z^2 and N
+// Bijection between Z^2 and N
+static inline int BlockIndex(int i, int j)
+{
         int f_i, f_j;
         if(i < 0)
                 f_i = -2*i-1;
@@ -244,43 +249,162 @@ void DEM::Update(double x, double y, double data)
                 f_j = -2*j-1;
         else
                 f_j = 2*j;
-        int idx = ((f_i+f_j)*(f_i+f_j)+f_i+3*f_j)/2;
+        return ((f_i+f_j)*(f_i+f_j)+f_i+3*f_j)/2;
+}
+
+DEMBlock* DEM::FindBlock(int i, int j)
+{
+        auto it = m_CellMap.find(BlockIndex(i, j));
+        if(it == m_CellMap.end())
+                return nullptr;
+        return it->second;
+}
+
+DEMBlock* DEM::GetBlock(int i, int j)
+{
+        m_MaxCellRow = std::max(m_MaxCellRow, i);
+        m_MinCellRow = std::min(m_MinCellRow, i);
+        m_MaxCellColumn = std::max(m_MaxCellColumn, j);
+        m_MinCellColumn = std::min(m_MinCellColumn, j);
+
+        int idx = BlockIndex(i, j);
 
         // Fills in the new data
         auto it = m_CellMap.find(idx);
-        BlockMatrixData *pData;
+        DEMBlock *pData;
+        int level = m_Levels.GetLevel(i, j);
         if(it == m_CellMap.end())
         {
-                pData = new BlockMatrixData;
+                pData = new DEMBlock;
                 pData->m = i;
                 pData->n = j;
-                pData->pHeightMatrix = new cv::Mat(m_uiCellSize,m_uiCellSize,CV_32F);
-                pData->pVarianceMatrix = new cv::Mat(m_uiCellSize,m_uiCellSize,CV_32F);
-                pData->pNumMeasurementsMatrix = new cv::Mat(m_uiCellSize,m_uiCellSize,CV_32S);
-
-                for(int i = 0; i < m_uiCellSize; i++)
+                pData->level = level;
+                pData->size = ResolutionLevels::GetSize(m_uiCellSize, level);
+                pData->pHeightMatrix = new cv::Mat(pData->size,pData->size,CV_32F);
+                pData->pVarianceMatrix = new cv::Mat(pData->size,pData->size,CV_32F);
+                pData->pNumMeasurementsMatrix = new cv::Mat(pData->size,pData->size,CV_32S);
+                pData->pSlopeMatrix = new cv::Mat(pData->size,pData->size,CV_32F);
+                pData->pRoughnessMatrix = new cv::Mat(pData->size,pData->size,CV_32F);
+
+                for(int i = 0; i < pData->size; i++)
                 {
-                        for(int j = 0; j < m_uiCellSize; j++)
+                        for(int j = 0; j < pData->size; j++)
                         {
                                 pData->pHeightMatrix->at<float>(i,j)=FLT_MIN;
                                 pData->pVarianceMatrix->at<float>(i,j)=SIGMA_2;
                                 pData->pNumMeasurementsMatrix->at<int>(i,j)=0;
+                                pData->pSlopeMatrix->at<float>(i,j)=0.0f;
+                                pData->pRoughnessMatrix->at<float>(i,j)=0.0f;
                         }
                 }
+                pData->converged.Resize(pData->size*pData->size);
                 m_CellMap[idx] = pData;
         }
         else
+        {
                 pData = it->second;
+                if(level < pData->level)
+                        Refine(pData, level);
+        }
+        return pData;
+}
+
+void DEM::Refine(DEMBlock *pData, int level)
+{
+        int shift = pData->level-level;
+        int size = ResolutionLevels::GetSize(m_uiCellSize, level);
+        cv::Mat *pHeightMatrix = new cv::Mat(size,size,CV_32F);
+        cv::Mat *pVarianceMatrix = new cv::Mat(size,size,CV_32F);
+        cv::Mat *pNumMeasurementsMatrix = new cv::Mat(size,size,CV_32S);
+        cv::Mat *pSlopeMatrix = new cv::Mat(size,size,CV_32F);
+        cv::Mat *pRoughnessMatrix = new cv::Mat(size,size,CV_32F);
+        bool bLocal = pData->pLocalSumMatrix != nullptr;
+        cv::Mat *pLocalSumMatrix = bLocal ? new cv::Mat(size,size,CV_32F) : nullptr;
+        cv::Mat *pLocalCountMatrix = bLocal ? new cv::Mat(size,size,CV_32S) : nullptr;
+        for(int m = 0; m < size; m++)
+        {
+                for(int n = 0; n < size; n++)
+                {
+                        int mc = m >> shift;
+                        int nc = n >> shift;
+                        pHeightMatrix->at<float>(m,n) = pData->pHeightMatrix->at<float>(mc,nc);
+                        pVarianceMatrix->at<float>(m,n) = pData->pVarianceMatrix->at<float>(mc,nc);
+                        pSlopeMatrix->at<float>(m,n) = pData->pSlopeMatrix->at<float>(mc,nc);
+                        pRoughnessMatrix->at<float>(m,n) = pData->pRoughnessMatrix->at<float>(mc,nc);
+                        // The measurements of the coarse element are shared by the finer ones
+                        int part = ResolutionLevels::GetCoverage(m_uiCellSize, level, m)*ResolutionLevels::GetCoverage(m_uiCellSize, level, n);
+                        int whole = ResolutionLevels::GetCoverage(m_uiCellSize, pData->level, mc)*ResolutionLevels::GetCoverage(m_uiCellSize, pData->level, nc);
+                        pNumMeasurementsMatrix->at<int>(m,n) = SplitCount(pData->pNumMeasurementsMatrix->at<int>(mc,nc), part, whole);
+                        if(bLocal)
+                        {
+                                int count = pData->pLocalCountMatrix->at<int>(mc,nc);
+                                int share = SplitCount(count, part, whole);
+                                pLocalCountMatrix->at<int>(m,n) = share;
+                                pLocalSumMatrix->at<float>(m,n) = (count > 0) ? pData->pLocalSumMatrix->at<float>(mc,nc)*share/count : 0.0f;
+                        }
+                }
+        }
+        delete pData->pHeightMatrix;
+        delete pData->pVarianceMatrix;
+        delete pData->pNumMeasurementsMatrix;
+        delete pData->pSlopeMatrix;
+        delete pData->pRoughnessMatrix;
+        pData->pHeightMatrix = pHeightMatrix;
+        pData->pVarianceMatrix = pVarianceMatrix;
+        pData->pNumMeasurementsMatrix = pNumMeasurementsMatrix;
+        pData->pSlopeMatrix = pSlopeMatrix;
+        pData->pRoughnessMatrix = pRoughnessMatrix;
+        if(bLocal)
+        {
+                delete pData->pLocalSumMatrix;
+                delete pData->pLocalCountMatrix;
+                pData->pLocalSumMatrix = pLocalSumMatrix;
+                pData->pLocalCountMatrix = pLocalCountMatrix;
+        }
+        pData->level = level;
+        pData->size = size;
+        // The finer elements converge again on their own measurements
+        pData->converged.Resize(size*size);
+        if(!pData->bDirty)
+        {
+                pData->bDirty = true;
+                m_vDirtyBlocks.push_back(pData);
+        }
+}
 
-        // Take the decimal part of x and y
-        // For negative value it will take 1-decimal part
-        double _01x = x-double(i)*m_dCellSize;
-        double _01y = y-double(j)*m_dCellSize;
-        // Convert to cvMat row and column
-        int m = int(_01x*m_uiCellSize);
-        int n = int(_01y*m_uiCellSize);
+void DEM::Update(double x, double y, double data)
+{
+        int cellX = ConvertWorldCoordToIndex(x);
+        int cellY = ConvertWorldCoordToIndex(y);
+        int i = FloorDiv(cellX, m_uiCellSize);
+        int j = FloorDiv(cellY, m_uiCellSize);
+        DEMBlock *pData = m_pLastBlock;
+        if(!pData || pData->m != i || pData->n != j)
+                pData = m_pLastBlock = GetBlock(i, j);
+
+        // Convert to cvMat row and column, an element of a coarse block taking the heights of its whole area
+        int m = (cellX-i*int(m_uiCellSize)) >> pData->level;
+        int n = (cellY-j*int(m_uiCellSize)) >> pData->level;
         // Previous height stored before measuring data
         float &fHeight = pData->pHeightMatrix->at<float>(m, n);
+        // A converged element only moves by a fraction of the heights close to its own, so these
+        // are dropped before the update. A height too far from it re-arms the element.
+        int k = m*pData->size+n;
+        bool bAgrees = fabs(data-fHeight) <= m_fConvergenceTolerance;
+        if(pData->converged.Test(k))
+        {
+                if(bAgrees)
+                {
+                        m_NumSkipped++;
+                        return;
+                }
+                pData->converged.Reset(k);
+        }
+        if(!pData->bDirty)
+        {
+                pData->bDirty = true;
+                m_vDirtyBlocks.push_back(pData);
+        }
         float &fVariance = pData->pVarianceMatrix->at<float>(m,n);
         float fCorrelationCoefficient = Covariance(data,fHeight, SIGMA_2, fVariance);
         int &numMeasurements = pData->pNumMeasurementsMatrix->at<int>(m,n);
@@ -293,6 +417,311 @@ void DEM::Update(double x, double y, double data)
         //fVariance = SIGMA_2*(1-fCorrelationCoefficient*fCorrelationCoefficient);
         numMeasurements = std::min(numMeasurements+1,MAX_NUM_MEASURES);
         fVariance = 1/(fVariance*fVariance+numMeasurements/SIGMA_2);
+        // Converged once enough heights agreed, the variance shrinking with their number
+        if(m_iConvergedMeasurements > 0 && bAgrees && numMeasurements >= m_iConvergedMeasurements)
+                pData->converged.Set(k);
+
+        if(m_bTrackLocalChanges)
+        {
+                if(!pData->pLocalSumMatrix)
+                {
+                        pData->pLocalSumMatrix = new cv::Mat(cv::Mat::zeros(pData->size,pData->size,CV_32F));
+                        pData->pLocalCountMatrix = new cv::Mat(cv::Mat::zeros(pData->size,pData->size,CV_32S));
+                }
+                pData->pLocalSumMatrix->at<float>(m,n) += data;
+                pData->pLocalCountMatrix->at<int>(m,n) += 1;
+                if(!pData->bLocalChanged)
+                {
+                        pData->bLocalChanged = true;
+                        m_vLocalBlocks.push_back(pData);
+                }
+        }
+}
+
+void DEM::ExportLocalChanges(std::map<long long, MapTileData> &tiles)
+{
+        const int N = m_uiCellSize;
+        for(size_t k = 0; k < m_vLocalBlocks.size(); k++)
+        {
+                DEMBlock *pData = m_vLocalBlocks[k];
+                MapTileData &tile = tiles[PackIndices(pData->m, pData->n)];
+                tile.i = pData->m;
+                tile.j = pData->n;
+                tile.height.assign(N*N, FLT_MIN);
+                tile.variance.assign(N*N, 0.0f);
+                tile.numMeasurements.assign(N*N, 0);
+                const int level = pData->level;
+                for(int m = 0; m < N; m++)
+                {
+                        for(int n = 0; n < N; n++)
+                        {
+                                int count = pData->pLocalCountMatrix->at<int>(m >> level,n >> level);
+                                if(count == 0)
+                                        continue;
+                                float height = pData->pLocalSumMatrix->at<float>(m >> level,n >> level)/count;
+                                // The tiles are at full resolution, each element of a coarse one
+                                // receiving its share of the measurements
+                                count = SplitCount(count, 1, ResolutionLevels::GetCoverage(N, level, m >> level)*ResolutionLevels::GetCoverage(N, level, n >> level));
+                                // Mean of count measurements of variance SIGMA_2
+                                tile.height[m*N+n] = height;
+                                tile.variance[m*N+n] = SIGMA_2/count;
+                                tile.numMeasurements[m*N+n] = count;
+                        }
+                }
+                pData->pLocalSumMatrix->setTo(cv::Scalar(0));
+                pData->pLocalCountMatrix->setTo(cv::Scalar(0));
+                pData->bLocalChanged = false;
+        }
+        m_vLocalBlocks.clear();
+}
+
+void DEM::ExportBlocks(std::map<long long, MapTileData> &tiles) const
+{
+        const int N = m_uiCellSize;
+        for(auto it = m_CellMap.begin(); it != m_CellMap.end(); it++)
+        {
+                const DEMBlock *pData = it->second;
+                MapTileData &tile = tiles[PackIndices(pData->m, pData->n)];
+                tile.i = pData->m;
+                tile.j = pData->n;
+                const int level = pData->level;
+                tile.height.resize(N*N);
+                tile.variance.resize(N*N);
+                tile.numMeasurements.resize(N*N);
+                ResolutionLevels::Expand(*pData->pHeightMatrix, level, N, &tile.height[0]);
+                ResolutionLevels::Expand(*pData->pVarianceMatrix, level, N, &tile.variance[0]);
+                ResolutionLevels::Expand(*pData->pNumMeasurementsMatrix, level, N, &tile.numMeasurements[0]);
+                if(level > 0)
+                {
+                        for(int m = 0; m < N; m++)
+                        {
+                                for(int n = 0; n < N; n++)
+                                        tile.numMeasurements[m*N+n] = SplitCount(tile.numMeasurements[m*N+n], 1,
+                                                ResolutionLevels::GetCoverage(N, level, m >> level)*ResolutionLevels::GetCoverage(N, level, n >> level));
+                        }
+                }
+        }
+}
+
+void DEM::FuseBlock(DEMBlock *pData, const MapTileData &tile) const
+{
+        // The tiles are at full resolution, an element of a coarse block fusing the heights of all its elements
+        const int N = m_uiCellSize;
+        const int level = pData->level;
+        for(int m = 0; m < N; m++)
+        {
+                for(int n = 0; n < N; n++)
+                {
+                        int count = tile.numMeasurements[m*N+n];
+                        float fVarianceIn = tile.variance[m*N+n];
+                        if(count <= 0 || fVarianceIn <= 0.0f)
+                                continue;
+                        float &fHeight = pData->pHeightMatrix->at<float>(m >> level,n >> level);
+                        float &fVariance = pData->pVarianceMatrix->at<float>(m >> level,n >> level);
+                        int &numMeasurements = pData->pNumMeasurementsMatrix->at<int>(m >> level,n >> level);
+                        if(fHeight == FLT_MIN)
+                        {
+                                fHeight = tile.height[m*N+n];
+                                fVariance = fVarianceIn;
+                        }
+                        else
+                        {
+                                float w = 1.0f/fVariance;
+                                float wIn = 1.0f/fVarianceIn;
+                                fHeight = (w*fHeight+wIn*tile.height[m*N+n])/(w+wIn);
+                                fVariance = 1.0f/(w+wIn);
+                        }
+                        numMeasurements = std::min(numMeasurements+count,MAX_NUM_MEASURES);
+                }
+        }
+}
+
+// Fuses tiles in parallel, each tile going to a different block
+class DEMBlockFusion : public cv::ParallelLoopBody
+{
+        const DEM &m_DEM;
+        const std::vector<DEMBlock*> &m_vBlocks;
+        const std::vector<const MapTileData*> &m_vTiles;
+
+public:
+        DEMBlockFusion(const DEM &dem, const std::vector<DEMBlock*> &blocks, const std::vector<const MapTileData*> &tiles) :
+                m_DEM(dem), m_vBlocks(blocks), m_vTiles(tiles)  {}
+
+        virtual void operator()(const cv::Range &range) const
+        {
+                for(int k = range.start; k < range.end; k++)
+                        m_DEM.FuseBlock(m_vBlocks[k], *m_vTiles[k]);
+        }
+};
+
+void DEM::Fuse(const std::vector<const MapTileData*> &tiles)
+{
+        const size_t N2 = m_uiCellSize*m_uiCellSize;
+        std::vector<const MapTileData*> remaining;
+        for(size_t k = 0; k < tiles.size(); k++)
+        {
+                if(tiles[k]->height.size() == N2 && tiles[k]->variance.size() == N2 && tiles[k]->numMeasurements.size() == N2)
+                        remaining.push_back(tiles[k]);
+        }
+        // The blocks are created and marked dirty beforehand since the block map cannot be modified
+        // concurrently. Tiles of the same block are fused in successive passes.
+        while(!remaining.empty())
+        {
+                std::vector<const MapTileData*> batch;
+                std::vector<const MapTileData*> duplicates;
+                std::vector<DEMBlock*> blocks;
+                std::set<long long> keys;
+                for(size_t k = 0; k < remaining.size(); k++)
+                {
+                        if(!keys.insert(PackIndices(remaining[k]->i, remaining[k]->j)).second)
+                        {
+                                duplicates.push_back(remaining[k]);
+                                continue;
+                        }
+                        DEMBlock *pData = GetBlock(remaining[k]->i, remaining[k]->j);
+                        if(!pData->bDirty)
+                        {
+                                pData->bDirty = true;
+                                m_vDirtyBlocks.push_back(pData);
+                        }
+                        batch.push_back(remaining[k]);
+                        blocks.push_back(pData);
+                }
+                cv::parallel_for_(cv::Range(0, int(batch.size())), DEMBlockFusion(*this, blocks, batch));
+                remaining.swap(duplicates);
+        }
+}
+
+void DEM::ComputeDerivedLayers(DEMBlock *pData, int r0, int r1, int c0, int c1)
+{
+        const int N = m_uiCellSize;
+        const int S = pData->size;
+        const int P = S+2;
+        const int level = pData->level;
+        const float fResolution = float(m_dCellSize/m_uiCellSize)*(1 << level);
+
+        // Heights of the block with a one element border taken from the neighbour blocks.
+        // Unknown heights get a null weight.
+        std::vector<float> height(P*P, 0.0f);
+        std::vector<float> weight(P*P, 0.0f);
+        for(int di = -1; di <= 1; di++)
+        {
+                for(int dj = -1; dj <= 1; dj++)
+                {
+                        DEMBlock *pBlock = (di == 0 && dj == 0) ? pData : FindBlock(pData->m+di, pData->n+dj);
+                        if(!pBlock)
+                                continue;
+                        // Range of the padded patch covered by this block
+                        int pr0 = (di < 0) ? 0 : ((di == 0) ? 1 : S+1);
+                        int pr1 = (di < 0) ? 1 : ((di == 0) ? S+1 : S+2);
+                        int pc0 = (dj < 0) ? 0 : ((dj == 0) ? 1 : S+1);
+                        int pc1 = (dj < 0) ? 1 : ((dj == 0) ? S+1 : S+2);
+                        // The neighbours may be at other levels, so the border is read through the
+                        // full resolution element next to this block
+                        for(int pr = pr0; pr < pr1; pr++)
+                        {
+                                int fr = (di < 0) ? N-1 : ((di == 0) ? (pr-1) << level : 0);
+                                const float *src = pBlock->pHeightMatrix->ptr<float>(fr >> pBlock->level);
+                                for(int pc = pc0; pc < pc1; pc++)
+                                {
+                                        int fc = (dj < 0) ? N-1 : ((dj == 0) ? (pc-1) << level : 0);
+                                        float h = src[fc >> pBlock->level];
+                                        height[pr*P+pc] = (h == FLT_MIN) ? 0.0f : h;
+                                        weight[pr*P+pc] = (h == FLT_MIN) ? 0.0f : 1.0f;
+                                }
+                        }
+                }
+        }
+
+        // Central differences where both neighbours are known, one sided differences otherwise,
+        // and weighted variance over the 3x3 neighbourhood. The inner loop has no branch so
+        // that it can be vectorised.
+        for(int r = r0; r < r1; r++)
+        {
+                const float *hN = &height[r*P+1];
+                const float *hC = &height[(r+1)*P+1];
+                const float *hS = &height[(r+2)*P+1];
+                const float *wN = &weight[r*P+1];
+                const float *wC = &weight[(r+1)*P+1];
+                const float *wS = &weight[(r+2)*P+1];
+                float *slope = pData->pSlopeMatrix->ptr<float>(r);
+                float *roughness = pData->pRoughnessMatrix->ptr<float>(r);
+                for(int c = c0; c < c1; c++)
+                {
+                        float h = hC[c];
+                        float w = wC[c];
+                        // Missing neighbours are replaced by the center
+                        float hUp = wN[c]*hN[c]+(1.0f-wN[c])*h;
+                        float hDown = wS[c]*hS[c]+(1.0f-wS[c])*h;
+                        float hLeft = wC[c-1]*hC[c-1]+(1.0f-wC[c-1])*h;
+                        float hRight = wC[c+1]*hC[c+1]+(1.0f-wC[c+1])*h;
+                        float spanRows = std::max(wN[c]+wS[c], 1.0f)*fResolution;
+                        float spanColumns = std::max(wC[c-1]+wC[c+1], 1.0f)*fResolution;
+                        float gradRows = (hDown-hUp)/spanRows;
+                        float gradColumns = (hRight-hLeft)/spanColumns;
+                        slope[c] = w*sqrtf(gradRows*gradRows+gradColumns*gradColumns);
+
+                        float sumW = wN[c-1]+wN[c]+wN[c+1]+wC[c-1]+w+wC[c+1]+wS[c-1]+wS[c]+wS[c+1];
+                        float sumH = wN[c-1]*hN[c-1]+wN[c]*hN[c]+wN[c+1]*hN[c+1]
+                                +wC[c-1]*hC[c-1]+w*h+wC[c+1]*hC[c+1]
+                                +wS[c-1]*hS[c-1]+wS[c]*hS[c]+wS[c+1]*hS[c+1];
+                        float sumH2 = wN[c-1]*hN[c-1]*hN[c-1]+wN[c]*hN[c]*hN[c]+wN[c+1]*hN[c+1]*hN[c+1]
+                                +wC[c-1]*hC[c-1]*hC[c-1]+w*h*h+wC[c+1]*hC[c+1]*hC[c+1]
+                                +wS[c-1]*hS[c-1]*hS[c-1]+wS[c]*hS[c]*hS[c]+wS[c+1]*hS[c+1]*hS[c+1];
+                        float mean = sumH/std::max(sumW, 1.0f);
+                        roughness[c] = w*std::max(sumH2/std::max(sumW, 1.0f)-mean*mean, 0.0f);
+                }
+        }
+}
+
+void DEM::UpdateDerivedLayers()
+{
+        for(size_t k = 0; k < m_vDirtyBlocks.size(); k++)
+        {
+                DEMBlock *pData = m_vDirtyBlocks[k];
+                ComputeDerivedLayers(pData, 0, pData->size, 0, pData->size);
+                // Only the elements of the neighbours along the border depend on this block
+                for(int di = -1; di <= 1; di++)
+                {
+                        for(int dj = -1; dj <= 1; dj++)
+                        {
+                                if(di == 0 && dj == 0)
+                                        continue;
+                                DEMBlock *pBlock = FindBlock(pData->m+di, pData->n+dj);
+                                if(!pBlock || pBlock->bDirty)
+                                        continue;
+                                const int N = pBlock->size;
+                                int r0 = (di > 0) ? 0 : ((di == 0) ? 0 : N-1);
+                                int r1 = (di > 0) ? 1 : N;
+                                int c0 = (dj > 0) ? 0 : ((dj == 0) ? 0 : N-1);
+                                int c1 = (dj > 0) ? 1 : N;
+                                ComputeDerivedLayers(pBlock, r0, r1, c0, c1);
+                        }
+                }
+        }
+        for(size_t k = 0; k < m_vDirtyBlocks.size(); k++)
+                m_vDirtyBlocks[k]->bDirty = false;
+        m_vDirtyBlocks.clear();
+}
+
+bool DEM::Lookup(double x, double y, float &height, float &variance, float &slope, float &roughness)
+{
+        int cellX = ConvertWorldCoordToIndex(x);
+        int cellY = ConvertWorldCoordToIndex(y);
+        int i = FloorDiv(cellX, m_uiCellSize);
+        int j = FloorDiv(cellY, m_uiCellSize);
+        DEMBlock *pData = FindBlock(i, j);
+        if(!pData)
+                return false;
+        int m = (cellX-i*int(m_uiCellSize)) >> pData->level;
+        int n = (cellY-j*int(m_uiCellSize)) >> pData->level;
+        height = pData->pHeightMatrix->at<float>(m, n);
+        if(height == FLT_MIN)
+                return false;
+        variance = pData->pVarianceMatrix->at<float>(m, n);
+        slope = pData->pSlopeMatrix->at<float>(m, n);
+        roughness = pData->pRoughnessMatrix->at<float>(m, n);
+        return true;
 }
 
 cv::Mat* DEM::getMat(){
@@ -302,3 +731,24 @@ cv::Mat* DEM::getMat(){
 cv::Mat* DEM::getVarMat(){
         return this->m_pFinalVarianceMatrix;
 }
+
+void DEM::ShareMats(cv::Mat &height, cv::Mat &variance)
+{
+        if(!m_pFinalMatrix)
+        {
+                height = cv::Mat();
+                variance = cv::Mat();
+                return;
+        }
+        m_bFinalMatricesShared = true;
+        height = *m_pFinalMatrix;
+        variance = *m_pFinalVarianceMatrix;
+}
+
+cv::Mat* DEM::getSlopeMat(){
+        return this->m_pFinalSlopeMatrix;
+}
+
+cv::Mat* DEM::getRoughnessMat(){
+        return this->m_pFinalRoughnessMatrix;
+}
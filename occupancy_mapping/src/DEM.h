@@ -1,34 +1,50 @@
 #pragma once
 
-#include <ros/ros.h>
-#include <sensor_msgs/Image.h>
-#include <sensor_msgs/image_encodings.h>
-#include <image_transport/image_transport.h>
-#include <cv_bridge/cv_bridge.h>
-#include <opencv2/imgproc/imgproc.hpp>
-#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/core/core.hpp>
 #include <map>
+#include <string>
+#include <vector>
 #include <math.h>
+#include "ConvergenceMask.h"
+#include "MapTile.h"
+#include "ResolutionLevels.h"
 
 #define nullptr 0
 
 
 // Stores the block matrix row/column for easier access
-struct BlockMatrixData;
+struct DEMBlock;
 
 class DEM
 {
 protected:
-        image_transport::ImageTransport m_ImageTransport;
-        image_transport::Publisher m_DEMPublisher;
-        image_transport::Publisher m_DEMCovPublisher;
-
         // Map = Cells. Cells = Fixed size matrices. Matrix elements = data about a world space square of dimension m_dCellSize.
-        std::map<int, BlockMatrixData*> m_CellMap;
+        std::map<int, DEMBlock*> m_CellMap;
         // Concatenates data from the map of cells.
         cv::Mat *m_pFinalMatrix;
 
         cv::Mat *m_pFinalVarianceMatrix;
+        cv::Mat *m_pFinalSlopeMatrix;
+        cv::Mat *m_pFinalRoughnessMatrix;
+
+        // Blocks updated since the last call to UpdateDerivedLayers
+        std::vector<DEMBlock*> m_vDirtyBlocks;
+
+        // Keeps the heights measured locally since the last export
+        bool m_bTrackLocalChanges;
+        // Blocks with local measurements since the last export
+        std::vector<DEMBlock*> m_vLocalBlocks;
+
+        // Block of the last update, successive updates usually falling in the same block
+        DEMBlock *m_pLastBlock;
+        // Measurements after which an element converges, 0 to never converge, and distance to
+        // its height within which the next heights agree with it
+        int m_iConvergedMeasurements;
+        float m_fConvergenceTolerance;
+        // Updates dropped since the last call to TakeNumSkipped, their element being converged
+        size_t m_NumSkipped;
+        // Resolution of the blocks from their distance to the robot
+        ResolutionLevels m_Levels;
 
         const double m_dCellSize;
         // Size of the matrix representing a square cell of dimension m_dCellSize
@@ -46,16 +62,73 @@ protected:
         int m_OldMinCellRow;
         int m_OldMaxCellColumn;
         int m_OldMinCellColumn;
+        // Set once the height and variance are shared by ShareMats, so that the next Compose writes new ones
+        bool m_bFinalMatricesShared;
+
+        // Returns the block matrix (i, j), creating it if it does not exist yet, and refines it if the
+        // robot came closer since
+        DEMBlock* GetBlock(int i, int j);
+        // Replicates the elements of a block into those of a finer level
+        void Refine(DEMBlock *pData, int level);
+        // Returns the block matrix (i, j), or nullptr if it does not exist
+        DEMBlock* FindBlock(int i, int j);
+        // Recomputes the slope and roughness of the elements [r0, r1[ x [c0, c1[ of a block, at its level
+        void ComputeDerivedLayers(DEMBlock *pData, int r0, int r1, int c0, int c1);
+        inline int ConvertWorldCoordToIndex(double d)   {return int(floor(d*m_uiCellSize/m_dCellSize));}
+        // Fuses the heights of a tile received from another robot into its block
+        void FuseBlock(DEMBlock *pData, const MapTileData &tile) const;
+        friend class DEMBlockFusion;
 
 public:
-        DEM(double dCellSize, unsigned int uiCellSize, ros::NodeHandle &nh);
+        DEM(double dCellSize, unsigned int uiCellSize);
         ~DEM();
 
-        void PublishToFile();
-        void PublishImage();
+        // Copies the blocks into the final matrices. Returns false if the map is empty.
+        bool Compose();
+        // Writes the height, variance, slope and roughness as a binary export (see DEMFile.h)
+        bool PublishToFile(const std::string &path = "/tmp/DEM.bin");
+        // Composes the height into an rgba8 image
+        bool ComposeImage(cv::Mat &image);
+        // Converts heights into the image of ComposeImage
+        static void ColorImage(const cv::Mat &height, cv::Mat &image);
+        // Height and variance matrices of the last Compose, shared rather than copied. The next Compose
+        // leaves them as they are and writes new final matrices, so they can be read once the map is unlocked.
+        void ShareMats(cv::Mat &height, cv::Mat &variance);
 
         void Update(double x, double y, double data);
+        // Elements with numMeasurements heights converge: the next heights within tolerance of
+        // theirs are dropped. 0 disables the convergence.
+        void SetConvergence(int numMeasurements, double tolerance)      {m_iConvergedMeasurements = numMeasurements; m_fConvergenceTolerance = float(tolerance);}
+        // Blocks beyond dFineRadius meters of the robot are held at coarser levels, see ResolutionLevels.
+        // An element of a coarse block holds the heights of the whole area it stands for.
+        void SetAdaptiveResolution(double dFineRadius, int iMaxLevel)   {m_Levels.Set(dFineRadius, iMaxLevel);}
+        // Position of the robot for the levels of the blocks, once per scan
+        void SetFocus(double x, double y)       {m_Levels.SetFocus(x, y); m_pLastBlock = nullptr;}
+        // Returns the number of updates dropped on converged elements since the last call
+        size_t TakeNumSkipped() {size_t numSkipped = m_NumSkipped; m_NumSkipped = 0; return numSkipped;}
+        // Refreshes the slope and roughness of the blocks updated since the last call and
+        // of the borders of their neighbours. Call once per scan, after the updates.
+        void UpdateDerivedLayers();
+        // Reads the layers at (x, y). Returns false if no height was measured there.
+        bool Lookup(double x, double y, float &height, float &variance, float &slope, float &roughness);
         inline double ConvertIndexToWorldCoord(int i)   {return (double(i)/m_uiCellSize)*m_dCellSize;}
         cv::Mat* getMat();
         cv::Mat* getVarMat();
+        cv::Mat* getSlopeMat();
+        cv::Mat* getRoughnessMat();
+        // Index over the whole map of the element (0, 0) of the final matrices
+        cv::Point2i getMatOrigin()      {return cv::Point2i(m_OldMinCellRow*int(m_uiCellSize), m_OldMinCellColumn*int(m_uiCellSize));}
+        double getResolution()  {return m_dCellSize/m_uiCellSize;}
+
+        // Map sharing between robots
+        void SetTrackLocalChanges(bool bTrack)  {m_bTrackLocalChanges = bTrack;}
+        // Adds the mean, variance and number of the heights measured locally since the last export
+        // to tiles, indexed by the PackIndices of the block, and resets them
+        void ExportLocalChanges(std::map<long long, MapTileData> &tiles);
+        // Adds the height, variance and number of measurements of every block to tiles, so that
+        // fusing them into an empty map copies this one
+        void ExportBlocks(std::map<long long, MapTileData> &tiles) const;
+        // Combines the heights of the tiles received from other robots with the local ones as
+        // variance weighted means, one block per thread
+        void Fuse(const std::vector<const MapTileData*> &tiles);
 };
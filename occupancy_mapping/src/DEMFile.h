@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+// Binary DEM export, meant to be memory mapped by the offline tools without any parsing.
+// The file starts with a DEMFileHeader, followed by numLayers DEMFileLayer entries. Each layer
+// is a dense row-major array of rows x cols floats, starting at its offset from the beginning
+// of the file (a multiple of DEM_FILE_ALIGNMENT). The element (i, j) covers the square whose
+// corner is (originX + i*resolution, originY + j*resolution) in the world frame. Values are in
+// the native byte order.
+
+#define DEM_FILE_MAGIC		"OMDM"
+#define DEM_FILE_VERSION	1
+#define DEM_FILE_ALIGNMENT	64
+#define DEM_FILE_LAYER_NAME_SIZE	24
+
+struct DEMFileHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t numLayers;
+	uint32_t rows;
+	uint32_t cols;
+	uint32_t reserved;
+	double originX;
+	double originY;
+	// Side of an element in meters
+	double resolution;
+};
+
+struct DEMFileLayer
+{
+	// Null terminated, e.g. "height" or "variance"
+	char name[DEM_FILE_LAYER_NAME_SIZE];
+	uint64_t offset;
+};
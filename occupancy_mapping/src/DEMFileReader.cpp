@@ -0,0 +1,93 @@
+/*
+ * Memory mapped reader of the binary DEM exports
+ */
+
+#include "DEMFileReader.h"
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+DEMFileReader::DEMFileReader() :
+	m_pData(nullptr), m_Size(0), m_pHeader(nullptr), m_pLayers(nullptr)
+{
+}
+
+DEMFileReader::~DEMFileReader()
+{
+	Close();
+}
+
+bool DEMFileReader::Open(const std::string &path)
+{
+	Close();
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(DEMFileHeader))
+	{
+		close(fd);
+		return false;
+	}
+	m_Size = st.st_size;
+	m_pData = mmap(nullptr, m_Size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping stays valid once the file is closed
+	close(fd);
+	if(m_pData == MAP_FAILED)
+	{
+		m_pData = nullptr;
+		return false;
+	}
+
+	const DEMFileHeader *pHeader = static_cast<const DEMFileHeader*>(m_pData);
+	const DEMFileLayer *pLayers = reinterpret_cast<const DEMFileLayer*>(pHeader+1);
+	bool bValid = memcmp(pHeader->magic, DEM_FILE_MAGIC, 4) == 0 && pHeader->version == DEM_FILE_VERSION
+		&& sizeof(DEMFileHeader)+pHeader->numLayers*sizeof(DEMFileLayer) <= m_Size;
+	size_t layerSize = size_t(pHeader->rows)*pHeader->cols*sizeof(float);
+	for(unsigned int k = 0; bValid && k < pHeader->numLayers; k++)
+	{
+		bValid = pLayers[k].offset%DEM_FILE_ALIGNMENT == 0 && pLayers[k].offset+layerSize <= m_Size
+			&& memchr(pLayers[k].name, '\0', DEM_FILE_LAYER_NAME_SIZE) != nullptr;
+	}
+	if(!bValid)
+	{
+		Close();
+		return false;
+	}
+	m_pHeader = pHeader;
+	m_pLayers = pLayers;
+	return true;
+}
+
+void DEMFileReader::Close()
+{
+	if(m_pData)
+		munmap(m_pData, m_Size);
+	m_pData = nullptr;
+	m_Size = 0;
+	m_pHeader = nullptr;
+	m_pLayers = nullptr;
+}
+
+int DEMFileReader::FindLayer(const char *name) const
+{
+	for(unsigned int k = 0; k < m_pHeader->numLayers; k++)
+	{
+		if(strcmp(m_pLayers[k].name, name) == 0)
+			return int(k);
+	}
+	return -1;
+}
+
+bool DEMFileReader::Sample(unsigned int layer, double x, double y, float &value) const
+{
+	double i = floor((x-m_pHeader->originX)/m_pHeader->resolution);
+	double j = floor((y-m_pHeader->originY)/m_pHeader->resolution);
+	if(i < 0 || j < 0 || i >= m_pHeader->rows || j >= m_pHeader->cols)
+		return false;
+	value = GetLayer(layer)[size_t(i)*m_pHeader->cols+size_t(j)];
+	return true;
+}
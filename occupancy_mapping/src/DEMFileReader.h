@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+#include "DEMFile.h"
+
+// Read-only access to a DEM export through a memory mapping: the layers are used in place.
+// Only depends on POSIX, so that the offline tools can link it alone.
+class DEMFileReader
+{
+protected:
+	void *m_pData;
+	size_t m_Size;
+	const DEMFileHeader *m_pHeader;
+	const DEMFileLayer *m_pLayers;
+
+public:
+	DEMFileReader();
+	~DEMFileReader();
+
+	// Maps the file and checks its header. Returns false if it cannot be read or is not a valid export.
+	bool Open(const std::string &path);
+	void Close();
+	bool IsOpen() const	{return m_pHeader != nullptr;}
+
+	unsigned int GetRows() const	{return m_pHeader->rows;}
+	unsigned int GetCols() const	{return m_pHeader->cols;}
+	double GetOriginX() const	{return m_pHeader->originX;}
+	double GetOriginY() const	{return m_pHeader->originY;}
+	double GetResolution() const	{return m_pHeader->resolution;}
+	unsigned int GetNumLayers() const	{return m_pHeader->numLayers;}
+	const char* GetLayerName(unsigned int layer) const	{return m_pLayers[layer].name;}
+	// Index of the layer called name, -1 if there is none
+	int FindLayer(const char *name) const;
+	// Elements of a layer, row-major
+	const float* GetLayer(unsigned int layer) const
+	{
+		return reinterpret_cast<const float*>(static_cast<const char*>(m_pData)+m_pLayers[layer].offset);
+	}
+	// Value of a layer at the world position (x, y). Returns false outside of the map.
+	bool Sample(unsigned int layer, double x, double y, float &value) const;
+};
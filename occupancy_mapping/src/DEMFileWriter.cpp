@@ -0,0 +1,103 @@
+/*
+ * Binary DEM exports
+ */
+
+#include "DEMFileWriter.h"
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+
+DEMFileWriter::DEMFileWriter() : m_bBusy(false)
+{
+}
+
+DEMFileWriter::~DEMFileWriter()
+{
+	if(m_Thread.joinable())
+		m_Thread.join();
+}
+
+bool DEMFileWriter::Write(const std::string &path, const DEMFileData &data)
+{
+	if(data.layers.empty() || data.names.size() != data.layers.size())
+		return false;
+	int rows = data.layers[0].rows;
+	int cols = data.layers[0].cols;
+	for(size_t k = 0; k < data.layers.size(); k++)
+	{
+		const cv::Mat &layer = data.layers[k];
+		if(layer.type() != CV_32FC1 || layer.rows != rows || layer.cols != cols
+			|| data.names[k].size() >= DEM_FILE_LAYER_NAME_SIZE)
+			return false;
+	}
+
+	DEMFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DEM_FILE_MAGIC, 4);
+	header.version = DEM_FILE_VERSION;
+	header.numLayers = data.layers.size();
+	header.rows = rows;
+	header.cols = cols;
+	header.originX = data.originX;
+	header.originY = data.originY;
+	header.resolution = data.resolution;
+
+	// The layers follow the layer table, each on an aligned offset
+	std::vector<DEMFileLayer> vLayers(data.layers.size());
+	size_t layerSize = size_t(rows)*cols*sizeof(float);
+	size_t offset = sizeof(DEMFileHeader)+vLayers.size()*sizeof(DEMFileLayer);
+	for(size_t k = 0; k < vLayers.size(); k++)
+	{
+		memset(vLayers[k].name, 0, DEM_FILE_LAYER_NAME_SIZE);
+		strcpy(vLayers[k].name, data.names[k].c_str());
+		offset = (offset+DEM_FILE_ALIGNMENT-1)/DEM_FILE_ALIGNMENT*DEM_FILE_ALIGNMENT;
+		vLayers[k].offset = offset;
+		offset += layerSize;
+	}
+
+	std::string tmpPath = path+".tmp";
+	std::ofstream out(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+	if(!out.is_open())
+		return false;
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(&vLayers[0]), vLayers.size()*sizeof(DEMFileLayer));
+	static const char padding[DEM_FILE_ALIGNMENT] = {0};
+	size_t position = sizeof(DEMFileHeader)+vLayers.size()*sizeof(DEMFileLayer);
+	for(size_t k = 0; k < vLayers.size(); k++)
+	{
+		out.write(padding, vLayers[k].offset-position);
+		const cv::Mat &layer = data.layers[k];
+		if(layer.isContinuous())
+			out.write(reinterpret_cast<const char*>(layer.data), layerSize);
+		else
+		{
+			for(int i = 0; i < rows; i++)
+				out.write(reinterpret_cast<const char*>(layer.ptr<float>(i)), cols*sizeof(float));
+		}
+		position = vLayers[k].offset+layerSize;
+	}
+	out.close();
+	if(!out)
+	{
+		remove(tmpPath.c_str());
+		return false;
+	}
+	return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+void DEMFileWriter::WriteThread(std::string path, DEMFileData data)
+{
+	Write(path, data);
+	m_bBusy = false;
+}
+
+bool DEMFileWriter::WriteAsync(const std::string &path, const DEMFileData &data)
+{
+	if(m_bBusy)
+		return false;
+	if(m_Thread.joinable())
+		m_Thread.join();
+	m_bBusy = true;
+	m_Thread = boost::thread(&DEMFileWriter::WriteThread, this, path, data);
+	return true;
+}
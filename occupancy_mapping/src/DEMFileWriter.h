@@ -0,0 +1,42 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <boost/thread.hpp>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "DEMFile.h"
+
+// Layers of a DEM export, all CV_32FC1 matrices of the same size
+struct DEMFileData
+{
+	// World position of the corner of the element (0, 0), and side of an element in meters
+	double originX;
+	double originY;
+	double resolution;
+	std::vector<std::string> names;
+	std::vector<cv::Mat> layers;
+};
+
+// Writes the binary DEM exports described in DEMFile.h. The file is written next to its
+// destination and renamed once complete, so that the readers never map a partial export.
+class DEMFileWriter
+{
+protected:
+	boost::thread m_Thread;
+	std::atomic<bool> m_bBusy;
+
+	void WriteThread(std::string path, DEMFileData data);
+
+public:
+	DEMFileWriter();
+	// Waits for the write in progress
+	~DEMFileWriter();
+
+	static bool Write(const std::string &path, const DEMFileData &data);
+	// Writes on a background thread. The layers are used as they are and must not be modified
+	// until the write is done. Returns false if the previous write is still in progress.
+	bool WriteAsync(const std::string &path, const DEMFileData &data);
+	bool IsBusy() const	{return m_bBusy;}
+};
@@ -0,0 +1,222 @@
+/*
+ * Incremental obstacle distance map (dynamic brushfire)
+ * Lau, Sprunk & Burgard, "Improved updating of Euclidean distance maps and Voronoi diagrams", IROS 2010
+ */
+
+#include "DistanceMap.h"
+#include <float.h>
+#include <limits.h>
+
+#define NO_OBSTACLE	INT_MIN
+
+using namespace std;
+
+struct DistanceBlockData
+{
+	//! Coordinates (m,n) of the block matrix
+	int m;
+	int n;
+	std::vector<DistanceCell> cells;
+};
+
+// 8-connected neighbourhood
+static const int NEIGHBOUR_X[8] = {-1, -1, -1, 0, 0, 1, 1, 1};
+static const int NEIGHBOUR_Y[8] = {-1, 0, 1, -1, 1, -1, 0, 1};
+
+DistanceMap::DistanceMap(double dCellSize, unsigned int uiCellSize, double dMaxDistance):
+	m_dCellSize(dCellSize), m_uiCellSize(uiCellSize),
+	m_fMaxDistance(float(dMaxDistance*uiCellSize/dCellSize))
+{
+}
+
+DistanceMap::~DistanceMap()
+{
+	for(auto it = m_CellMap.begin(); it != m_CellMap.end(); it++)
+		delete(it->second);
+}
+
+DistanceCell* DistanceMap::GetCell(int x, int y, bool bCreate)
+{
+	int i = FloorDiv(x, m_uiCellSize);
+	int j = FloorDiv(y, m_uiCellSize);
+
+	// Compute the bijection between Z^2 and N
+	int f_i, f_j;
+	if(i < 0)
+		f_i = -2*i-1;
+	else
+		f_i = 2*i;
+	if(j < 0)
+		f_j = -2*j-1;
+	else
+		f_j = 2*j;
+	int idx = ((f_i+f_j)*(f_i+f_j)+f_i+3*f_j)/2;
+
+	auto it = m_CellMap.find(idx);
+	DistanceBlockData *pData;
+	if(it == m_CellMap.end())
+	{
+		if(!bCreate)
+			return nullptr;
+
+		pData = new DistanceBlockData;
+		pData->m = i;
+		pData->n = j;
+		DistanceCell empty = {FLT_MAX, NO_OBSTACLE, NO_OBSTACLE, false, false};
+		pData->cells.assign(m_uiCellSize*m_uiCellSize, empty);
+		m_CellMap[idx] = pData;
+	}
+	else
+		pData = it->second;
+	return &pData->cells[(x-i*int(m_uiCellSize))*m_uiCellSize+(y-j*int(m_uiCellSize))];
+}
+
+void DistanceMap::Push(float dist, int x, int y)
+{
+	m_OpenList.push(OpenListEntry(dist, PackIndices(x, y)));
+}
+
+void DistanceMap::SetObstacle(int x, int y)
+{
+	DistanceCell *pCell = GetCell(x, y, true);
+	if(pCell->bObstacle)
+		return;
+	pCell->bObstacle = true;
+	pCell->bRaise = false;
+	pCell->dist = 0.0f;
+	pCell->obstX = x;
+	pCell->obstY = y;
+	Push(0.0f, x, y);
+}
+
+void DistanceMap::RemoveObstacle(int x, int y)
+{
+	DistanceCell *pCell = GetCell(x, y, false);
+	if(!pCell || !pCell->bObstacle)
+		return;
+	pCell->bObstacle = false;
+	pCell->bRaise = true;
+	pCell->dist = FLT_MAX;
+	pCell->obstX = NO_OBSTACLE;
+	pCell->obstY = NO_OBSTACLE;
+	Push(0.0f, x, y);
+}
+
+// Clears the neighbours whose closest obstacle is gone, and queues the others so that they
+// propagate their distance back into the cleared area
+void DistanceMap::Raise(int x, int y)
+{
+	for(int k = 0; k < 8; k++)
+	{
+		int nx = x+NEIGHBOUR_X[k];
+		int ny = y+NEIGHBOUR_Y[k];
+		DistanceCell *pNeighbour = GetCell(nx, ny, false);
+		if(!pNeighbour || pNeighbour->obstX == NO_OBSTACLE || pNeighbour->bRaise)
+			continue;
+		float dist = pNeighbour->dist;
+		if(!IsObstacle(pNeighbour->obstX, pNeighbour->obstY))
+		{
+			pNeighbour->dist = FLT_MAX;
+			pNeighbour->obstX = NO_OBSTACLE;
+			pNeighbour->obstY = NO_OBSTACLE;
+			pNeighbour->bRaise = true;
+		}
+		Push(dist, nx, ny);
+	}
+	GetCell(x, y, false)->bRaise = false;
+}
+
+// Offers the obstacle of (x, y) to its neighbours
+void DistanceMap::Lower(int x, int y, const DistanceCell &cell)
+{
+	int obstX = cell.obstX;
+	int obstY = cell.obstY;
+	for(int k = 0; k < 8; k++)
+	{
+		int nx = x+NEIGHBOUR_X[k];
+		int ny = y+NEIGHBOUR_Y[k];
+		float dist = hypotf(float(nx-obstX), float(ny-obstY));
+		if(dist > m_fMaxDistance)
+			continue;
+		DistanceCell *pNeighbour = GetCell(nx, ny, true);
+		if(pNeighbour->bRaise || dist >= pNeighbour->dist)
+			continue;
+		pNeighbour->dist = dist;
+		pNeighbour->obstX = obstX;
+		pNeighbour->obstY = obstY;
+		Push(dist, nx, ny);
+	}
+}
+
+void DistanceMap::Update(const std::vector<CellStateChange> &vChanges)
+{
+	for(size_t k = 0; k < vChanges.size(); k++)
+	{
+		if(vChanges[k].to == NonTraversable)
+			SetObstacle(vChanges[k].x, vChanges[k].y);
+		else if(vChanges[k].from == NonTraversable)
+			RemoveObstacle(vChanges[k].x, vChanges[k].y);
+	}
+
+	while(!m_OpenList.empty())
+	{
+		OpenListEntry entry = m_OpenList.top();
+		m_OpenList.pop();
+		int x, y;
+		UnpackIndices(entry.second, x, y);
+		DistanceCell *pCell = GetCell(x, y, false);
+		if(!pCell)
+			continue;
+		if(pCell->bRaise)
+			Raise(x, y);
+		else if(pCell->obstX != NO_OBSTACLE && IsObstacle(pCell->obstX, pCell->obstY))
+		{
+			// Outdated entry, the element was lowered again since
+			if(entry.first > pCell->dist)
+				continue;
+			Lower(x, y, *pCell);
+		}
+	}
+}
+
+double DistanceMap::GetDistance(double x, double y)
+{
+	DistanceCell *pCell = GetCell(int(floor(x*m_uiCellSize/m_dCellSize)), int(floor(y*m_uiCellSize/m_dCellSize)), false);
+	float dist = pCell ? std::min(pCell->dist, m_fMaxDistance) : m_fMaxDistance;
+	return dist*m_dCellSize/m_uiCellSize;
+}
+
+bool DistanceMap::ComposeImage(cv::Mat &image, const cv::Point2i &origin, int numRows, int numColumns)
+{
+	if(numRows <= 0 || numColumns <= 0)
+		return false;
+
+	int N = int(m_uiCellSize);
+	float fResolution = float(m_dCellSize/m_uiCellSize);
+	float fMaxDistance = m_fMaxDistance*fResolution;
+
+	cv::Mat distanceMatrix(numRows, numColumns, CV_32F);
+	for(int i = 0; i < numRows; i++)
+	{
+		float *row = distanceMatrix.ptr<float>(i);
+		for(int j = 0; j < numColumns; j++)
+			row[j] = fMaxDistance;
+	}
+	// The blocks around obstacles the Cartography has not composed are cropped
+	for(auto it = m_CellMap.begin(); it != m_CellMap.end(); it++)
+	{
+		int row0 = int(it->second->m)*N-origin.x;
+		int column0 = int(it->second->n)*N-origin.y;
+		if(row0+N <= 0 || row0 >= numRows || column0+N <= 0 || column0 >= numColumns)
+			continue;
+		for(int i = std::max(0, -row0); i < std::min(N, numRows-row0); i++)
+		{
+			float *row = distanceMatrix.ptr<float>(row0+i);
+			for(int j = std::max(0, -column0); j < std::min(N, numColumns-column0); j++)
+				row[column0+j] = std::min(it->second->cells[i*N+j].dist, m_fMaxDistance)*fResolution;
+		}
+	}
+
+	image = distanceMatrix;
+	return true;
+}
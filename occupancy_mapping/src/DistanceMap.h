@@ -0,0 +1,68 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <map>
+#include <queue>
+#include <vector>
+#include <math.h>
+
+#include "Cartography.h"
+
+// Data about one element of the distance map
+struct DistanceCell
+{
+	// Distance to the closest obstacle, in elements
+	float dist;
+	// Closest obstacle, x and y being indices over the whole map (INT_MIN if none)
+	int obstX;
+	int obstY;
+	bool bObstacle;
+	// The element lost its obstacle and waits for the wavefront to clear it
+	bool bRaise;
+};
+
+struct DistanceBlockData;
+
+// Distance from every element of the map to the closest NonTraversable element.
+// It is maintained incrementally from the state changes of the Cartography with a dynamic
+// brushfire (Lau, Sprunk & Burgard, 2010): only the elements around the changes are visited.
+class DistanceMap
+{
+protected:
+	// Same block layout as the Cartography
+	std::map<int, DistanceBlockData*> m_CellMap;
+	const double m_dCellSize;
+	const unsigned int m_uiCellSize;
+	// Distances are not propagated beyond m_fMaxDistance elements
+	const float m_fMaxDistance;
+
+	// Elements to process, closest first
+	typedef std::pair<float, long long> OpenListEntry;
+	std::priority_queue<OpenListEntry, std::vector<OpenListEntry>, std::greater<OpenListEntry> > m_OpenList;
+
+	// Returns the element (x, y), or nullptr if its block does not exist and bCreate is false
+	DistanceCell* GetCell(int x, int y, bool bCreate);
+	inline bool IsObstacle(int x, int y)
+	{
+		DistanceCell *pCell = GetCell(x, y, false);
+		return pCell && pCell->bObstacle;
+	}
+	void Push(float dist, int x, int y);
+	void SetObstacle(int x, int y);
+	void RemoveObstacle(int x, int y);
+	void Raise(int x, int y);
+	void Lower(int x, int y, const DistanceCell &cell);
+
+public:
+	DistanceMap(double dCellSize, unsigned int uiCellSize, double dMaxDistance);
+	~DistanceMap();
+
+	// Applies the state changes of the Cartography and propagates the distances around them
+	void Update(const std::vector<CellStateChange> &vChanges);
+	// Distance in meters from (x, y) to the closest obstacle, capped to the maximum distance
+	double GetDistance(double x, double y);
+	// Composes the distances in meters (32FC1) over numRows x numColumns elements from origin,
+	// in elements of the whole map, so that it lines up with the Cartography image given its
+	// getMatOrigin() and size. The elements without a distance block are at the maximum distance.
+	bool ComposeImage(cv::Mat &image, const cv::Point2i &origin, int numRows, int numColumns);
+};
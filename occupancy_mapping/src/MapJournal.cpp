@@ -0,0 +1,146 @@
+/*
+ * Journal of the map updates, for the offline rebuilds of the maps
+ */
+
+#include "MapJournal.h"
+#include <stdint.h>
+#include <string.h>
+
+static const char JOURNAL_MAGIC[4] = {'O', 'M', 'J', 'L'};
+static const uint32_t JOURNAL_VERSION = 1;
+// Size from which the serialized frames are handed over to the writing thread
+static const size_t JOURNAL_FLUSH_SIZE = 1 << 20;
+
+static void Append(std::vector<char> &buffer, const void *pData, size_t size)
+{
+	const char *pBytes = (const char*)pData;
+	buffer.insert(buffer.end(), pBytes, pBytes+size);
+}
+
+JournalWriter::JournalWriter() : m_bStop(false), m_bFailed(false)
+{
+}
+
+JournalWriter::~JournalWriter()
+{
+	Close();
+}
+
+bool JournalWriter::Open(const std::string &path, double dCellSize, unsigned int uiCellSize)
+{
+	Close();
+	m_File.open(path.c_str(), std::ios_base::binary | std::ios_base::trunc);
+	if(!m_File.is_open())
+		return false;
+	uint32_t cellSize = uiCellSize;
+	m_File.write(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+	m_File.write((const char*)&JOURNAL_VERSION, sizeof(JOURNAL_VERSION));
+	m_File.write((const char*)&dCellSize, sizeof(dCellSize));
+	m_File.write((const char*)&cellSize, sizeof(cellSize));
+	if(!m_File.good())
+	{
+		m_File.close();
+		return false;
+	}
+	m_vBuffer.reserve(JOURNAL_FLUSH_SIZE);
+	m_bStop = false;
+	m_bFailed = false;
+	m_Thread = boost::thread(&JournalWriter::WriteThread, this);
+	return true;
+}
+
+bool JournalWriter::WriteData(const std::vector<char> &data)
+{
+	if(!data.empty())
+		m_File.write(&data[0], data.size());
+	return m_File.good();
+}
+
+void JournalWriter::WriteThread()
+{
+	std::vector<char> data;
+	while(true)
+	{
+		{
+			boost::mutex::scoped_lock lock(m_Mutex);
+			while(m_vPending.empty() && !m_bStop)
+				m_Condition.wait(lock);
+			if(m_vPending.empty())
+				return;
+			data.swap(m_vPending);
+		}
+		if(!WriteData(data))
+			m_bFailed = true;
+		data.clear();
+	}
+}
+
+bool JournalWriter::Append(const JournalFrame &frame)
+{
+	uint32_t numObservations = uint32_t(frame.observations.size());
+	::Append(m_vBuffer, &frame.stamp, sizeof(frame.stamp));
+	::Append(m_vBuffer, frame.origin, sizeof(frame.origin));
+	::Append(m_vBuffer, &numObservations, sizeof(numObservations));
+	if(numObservations > 0)
+		::Append(m_vBuffer, &frame.observations[0], numObservations*sizeof(JournalObservation));
+
+	// Handed over only if the thread is done with the previous buffer, this one growing meanwhile
+	if(m_vBuffer.size() >= JOURNAL_FLUSH_SIZE)
+	{
+		boost::mutex::scoped_lock lock(m_Mutex);
+		if(m_vPending.empty())
+		{
+			m_vPending.swap(m_vBuffer);
+			m_Condition.notify_one();
+		}
+	}
+	return !m_bFailed.exchange(false);
+}
+
+bool JournalWriter::Close()
+{
+	if(!m_File.is_open())
+		return true;
+	{
+		boost::mutex::scoped_lock lock(m_Mutex);
+		m_bStop = true;
+		m_Condition.notify_one();
+	}
+	m_Thread.join();
+	bool bSuccess = !m_bFailed && WriteData(m_vPending) && WriteData(m_vBuffer);
+	m_vPending.clear();
+	m_vBuffer.clear();
+	m_File.close();
+	return bSuccess;
+}
+
+bool JournalReader::Open(const std::string &path)
+{
+	m_File.open(path.c_str(), std::ios_base::binary);
+	if(!m_File.is_open())
+		return false;
+	char magic[4];
+	uint32_t version = 0;
+	uint32_t cellSize = 0;
+	m_File.read(magic, sizeof(magic));
+	m_File.read((char*)&version, sizeof(version));
+	m_File.read((char*)&m_dCellSize, sizeof(m_dCellSize));
+	m_File.read((char*)&cellSize, sizeof(cellSize));
+	m_uiCellSize = cellSize;
+	return m_File.good() && memcmp(magic, JOURNAL_MAGIC, sizeof(magic)) == 0 && version == JOURNAL_VERSION
+		&& m_dCellSize > 0 && m_uiCellSize > 0;
+}
+
+bool JournalReader::Read(JournalFrame &frame)
+{
+	uint32_t numObservations = 0;
+	m_File.read((char*)&frame.stamp, sizeof(frame.stamp));
+	m_File.read((char*)frame.origin, sizeof(frame.origin));
+	m_File.read((char*)&numObservations, sizeof(numObservations));
+	if(!m_File.good())
+		return false;
+	frame.observations.resize(numObservations);
+	if(numObservations > 0)
+		m_File.read((char*)&frame.observations[0], numObservations*sizeof(JournalObservation));
+	return m_File.good();
+}
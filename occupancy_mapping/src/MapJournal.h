@@ -0,0 +1,86 @@
+#pragma once
+
+#include <boost/thread.hpp>
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Classified point of a scan, as journaled: enough to recompute the log odd it adds to the
+// Cartography with other mapping parameters
+struct JournalObservation
+{
+	// Position in the world frame
+	float x;
+	float y;
+	float z;
+	// Height above the base, compared to the z threshold
+	float baseZ;
+	// CellState of the point above and below the z threshold (the same for the points of a plane)
+	unsigned char stateAbove;
+	unsigned char stateBelow;
+	unsigned char reserved[2];
+
+	int GetState(double zThreshold) const	{return (baseZ > zThreshold) ? stateAbove : stateBelow;}
+};
+
+// Observations of one scan, applied to the maps in a single batch
+struct JournalFrame
+{
+	double stamp;
+	// Position of the sensor in the world frame, origin of the rays
+	float origin[3];
+	std::vector<JournalObservation> observations;
+};
+
+// Append-only journal of the map updates: a "OMJL" magic, a version number, the size and the
+// resolution of the map blocks, then the frames one after the other (stamp, origin, number of
+// observations and the observations), in native byte order.
+// The frames are serialized into a buffer which a background thread writes once it is large
+// enough, so that appending never waits for the disk.
+class JournalWriter
+{
+protected:
+	std::ofstream m_File;
+	// Frames serialized since the last hand over to the writing thread
+	std::vector<char> m_vBuffer;
+	// Frames being written by the thread
+	std::vector<char> m_vPending;
+	boost::mutex m_Mutex;
+	boost::condition_variable m_Condition;
+	boost::thread m_Thread;
+	bool m_bStop;
+	std::atomic<bool> m_bFailed;
+
+	void WriteThread();
+	bool WriteData(const std::vector<char> &data);
+
+public:
+	JournalWriter();
+	~JournalWriter();
+
+	bool Open(const std::string &path, double dCellSize, unsigned int uiCellSize);
+	bool IsOpen() const	{return m_File.is_open();}
+	// Returns false if the journal could not be written since the previous call
+	bool Append(const JournalFrame &frame);
+	// Writes what is left in the buffers and closes the file
+	bool Close();
+};
+
+class JournalReader
+{
+protected:
+	std::ifstream m_File;
+	double m_dCellSize;
+	unsigned int m_uiCellSize;
+
+public:
+	JournalReader() : m_dCellSize(0.0), m_uiCellSize(0)	{}
+
+	bool Open(const std::string &path);
+	// Reads the next frame. Returns false at the end of the file or if it is truncated.
+	bool Read(JournalFrame &frame);
+	// Block layout of the journaled map
+	double GetCellSize() const	{return m_dCellSize;}
+	unsigned int GetCellResolution() const	{return m_uiCellSize;}
+};
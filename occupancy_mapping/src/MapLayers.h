@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <math.h>
+
+#include "TiledGrid.h"
+
+// Policies of the TiledGrid layers
+
+// Number of points which fell in each element
+struct HitCountPolicy
+{
+	typedef unsigned int Cell;
+	// Number of hits to add
+	typedef unsigned int Input;
+	static const int NumChannels = 1;
+
+	static Cell Empty()	{return 0;}
+	static void Update(Cell &cell, const Input &input)	{cell += input;}
+	static const char* GetChannelName(int c)	{return "hits";}
+	static float GetChannel(const Cell &cell, int c)	{return float(cell);}
+};
+
+// Index of the last scan which hit each element, to tell the stale parts of the map
+struct LastSeenPolicy
+{
+	// Scan index plus one, 0 meaning never seen
+	typedef unsigned int Cell;
+	typedef unsigned int Input;
+	static const int NumChannels = 1;
+
+	static Cell Empty()	{return 0;}
+	static void Update(Cell &cell, const Input &input)	{cell = std::max(cell, input+1);}
+	static const char* GetChannelName(int c)	{return "last_seen";}
+	// -1 where never seen
+	static float GetChannel(const Cell &cell, int c)	{return float(cell)-1.0f;}
+};
+
+// Free height above the ground of each element, derived from the columns of the 3D layer
+struct ClearancePolicy
+{
+	// NaN where nothing was observed in the column
+	typedef float Cell;
+	// Clearance of the column, replacing the previous one
+	typedef float Input;
+	static const int NumChannels = 1;
+
+	static Cell Empty()	{return NAN;}
+	static void Update(Cell &cell, const Input &input)	{cell = input;}
+	static const char* GetChannelName(int c)	{return "clearance";}
+	static float GetChannel(const Cell &cell, int c)	{return cell;}
+};
+
+// Mean intensity (or any other scalar returned with the points) of each element
+struct IntensityPolicy
+{
+	struct Cell
+	{
+		float sum;
+		unsigned int count;
+	};
+	typedef float Input;
+	static const int NumChannels = 2;
+
+	static Cell Empty()	{Cell cell = {0.0f, 0}; return cell;}
+	static void Update(Cell &cell, const Input &input)
+	{
+		cell.sum += input;
+		cell.count++;
+	}
+	static const char* GetChannelName(int c)	{return (c == 0) ? "intensity" : "intensity_count";}
+	static float GetChannel(const Cell &cell, int c)
+	{
+		if(c == 1)
+			return float(cell.count);
+		return (cell.count > 0) ? cell.sum/cell.count : 0.0f;
+	}
+};
+
+// Votes of the classifiers for each class, the element taking the class with the most votes
+template<int NUM_CLASSES>
+struct ClassificationPolicy
+{
+	struct Cell
+	{
+		unsigned short votes[NUM_CLASSES];
+	};
+	// Class voted for
+	typedef int Input;
+	static const int NumChannels = 2;
+
+	static Cell Empty()
+	{
+		Cell cell;
+		std::fill(cell.votes, cell.votes+NUM_CLASSES, 0);
+		return cell;
+	}
+	static void Update(Cell &cell, const Input &input)
+	{
+		if(input < 0 || input >= NUM_CLASSES)
+			return;
+		// Halve the votes rather than overflowing, keeping their proportions
+		if(cell.votes[input] == USHRT_MAX)
+		{
+			for(int k = 0; k < NUM_CLASSES; k++)
+				cell.votes[k] /= 2;
+		}
+		cell.votes[input]++;
+	}
+	static const char* GetChannelName(int c)	{return (c == 0) ? "class" : "class_confidence";}
+	// Class with the most votes (-1 without any vote) and its share of the votes
+	static float GetChannel(const Cell &cell, int c)
+	{
+		int best = 0;
+		unsigned int total = 0;
+		for(int k = 0; k < NUM_CLASSES; k++)
+		{
+			total += cell.votes[k];
+			if(cell.votes[k] > cell.votes[best])
+				best = k;
+		}
+		if(total == 0)
+			return (c == 0) ? -1.0f : 0.0f;
+		return (c == 0) ? float(best) : float(cell.votes[best])/total;
+	}
+};
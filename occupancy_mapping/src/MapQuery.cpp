@@ -0,0 +1,124 @@
+/*
+ * Batched map queries against the last published snapshot
+ */
+
+#include "MapQuery.h"
+#include <algorithm>
+#include <cmath>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+
+// Most cells a box query may return
+static const size_t MaxBoxCells = 1 << 22;
+
+// Grows [i0, i1] x [j0, j1] by the cell indices covered by a layer
+static inline void AddExtent(const cv::Mat &mat, const cv::Point2i &origin, int &i0, int &i1, int &j0, int &j1)
+{
+	if(mat.empty())
+		return;
+	i0 = std::min(i0, origin.x);
+	i1 = std::max(i1, origin.x+mat.rows-1);
+	j0 = std::min(j0, origin.y);
+	j1 = std::max(j1, origin.y+mat.cols-1);
+}
+
+static inline bool IsInside(const cv::Mat &mat, int row, int column)
+{
+	return row >= 0 && column >= 0 && row < mat.rows && column < mat.cols;
+}
+
+void MapSnapshot::Sample(double x, double y, MapSample &sample) const
+{
+	int cellX = int(floor(x/resolution));
+	int cellY = int(floor(y/resolution));
+
+	sample.logOdds = 0.0f;
+	int row = cellX-logOddsOrigin.x;
+	int column = cellY-logOddsOrigin.y;
+	if(IsInside(logOdds, row, column))
+		sample.logOdds = logOdds.at<float>(row, column);
+	sample.probability = 1.0f-1.0f/(1.0f+exp(sample.logOdds));
+
+	sample.height = 0.0f;
+	sample.variance = 0.0f;
+	sample.bKnown = false;
+	row = cellX-demOrigin.x;
+	column = cellY-demOrigin.y;
+	if(IsInside(height, row, column) && height.at<float>(row, column) != FLT_MIN)
+	{
+		sample.height = height.at<float>(row, column);
+		sample.variance = variance.at<float>(row, column);
+		sample.bKnown = true;
+	}
+
+	sample.clearance = NAN;
+	row = cellX-clearanceOrigin.x;
+	column = cellY-clearanceOrigin.y;
+	if(IsInside(clearance, row, column))
+		sample.clearance = clearance.at<float>(row, column);
+}
+
+void MapQuery::SetSnapshot(const boost::shared_ptr<const MapSnapshot> &pSnapshot)
+{
+	boost::atomic_store(&m_pSnapshot, pSnapshot);
+}
+
+boost::shared_ptr<const MapSnapshot> MapQuery::GetSnapshot() const
+{
+	return boost::atomic_load(&m_pSnapshot);
+}
+
+bool MapQuery::Query(const std::vector<cv::Point2d> &vPoints, std::vector<MapSample> &vSamples) const
+{
+	boost::shared_ptr<const MapSnapshot> pSnapshot = GetSnapshot();
+	if(!pSnapshot)
+		return false;
+	vSamples.resize(vPoints.size());
+	for(size_t k = 0; k < vPoints.size(); k++)
+		pSnapshot->Sample(vPoints[k].x, vPoints[k].y, vSamples[k]);
+	return true;
+}
+
+bool MapQuery::QueryBox(double minX, double maxX, double minY, double maxY,
+	std::vector<cv::Point2d> &vPoints, std::vector<MapSample> &vSamples) const
+{
+	boost::shared_ptr<const MapSnapshot> pSnapshot = GetSnapshot();
+	if(!pSnapshot)
+		return false;
+	if(!std::isfinite(minX) || !std::isfinite(maxX) || !std::isfinite(minY) || !std::isfinite(maxY))
+		return false;
+	vPoints.clear();
+	vSamples.clear();
+
+	// Cells known to any layer, every other cell samples as unknown
+	int i0 = INT_MAX, i1 = INT_MIN, j0 = INT_MAX, j1 = INT_MIN;
+	AddExtent(pSnapshot->logOdds, pSnapshot->logOddsOrigin, i0, i1, j0, j1);
+	AddExtent(pSnapshot->height, pSnapshot->demOrigin, i0, i1, j0, j1);
+	AddExtent(pSnapshot->clearance, pSnapshot->clearanceOrigin, i0, i1, j0, j1);
+	if(i1 < i0 || j1 < j0)
+		return true;
+
+	// Cells whose center (i+0.5)*resolution is in the box, clamped to the snapshot in double
+	// so that a huge box cannot overflow the indices
+	double resolution = pSnapshot->resolution;
+	i0 = int(std::max(double(i0), ceil(minX/resolution-0.5)));
+	i1 = int(std::min(double(i1), floor(maxX/resolution-0.5)));
+	j0 = int(std::max(double(j0), ceil(minY/resolution-0.5)));
+	j1 = int(std::min(double(j1), floor(maxY/resolution-0.5)));
+	if(i1 < i0 || j1 < j0)
+		return true;
+	if(size_t(i1-i0+1)*size_t(j1-j0+1) > MaxBoxCells)
+		return false;
+	vPoints.reserve(size_t(i1-i0+1)*(j1-j0+1));
+	vSamples.resize(size_t(i1-i0+1)*(j1-j0+1));
+	for(int i = i0; i <= i1; i++)
+	{
+		for(int j = j0; j <= j1; j++)
+		{
+			vPoints.push_back(cv::Point2d((i+0.5)*resolution, (j+0.5)*resolution));
+			pSnapshot->Sample(vPoints.back().x, vPoints.back().y, vSamples[vPoints.size()-1]);
+		}
+	}
+	return true;
+}
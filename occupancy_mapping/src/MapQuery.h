@@ -0,0 +1,57 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <boost/shared_ptr.hpp>
+#include <vector>
+
+// Result of a map query at one position
+struct MapSample
+{
+	float logOdds;
+	float probability;
+	float height;
+	float variance;
+	// False where no height was ever measured
+	bool bKnown;
+	// Free height above the ground from the 3D layer, NaN where unknown or disabled
+	float clearance;
+};
+
+// Immutable composed maps, taken when they are published. The matrices are shared with the maps,
+// which compose into new ones afterwards (see Cartography::ShareMat), so they are never modified.
+struct MapSnapshot
+{
+	double resolution;
+	// Traversability log odds and index over the whole map of its element (0, 0)
+	cv::Mat logOdds;
+	cv::Point2i logOddsOrigin;
+	// DEM height and variance, and index over the whole map of their element (0, 0)
+	cv::Mat height;
+	cv::Mat variance;
+	cv::Point2i demOrigin;
+	// Clearance from the 3D layer and index over the whole map of its element (0, 0), empty when
+	// the layer is disabled
+	cv::Mat clearance;
+	cv::Point2i clearanceOrigin;
+
+	void Sample(double x, double y, MapSample &sample) const;
+};
+
+// Answers map queries from the last published snapshot. The mapping thread swaps the
+// snapshot pointer atomically, so queries never wait for the mapping and see a consistent map.
+class MapQuery
+{
+protected:
+	boost::shared_ptr<const MapSnapshot> m_pSnapshot;
+
+public:
+	void SetSnapshot(const boost::shared_ptr<const MapSnapshot> &pSnapshot);
+	boost::shared_ptr<const MapSnapshot> GetSnapshot() const;
+
+	// Samples the map at each point. Returns false if no map was published yet.
+	bool Query(const std::vector<cv::Point2d> &vPoints, std::vector<MapSample> &vSamples) const;
+	// Samples every cell of the snapshot whose center lies in [minX, maxX] x [minY, maxY], and
+	// returns the centers in vPoints. Returns false for non-finite bounds or too many cells.
+	bool QueryBox(double minX, double maxX, double minY, double maxY,
+		std::vector<cv::Point2d> &vPoints, std::vector<MapSample> &vSamples) const;
+};
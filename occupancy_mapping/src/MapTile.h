@@ -0,0 +1,19 @@
+#pragma once
+
+#include <vector>
+
+// One block of the maps, as exchanged between robots. Only the local measurements since the
+// previous export are sent, so that a robot never sends back what it received from the others.
+struct MapTileData
+{
+	// Row/column of the block
+	int i;
+	int j;
+	// Log odds added to the elements of the block since the last export, row after row (empty if none)
+	std::vector<float> logOdds;
+	// Mean and variance of the heights measured in each element since the last export,
+	// and number of measurements (0 where none)
+	std::vector<float> height;
+	std::vector<float> variance;
+	std::vector<int> numMeasurements;
+};
@@ -0,0 +1,534 @@
+/*
+ * Mapping pipeline: filtering, floor plane fitting, normal estimation and map updates
+ */
+
+#include "MappingPipeline.h"
+#include <Eigen/Geometry>
+#include <algorithm>
+#include <map>
+#include <stdlib.h>
+#include <math.h>
+
+using namespace std;
+
+MappingParameters::MappingParameters() :
+	maxRange(5.0), numSamples(1000), tolerance(1.0), maxPlanes(1), minPlaneSupport(50), planeAdjacency(0.1),
+	traverseThreshold(0.3), normalEstimationRadius(0.03), minNormalNeighbours(5),
+	stepFunctionParameter(2.0), alpha(1.0), beta(2.0), zThreshold(0.4), beliefMod(3.0),
+	freeSpaceBelief(0.5), stateThreshold(1.0), maxObstacleDistance(2.0), cellSize(1.0), cellResolution(10),
+	voxelSize(0.0), clearanceMinHeight(-1.0), clearanceMaxHeight(3.0), statisticsLayers(false),
+	convergedMeasurements(1000), convergenceTolerance(0.02),
+	fineResolutionRadius(0.0), maxResolutionLevel(2)
+{
+}
+
+// Random index in [0, n[
+static size_t GetRandomIndex(size_t n)
+{
+	return size_t(std::min((rand()/(double)RAND_MAX)*n, (double)n-1));
+}
+
+ScanFrontEnd::ScanFrontEnd(const MappingParameters &params) :
+	m_Params(params), m_OutliersBegin(0), m_PlaneNormal(0, 0, 1), m_RansacIterations(0),
+	m_bKeepObservations(false)
+{
+	m_Plane[0] = m_Plane[1] = m_Plane[2] = 0.0;
+}
+
+void ScanFrontEnd::Process(const pcl::PointCloud<pcl::PointXYZ> &sensorPC, const pcl::PointCloud<pcl::PointXYZ> &basePC,
+	const pcl::PointCloud<pcl::PointXYZ> &worldPC, double ox, double oy, double oz, ScanUpdate &update,
+	StageTimer *pTimer)
+{
+	Filter(sensorPC, basePC);
+	if(pTimer)
+	{
+		pTimer->Lap(StageFiltering);
+		pTimer->GetStats().AddCount(CounterInputPoints, sensorPC.size());
+		pTimer->GetStats().AddCount(CounterFilteredPoints, m_vFiltered.size());
+	}
+	FitPlanes(basePC);
+	if(pTimer)
+	{
+		pTimer->Lap(StageRansac);
+		pTimer->GetStats().AddCount(CounterInliers, m_OutliersBegin);
+		pTimer->GetStats().AddCount(CounterRansacIterations, m_RansacIterations);
+	}
+	EstimateNormals(basePC);
+	if(pTimer)
+		pTimer->Lap(StageNormals);
+	Classify(basePC, worldPC, ox, oy, oz, update);
+}
+
+void ScanFrontEnd::Filter(const pcl::PointCloud<pcl::PointXYZ> &sensorPC, const pcl::PointCloud<pcl::PointXYZ> &basePC)
+{
+	m_vFiltered.clear();
+	for(size_t i = 0; i < sensorPC.size(); i++)
+	{
+		// Bogus point
+		if(hypot(sensorPC[i].x, sensorPC[i].y) < 1e-2)
+			continue;
+		// Too far
+		if(hypot(basePC[i].x, basePC[i].y) > m_Params.maxRange)
+			continue;
+		m_vFiltered.push_back(i);
+	}
+}
+
+size_t ScanFrontEnd::FitPlane(const pcl::PointCloud<pcl::PointXYZ> &basePC, size_t begin, PlaneSegment &plane)
+{
+	size_t end = m_vPlaneIndices.size();
+	size_t n = end-begin;
+	if(n < 3)
+		return 0;
+
+	size_t best = 0;
+	for(int k = 0; k < m_Params.numSamples && best < n; k++)
+	{
+		m_RansacIterations++;
+		// Pick up 3 random points
+		Eigen::Vector3f samplePoints[3];
+		for(int j = 0; j < 3; j++)
+		{
+			const pcl::PointXYZ &p = basePC[m_vPlaneIndices[begin+GetRandomIndex(n)]];
+			samplePoints[j] << p.x, p.y, p.z;
+		}
+		// Calculate the plane ax+by+cz+d=0
+		Eigen::Vector3f normal = (samplePoints[1]-samplePoints[0]).cross(samplePoints[2]-samplePoints[1]);
+		// Aligned or repeated samples define no plane, and a null normal would take every point
+		if(normal.norm() < 1e-6f)
+			continue;
+		normal.normalize();
+		double d = -samplePoints[1].dot(normal);
+
+		// Evaluation, the inliers are only counted
+		size_t count = 0;
+		for(size_t i = begin; i < end; i++)
+		{
+			const pcl::PointXYZ &p = basePC[m_vPlaneIndices[i]];
+			if(fabs(Eigen::Vector3f(p.x, p.y, p.z).dot(normal)+d) <= m_Params.tolerance)
+				count++;
+		}
+
+		// Keep the model if it is better
+		if(count > best)
+		{
+			best = count;
+			plane.normal = normal;
+			plane.d = d;
+		}
+	}
+	if(best == 0)
+		return 0;
+
+	// Move the inliers of the best model to the front of the working set
+	size_t w = begin;
+	for(size_t i = begin; i < end; i++)
+	{
+		const pcl::PointXYZ &p = basePC[m_vPlaneIndices[i]];
+		if(fabs(Eigen::Vector3f(p.x, p.y, p.z).dot(plane.normal)+plane.d) <= m_Params.tolerance)
+			std::swap(m_vPlaneIndices[w++], m_vPlaneIndices[i]);
+	}
+	plane.begin = begin;
+	plane.end = w;
+	return w-begin;
+}
+
+void ScanFrontEnd::FitPlanes(const pcl::PointCloud<pcl::PointXYZ> &basePC)
+{
+	m_Plane[0] = m_Plane[1] = m_Plane[2] = 0.0;
+	m_PlaneNormal = Eigen::Vector3f(0, 0, 1);
+	m_vPlanes.clear();
+	m_vPlaneIndices = m_vFiltered;
+	m_RansacIterations = 0;
+
+	// Each plane is extracted from the points left by the previous ones, so that every round
+	// works on a smaller set. The first plane is the dominant one, kept whatever its support.
+	size_t begin = 0;
+	while(int(m_vPlanes.size()) < std::max(1, m_Params.maxPlanes))
+	{
+		PlaneSegment plane;
+		size_t support = FitPlane(basePC, begin, plane);
+		if(support == 0 || (!m_vPlanes.empty() && support < size_t(m_Params.minPlaneSupport)))
+			break;
+		// Orient the normals towards +z
+		if(plane.normal[2] < 0)
+		{
+			plane.normal = -plane.normal;
+			plane.d = -plane.d;
+		}
+		m_vPlanes.push_back(plane);
+		begin = plane.end;
+	}
+	m_OutliersBegin = begin;
+
+	if(!m_vPlanes.empty())
+	{
+		const PlaneSegment &floor = m_vPlanes[0];
+		m_PlaneNormal = floor.normal;
+		m_Plane[0] = floor.normal[0]/-floor.normal[2];
+		m_Plane[1] = floor.normal[1]/-floor.normal[2];
+		m_Plane[2] = floor.d/-floor.normal[2];
+	}
+}
+
+void ScanFrontEnd::EstimateNormals(const pcl::PointCloud<pcl::PointXYZ> &basePC)
+{
+	if(m_Params.normalEstimationRadius > 0)
+		m_NormalEstimation.Compute(basePC, m_vFiltered, m_Params.normalEstimationRadius,
+			m_Params.minNormalNeighbours, m_vNormals, m_vHasNormal);
+	else
+		m_vHasNormal.assign(basePC.size(), 0);
+}
+
+bool ScanFrontEnd::IsLevel(const Eigen::Vector3f &normal) const
+{
+	// Angle between the plane and the horizontal
+	double angle = acos(normal[2]/normal.norm());
+	if(fabs(angle) > M_PI/2)
+		angle = M_PI-fabs(angle);
+	return fabs(angle) <= m_Params.traverseThreshold;
+}
+
+void ScanFrontEnd::FindReachablePlanes(const pcl::PointCloud<pcl::PointXYZ> &basePC, std::vector<bool> &vReachable) const
+{
+	vReachable.assign(m_vPlanes.size(), false);
+	if(m_vPlanes.empty() || !IsLevel(m_vPlanes[0].normal))
+		return;
+
+	// Height range of the points of the reachable planes, per square of planeAdjacency meters
+	double a = std::max(m_Params.planeAdjacency, 1e-3);
+	std::map<long long, std::pair<float, float> > heights;
+	std::vector<size_t> vNewPlanes(1, 0);
+	vReachable[0] = true;
+	// The planes are extracted by support, not along the stairs, so the steps may only be
+	// reachable once the planes between them and the floor are
+	while(!vNewPlanes.empty())
+	{
+		for(size_t k = 0; k < vNewPlanes.size(); k++)
+		{
+			const PlaneSegment &plane = m_vPlanes[vNewPlanes[k]];
+			for(size_t i = plane.begin; i < plane.end; i++)
+			{
+				const pcl::PointXYZ &p = basePC[m_vPlaneIndices[i]];
+				long long key = PackIndices(int(floor(p.x/a)), int(floor(p.y/a)));
+				auto it = heights.find(key);
+				if(it == heights.end())
+					heights[key] = std::make_pair(p.z, p.z);
+				else
+				{
+					it->second.first = std::min(it->second.first, p.z);
+					it->second.second = std::max(it->second.second, p.z);
+				}
+			}
+		}
+		vNewPlanes.clear();
+
+		for(size_t k = 1; k < m_vPlanes.size(); k++)
+		{
+			if(vReachable[k] || !IsLevel(m_vPlanes[k].normal))
+				continue;
+			for(size_t i = m_vPlanes[k].begin; i < m_vPlanes[k].end && !vReachable[k]; i++)
+			{
+				const pcl::PointXYZ &p = basePC[m_vPlaneIndices[i]];
+				int x = int(floor(p.x/a));
+				int y = int(floor(p.y/a));
+				for(int dx = -1; dx <= 1 && !vReachable[k]; dx++)
+				{
+					for(int dy = -1; dy <= 1 && !vReachable[k]; dy++)
+					{
+						auto it = heights.find(PackIndices(x+dx, y+dy));
+						if(it != heights.end() && p.z >= it->second.first-m_Params.zThreshold
+							&& p.z <= it->second.second+m_Params.zThreshold)
+							vReachable[k] = true;
+					}
+				}
+			}
+			if(vReachable[k])
+				vNewPlanes.push_back(k);
+		}
+	}
+}
+
+CellState ScanFrontEnd::GetPointState(size_t idx, CellState state)
+{
+	if(state != Traversable || !m_vHasNormal[idx])
+		return state;
+	// The normals are oriented towards +z
+	double angle = acos(std::min(1.0f, m_vNormals[idx][2]));
+	if(angle <= m_Params.traverseThreshold)
+		return Traversable;
+	return NonTraversable;
+}
+
+double ScanFrontEnd::GetLogOdd(const MappingParameters &params, const pcl::PointXYZ &p, int state)
+{
+	double logOdd = 0.0;
+	double distanceToRobot = hypot(p.x, p.y);
+	if(state == Traversable)
+		logOdd = params.beliefMod;
+	else if(state == NonTraversable)
+		logOdd = -params.beliefMod;
+	// Step function such that f(0+)=1 and f(+infinite)->0+, f(0-)=-1 and f(-infinite)->0-
+	// The function chosen is f(x)=tanh(ALPHA*param/x^BETA)
+	return logOdd*tanh(params.alpha*params.stepFunctionParameter/pow(distanceToRobot, params.beta));
+}
+
+void ScanFrontEnd::AddPoint(const pcl::PointXYZ &p, int state, ScanUpdate &update)
+{
+	update.points.push_back(p);
+	update.logOdds.push_back(float(GetLogOdd(m_Params, p, state)));
+}
+
+void ScanFrontEnd::AddObservation(const pcl::PointXYZ &p, float baseZ, int stateAbove, int stateBelow, ScanUpdate &update)
+{
+	JournalObservation observation = {p.x, p.y, p.z, baseZ, (unsigned char)stateAbove, (unsigned char)stateBelow, {0, 0}};
+	update.observations.push_back(observation);
+}
+
+void ScanFrontEnd::Classify(const pcl::PointCloud<pcl::PointXYZ> &basePC, const pcl::PointCloud<pcl::PointXYZ> &worldPC,
+	double ox, double oy, double oz, ScanUpdate &update)
+{
+	update.points.clear();
+	update.logOdds.clear();
+	update.observations.clear();
+	update.points.reserve(m_vFiltered.size());
+	update.logOdds.reserve(m_vFiltered.size());
+	if(m_bKeepObservations)
+		update.observations.reserve(m_vFiltered.size());
+	update.origin = Eigen::Vector3f(ox, oy, oz);
+
+	// Each plane is classified by its own slope. A level plane other than the floor is only
+	// traversable when it can be stepped onto from a traversable plane: a table top is as
+	// level as the floor, but stands above it with no step in between.
+	std::vector<bool> vReachable;
+	FindReachablePlanes(basePC, vReachable);
+	for(size_t k = 0; k < m_vPlanes.size(); k++)
+	{
+		CellState planeState = IsLevel(m_vPlanes[k].normal) ? Traversable : NonTraversable;
+		if(k > 0 && planeState == Traversable && !vReachable[k])
+			planeState = NonTraversable;
+		for(size_t i = m_vPlanes[k].begin; i < m_vPlanes[k].end; i++)
+		{
+			size_t idx = m_vPlaneIndices[i];
+			CellState state = GetPointState(idx, planeState);
+			AddPoint(worldPC[idx], state, update);
+			if(m_bKeepObservations)
+				AddObservation(worldPC[idx], basePC[idx].z, state, state, update);
+		}
+	}
+
+	// The points of no plane are obstacles if they stand on a level floor
+	CellState outlierState = IsLevel(m_PlaneNormal) ? NonTraversable : Unknown;
+	CellState outlierAltState = Unknown;
+	for(size_t i = m_OutliersBegin; i < m_vPlaneIndices.size(); i++)
+	{
+		size_t idx = m_vPlaneIndices[i];
+		// Only the outliers high enough above the base are obstacles
+		if(basePC[idx].z > m_Params.zThreshold)
+			AddPoint(worldPC[idx], GetPointState(idx, outlierState), update);
+		else
+			AddPoint(worldPC[idx], GetPointState(idx, outlierAltState), update);
+		// Both states are journaled, so that the z threshold can be changed offline
+		if(m_bKeepObservations)
+			AddObservation(worldPC[idx], basePC[idx].z, GetPointState(idx, outlierState),
+				GetPointState(idx, outlierAltState), update);
+	}
+}
+
+MappingPipeline::MappingPipeline(const MappingParameters &params) :
+	m_Params(params), m_uiNumScans(0), m_NumSkippedUpdates(0), m_FrontEnd(params)
+{
+	m_pCartography = new Cartography(params.cellSize, params.cellResolution);
+	m_pCartography->SetStateThreshold(params.stateThreshold);
+	m_pCartography->SetAdaptiveResolution(params.fineResolutionRadius, params.maxResolutionLevel);
+	m_pDEM = new DEM(params.cellSize, params.cellResolution);
+	m_pDEM->SetConvergence(params.convergedMeasurements, params.convergenceTolerance);
+	m_pDEM->SetAdaptiveResolution(params.fineResolutionRadius, params.maxResolutionLevel);
+	m_pDistanceMap = new DistanceMap(params.cellSize, params.cellResolution, params.maxObstacleDistance);
+	m_pVoxelMap = nullptr;
+	m_pClearance = nullptr;
+	if(params.voxelSize > 0)
+	{
+		m_pVoxelMap = new VoxelMap(params.voxelSize);
+		m_pClearance = new TiledGrid<ClearancePolicy>(params.cellSize, params.cellResolution);
+	}
+	m_pHitCounts = nullptr;
+	m_pLastSeen = nullptr;
+	if(params.statisticsLayers)
+	{
+		m_pHitCounts = new TiledGrid<HitCountPolicy>(params.cellSize, params.cellResolution);
+		m_pLastSeen = new TiledGrid<LastSeenPolicy>(params.cellSize, params.cellResolution);
+	}
+}
+
+MappingPipeline::~MappingPipeline()
+{
+	delete m_pCartography;
+	delete m_pDEM;
+	delete m_pDistanceMap;
+	delete m_pVoxelMap;
+	delete m_pClearance;
+	delete m_pHitCounts;
+	delete m_pLastSeen;
+}
+
+void MappingPipeline::ProcessScan(const pcl::PointCloud<pcl::PointXYZ> &sensorPC, const pcl::PointCloud<pcl::PointXYZ> &basePC,
+	const pcl::PointCloud<pcl::PointXYZ> &worldPC, double ox, double oy, double oz, StageTimer *pTimer)
+{
+	m_FrontEnd.Process(sensorPC, basePC, worldPC, ox, oy, oz, m_Update, pTimer);
+	ApplyUpdate(m_Update);
+	if(pTimer)
+	{
+		pTimer->Lap(StageMapUpdate);
+		pTimer->GetStats().AddCount(CounterSkippedUpdates, m_NumSkippedUpdates);
+	}
+}
+
+void MappingPipeline::ApplyUpdate(const ScanUpdate &update)
+{
+	m_pCartography->ClearStateChanges();
+	// Resolution of the blocks from their distance to the sensor
+	m_pCartography->SetFocus(update.origin[0], update.origin[1]);
+	m_pDEM->SetFocus(update.origin[0], update.origin[1]);
+
+	for(size_t i = 0; i < update.points.size(); i++)
+	{
+		const pcl::PointXYZ &p = update.points[i];
+		m_pCartography->Update(p.x, p.y, update.logOdds[i]);
+		m_pDEM->Update(p.x, p.y, p.z);
+	}
+
+	// Free space between the sensor and the hits
+	if(m_Params.freeSpaceBelief != 0.0)
+	{
+		std::vector<cv::Point2f> hits(update.points.size());
+		for(size_t i = 0; i < update.points.size(); i++)
+			hits[i] = cv::Point2f(update.points[i].x, update.points[i].y);
+		m_pCartography->UpdateFreeSpace(update.origin[0], update.origin[1], hits, m_Params.freeSpaceBelief);
+	}
+	// Overhangs, in 3D
+	if(m_pVoxelMap)
+	{
+		m_pVoxelMap->Update(update.points, update.origin);
+		UpdateClearance();
+	}
+	if(m_pHitCounts)
+	{
+		for(size_t i = 0; i < update.points.size(); i++)
+		{
+			m_pHitCounts->Update(update.points[i].x, update.points[i].y, 1);
+			m_pLastSeen->Update(update.points[i].x, update.points[i].y, m_uiNumScans);
+		}
+	}
+	m_uiNumScans++;
+	m_NumSkippedUpdates = m_pCartography->TakeNumSkipped()+m_pDEM->TakeNumSkipped();
+
+	// Slope and roughness around the cells updated by this scan
+	m_pDEM->UpdateDerivedLayers();
+	// Distance to the obstacles, updated around the cells which changed state only
+	m_pDistanceMap->Update(m_pCartography->GetStateChanges());
+}
+
+void MappingPipeline::SetMapSharing(bool bShare)
+{
+	m_pCartography->SetTrackLocalChanges(bShare);
+	m_pDEM->SetTrackLocalChanges(bShare);
+}
+
+void MappingPipeline::ExportTiles(std::vector<MapTileData> &tiles)
+{
+	// Both maps share the block layout, so their changes are merged by block
+	std::map<long long, MapTileData> changedTiles;
+	m_pCartography->ExportLocalChanges(changedTiles);
+	m_pDEM->ExportLocalChanges(changedTiles);
+	tiles.clear();
+	tiles.reserve(changedTiles.size());
+	for(auto it = changedTiles.begin(); it != changedTiles.end(); it++)
+		tiles.push_back(it->second);
+}
+
+void MappingPipeline::FuseTiles(const std::vector<MapTileData> &tiles)
+{
+	std::vector<const MapTileData*> pTiles(tiles.size());
+	for(size_t k = 0; k < tiles.size(); k++)
+		pTiles[k] = &tiles[k];
+
+	size_t numChanges = m_pCartography->GetStateChanges().size();
+	m_pCartography->Fuse(pTiles);
+	m_pDEM->Fuse(pTiles);
+	m_pDEM->UpdateDerivedLayers();
+	const std::vector<CellStateChange> &changes = m_pCartography->GetStateChanges();
+	m_pDistanceMap->Update(std::vector<CellStateChange>(changes.begin()+numChanges, changes.end()));
+}
+
+bool MappingPipeline::GetClearance(double x, double y, double &ground, double &clearance) const
+{
+	if(!m_pVoxelMap)
+		return false;
+	return m_pVoxelMap->GetClearance(x, y, m_Params.clearanceMinHeight, m_Params.clearanceMaxHeight, ground, clearance);
+}
+
+void MappingPipeline::UpdateClearance()
+{
+	// Map elements overlapping the columns of the voxels updated by the scan
+	double voxelSize = m_pVoxelMap->GetVoxelSize();
+	double resolution = m_pClearance->GetResolution();
+	const std::vector<long long> &columns = m_pVoxelMap->GetUpdatedColumns();
+	std::vector<long long> elements;
+	for(size_t c = 0; c < columns.size(); c++)
+	{
+		int vx, vy;
+		UnpackIndices(columns[c], vx, vy);
+		int x0 = int(floor(vx*voxelSize/resolution));
+		int x1 = std::max(x0, int(ceil((vx+1)*voxelSize/resolution))-1);
+		int y0 = int(floor(vy*voxelSize/resolution));
+		int y1 = std::max(y0, int(ceil((vy+1)*voxelSize/resolution))-1);
+		for(int x = x0; x <= x1; x++)
+		{
+			for(int y = y0; y <= y1; y++)
+				elements.push_back(PackIndices(x, y));
+		}
+	}
+	std::sort(elements.begin(), elements.end());
+	elements.erase(std::unique(elements.begin(), elements.end()), elements.end());
+
+	// Each element takes the clearance of the column at its center
+	for(size_t e = 0; e < elements.size(); e++)
+	{
+		int x, y;
+		UnpackIndices(elements[e], x, y);
+		double ground, clearance;
+		if(m_pVoxelMap->GetClearance((x+0.5)*resolution, (y+0.5)*resolution, m_Params.clearanceMinHeight,
+			m_Params.clearanceMaxHeight, ground, clearance))
+			m_pClearance->UpdateCell(x, y, float(clearance));
+		else if(m_pClearance->GetCell(x, y))
+			m_pClearance->UpdateCell(x, y, NAN);
+	}
+}
+
+bool MappingPipeline::ComposeClearance(cv::Mat &clearance, cv::Point2i &origin) const
+{
+	if(!m_pClearance)
+		return false;
+	std::vector<cv::Mat> channels;
+	if(!m_pClearance->Compose(channels))
+		return false;
+	clearance = channels[0];
+	origin = m_pClearance->GetOrigin();
+	return true;
+}
+
+bool MappingPipeline::ComposeStatistics(DEMFileData &data) const
+{
+	if(!m_pHitCounts)
+		return false;
+	// Both layers are updated with the same points, so they cover the same blocks
+	return m_pHitCounts->Compose(data) && m_pLastSeen->Compose(data);
+}
+
+bool MappingPipeline::Compose()
+{
+	bool bCartography = m_pCartography->Compose();
+	bool bDEM = m_pDEM->Compose();
+	return bCartography && bDEM;
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <Eigen/Core>
+#include <vector>
+
+#include "Cartography.h"
+#include "Cell.h"
+#include "DEM.h"
+#include "DistanceMap.h"
+#include "MapJournal.h"
+#include "MapLayers.h"
+#include "NormalEstimation.h"
+#include "PipelineStats.h"
+#include "VoxelMap.h"
+
+// Parameters of the mapping pipeline, the defaults being those of the node
+struct MappingParameters
+{
+	double maxRange;
+	int numSamples;	// RANSAC iterations
+	double tolerance;	// Distance to the plane of the RANSAC inliers
+	int maxPlanes;	// Planes extracted one after the other, 1 for the floor only
+	int minPlaneSupport;	// Minimum number of inliers of the planes after the first one
+	double planeAdjacency;	// Horizontal distance in meters within which the points of two planes touch
+	double traverseThreshold;	// Angle threshold to determine if traversable
+	double normalEstimationRadius;	// Normal estimation radius in meters, 0 to use the RANSAC plane only
+	int minNormalNeighbours;	// Minimum number of neighbours to estimate the normal of a point
+	double stepFunctionParameter;
+	double alpha;
+	double beta;
+	double zThreshold;
+	double beliefMod;
+	double freeSpaceBelief;	// Log odd added to the cells crossed by the rays
+	double stateThreshold;	// Log odd beyond which a cell is considered Traversable/NonTraversable
+	double maxObstacleDistance;	// Obstacle distances are capped to this value in meters
+	// Size of a map block in meters, and number of elements per side of a block
+	double cellSize;
+	unsigned int cellResolution;
+	// Side of the voxels of the 3D layer in meters, 0 to disable it
+	double voxelSize;
+	// Heights between which the clearance of a column is searched
+	double clearanceMinHeight;
+	double clearanceMaxHeight;
+	// Keeps the number of hits and the last scan seen of each element
+	bool statisticsLayers;
+	// Heights after which a DEM element converges, 0 to never converge, and distance in meters
+	// to its height within which the next heights are dropped
+	int convergedMeasurements;
+	double convergenceTolerance;
+	// Distance in meters within which the map blocks are at full resolution, 0 for full
+	// resolution everywhere, and number of coarser levels beyond, each halving the resolution
+	double fineResolutionRadius;
+	int maxResolutionLevel;
+
+	MappingParameters();
+};
+
+// Plane extracted from a scan
+struct PlaneSegment
+{
+	// Unit normal oriented towards +z, the plane being normal.p+d=0
+	Eigen::Vector3f normal;
+	double d;
+	// Range of the inliers in the plane indices of the front end
+	size_t begin;
+	size_t end;
+};
+
+// Classified points of a scan, applied to the maps in a single batch
+struct ScanUpdate
+{
+	// Points of the scan in the world frame, and the log odd each adds to the Cartography
+	pcl::PointCloud<pcl::PointXYZ> points;
+	std::vector<float> logOdds;
+	// Position of the sensor in the world frame, origin of the rays
+	Eigen::Vector3f origin;
+	// The points before their conversion to log odds, for the journal, if the front end keeps them
+	std::vector<JournalObservation> observations;
+};
+
+// Stages of the mapping which only depend on the scan: filtering, floor plane fitting, normal
+// estimation and classification of the points. The maps are not touched, so that every sensor
+// can run its own front end on its own thread.
+class ScanFrontEnd
+{
+protected:
+	MappingParameters m_Params;
+
+	// Per point normals, indexed like the point clouds
+	NormalEstimation m_NormalEstimation;
+	std::vector<Eigen::Vector3f> m_vNormals;
+	std::vector<unsigned char> m_vHasNormal;
+
+	// Results of the last scan, as indices in the point clouds
+	std::vector<size_t> m_vFiltered;
+	// Filtered points grouped by plane, in the order of the planes, followed by the points of no plane
+	std::vector<size_t> m_vPlaneIndices;
+	std::vector<PlaneSegment> m_vPlanes;
+	size_t m_OutliersBegin;
+	// Floor plane z = X[0]*x+X[1]*y+X[2] and its unit normal, from the first plane
+	double m_Plane[3];
+	Eigen::Vector3f m_PlaneNormal;
+	unsigned int m_RansacIterations;
+	// Fills the observations of the updates
+	bool m_bKeepObservations;
+
+	// Fits a plane with RANSAC to the points of m_vPlaneIndices from begin on, and moves its
+	// inliers to the front of them. Returns the number of inliers.
+	size_t FitPlane(const pcl::PointCloud<pcl::PointXYZ> &basePC, size_t begin, PlaneSegment &plane);
+	// True if the slope of the plane is within the traversability threshold
+	bool IsLevel(const Eigen::Vector3f &normal) const;
+	// Flags the level planes which can be reached from a level floor: a plane is reachable when
+	// some of its inliers touch those of a reachable plane with a step of at most the z threshold.
+	// Stairs and ramps climb from the floor step by step, a table top stands a whole step above it.
+	void FindReachablePlanes(const pcl::PointCloud<pcl::PointXYZ> &basePC, std::vector<bool> &vReachable) const;
+	// Refines the state given to the point by the height rule with its own normal: a traversable
+	// point on a steep normal is an obstacle. No state is ever promoted by the normal.
+	CellState GetPointState(size_t idx, CellState state);
+	void AddPoint(const pcl::PointXYZ &p, int state, ScanUpdate &update);
+	void AddObservation(const pcl::PointXYZ &p, float baseZ, int stateAbove, int stateBelow, ScanUpdate &update);
+
+public:
+	ScanFrontEnd(const MappingParameters &params);
+
+	// Log odd added to the Cartography by a point of the given CellState, decreasing with its distance
+	static double GetLogOdd(const MappingParameters &params, const pcl::PointXYZ &p, int state);
+	void SetKeepObservations(bool bKeep)	{m_bKeepObservations = bKeep;}
+
+	// Runs every stage on a scan, the three clouds holding the same points in the sensor, base and
+	// world frames, (ox, oy, oz) being the position of the sensor in the world frame. The stages
+	// are recorded in the timer if there is one.
+	void Process(const pcl::PointCloud<pcl::PointXYZ> &sensorPC, const pcl::PointCloud<pcl::PointXYZ> &basePC,
+		const pcl::PointCloud<pcl::PointXYZ> &worldPC, double ox, double oy, double oz, ScanUpdate &update,
+		StageTimer *pTimer = nullptr);
+
+	// Keeps the points which are neither bogus nor beyond the maximum range
+	void Filter(const pcl::PointCloud<pcl::PointXYZ> &sensorPC, const pcl::PointCloud<pcl::PointXYZ> &basePC);
+	// Extracts up to maxPlanes planes from the filtered points with RANSAC, each from the points
+	// left by the previous ones, the first being the floor
+	void FitPlanes(const pcl::PointCloud<pcl::PointXYZ> &basePC);
+	void EstimateNormals(const pcl::PointCloud<pcl::PointXYZ> &basePC);
+	// Turns the points of the planes and the others into the log odds to add to the maps
+	void Classify(const pcl::PointCloud<pcl::PointXYZ> &basePC, const pcl::PointCloud<pcl::PointXYZ> &worldPC,
+		double ox, double oy, double oz, ScanUpdate &update);
+
+	const std::vector<size_t>& GetFilteredIndices() const	{return m_vFiltered;}
+	// Planes, whose points are ranges of GetPlaneIndices
+	const std::vector<PlaneSegment>& GetPlanes() const	{return m_vPlanes;}
+	const std::vector<size_t>& GetPlaneIndices() const	{return m_vPlaneIndices;}
+	const double* GetPlane() const	{return m_Plane;}
+	unsigned int GetRansacIterations() const	{return m_RansacIterations;}
+};
+
+// Core of the mapping, from the point clouds of a scan to the composed maps, without any
+// dependency on ROS so that it can be driven by the node as well as by offline tools.
+class MappingPipeline
+{
+protected:
+	MappingParameters m_Params;
+
+	Cartography *m_pCartography;
+	DEM *m_pDEM;
+	DistanceMap *m_pDistanceMap;
+	// Optional 3D layer, nullptr when disabled, and the clearance of its columns per map element
+	VoxelMap *m_pVoxelMap;
+	TiledGrid<ClearancePolicy> *m_pClearance;
+	// Optional statistics layers, nullptr when disabled
+	TiledGrid<HitCountPolicy> *m_pHitCounts;
+	TiledGrid<LastSeenPolicy> *m_pLastSeen;
+	// Number of scans applied so far
+	unsigned int m_uiNumScans;
+	// Updates of the last scan dropped on saturated or converged elements
+	size_t m_NumSkippedUpdates;
+
+	// Front end of ProcessScan
+	ScanFrontEnd m_FrontEnd;
+	ScanUpdate m_Update;
+
+	// Refreshes the clearance of the map elements over the columns updated by the last scan
+	void UpdateClearance();
+
+public:
+	MappingPipeline(const MappingParameters &params);
+	~MappingPipeline();
+
+	const MappingParameters& GetParameters() const	{return m_Params;}
+
+	// Runs the front end on a scan and applies the result to the maps, see ScanFrontEnd::Process
+	void ProcessScan(const pcl::PointCloud<pcl::PointXYZ> &sensorPC, const pcl::PointCloud<pcl::PointXYZ> &basePC,
+		const pcl::PointCloud<pcl::PointXYZ> &worldPC, double ox, double oy, double oz, StageTimer *pTimer = nullptr);
+	// Updates the maps with the classified points of a scan and the free space up to them. The
+	// state changes of the Cartography are kept until the next call. The points and rays ending
+	// in saturated Cartography elements or converged DEM elements are dropped by the maps.
+	// The blocks are at the resolution of their distance to the origin of the scan.
+	void ApplyUpdate(const ScanUpdate &update);
+	size_t GetNumSkippedUpdates() const	{return m_NumSkippedUpdates;}
+	// Free height above the ground of the column (x, y) from the 3D layer. Returns false if the
+	// layer is disabled or nothing was observed in the column.
+	bool GetClearance(double x, double y, double &ground, double &clearance) const;
+	// Composes the clearance of the map elements, NaN where unknown, and the index over the whole
+	// map of its element (0, 0). Returns false if the 3D layer is disabled or empty.
+	bool ComposeClearance(cv::Mat &clearance, cv::Point2i &origin) const;
+	// Composes the final matrices of the maps. Returns false while the maps are empty.
+	bool Compose();
+	// Composes the statistics layers for an export. Returns false if they are disabled or empty.
+	bool ComposeStatistics(DEMFileData &data) const;
+
+	// Map sharing between robots: keeps track of the local measurements so that they can be exported
+	void SetMapSharing(bool bShare);
+	// Moves the local measurements since the last export into tiles, one per changed block
+	void ExportTiles(std::vector<MapTileData> &tiles);
+	// Fuses tiles received from another robot into the maps, and updates the derived layers
+	// and the obstacle distances around them
+	void FuseTiles(const std::vector<MapTileData> &tiles);
+
+	// Results of the front end for the last scan of ProcessScan
+	const std::vector<size_t>& GetFilteredIndices() const	{return m_FrontEnd.GetFilteredIndices();}
+	const std::vector<PlaneSegment>& GetPlanes() const	{return m_FrontEnd.GetPlanes();}
+	const std::vector<size_t>& GetPlaneIndices() const	{return m_FrontEnd.GetPlaneIndices();}
+	const double* GetPlane() const	{return m_FrontEnd.GetPlane();}
+	unsigned int GetRansacIterations() const	{return m_FrontEnd.GetRansacIterations();}
+
+	Cartography* GetCartography()	{return m_pCartography;}
+	DEM* GetDEM()	{return m_pDEM;}
+	DistanceMap* GetDistanceMap()	{return m_pDistanceMap;}
+	VoxelMap* GetVoxelMap()	{return m_pVoxelMap;}
+};
@@ -0,0 +1,176 @@
+/*
+ * Per point normal estimation with a uniform grid for the neighbour search
+ */
+
+#include "NormalEstimation.h"
+#include <Eigen/Eigenvalues>
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <limits.h>
+#include <math.h>
+
+// Each bin coordinate is stored on 21 bits, centered on 0
+#define BIN_COORD_BITS		21
+#define BIN_COORD_OFFSET	(1 << (BIN_COORD_BITS-1))
+#define BIN_COORD_MASK		((1LL << BIN_COORD_BITS)-1)
+#define EMPTY_SLOT			LLONG_MIN
+
+using namespace std;
+
+UniformGrid::UniformGrid() : m_fBinSize(1.0f), m_uiHashMask(0)
+{
+}
+
+long long UniformGrid::GetBinKey(int i, int j, int k) const
+{
+	return (((long long)(i+BIN_COORD_OFFSET) & BIN_COORD_MASK) << (2*BIN_COORD_BITS))
+		| (((long long)(j+BIN_COORD_OFFSET) & BIN_COORD_MASK) << BIN_COORD_BITS)
+		| ((long long)(k+BIN_COORD_OFFSET) & BIN_COORD_MASK);
+}
+
+long long UniformGrid::GetBinKey(float x, float y, float z) const
+{
+	return GetBinKey(int(floor(x/m_fBinSize)), int(floor(y/m_fBinSize)), int(floor(z/m_fBinSize)));
+}
+
+unsigned int UniformGrid::FindSlot(long long key) const
+{
+	// Fibonacci hashing, then linear probing
+	unsigned int slot = (unsigned int)(((unsigned long long)key*0x9E3779B97F4A7C15ULL) >> 32) & m_uiHashMask;
+	while(m_vBinKeys[slot] != EMPTY_SLOT && m_vBinKeys[slot] != key)
+		slot = (slot+1) & m_uiHashMask;
+	return slot;
+}
+
+void UniformGrid::Build(const pcl::PointCloud<pcl::PointXYZ> &cloud, const std::vector<size_t> &indices, float fRadius)
+{
+	m_fBinSize = fRadius;
+	size_t n = indices.size();
+
+	// Sort the points by bin
+	vector<pair<long long, size_t> > keys(n);
+	for(size_t k = 0; k < n; k++)
+	{
+		const pcl::PointXYZ &p = cloud[indices[k]];
+		keys[k] = make_pair(GetBinKey(p.x, p.y, p.z), indices[k]);
+	}
+	sort(keys.begin(), keys.end());
+
+	m_vPoints.resize(n);
+	m_vIndices.resize(n);
+	size_t numBins = 0;
+	for(size_t k = 0; k < n; k++)
+	{
+		m_vPoints[k] = cloud[keys[k].second];
+		m_vIndices[k] = keys[k].second;
+		if(k == 0 || keys[k].first != keys[k-1].first)
+			numBins++;
+	}
+
+	// Keep the load factor of the hash table under 1/2
+	unsigned int capacity = 16;
+	while(capacity < 2*numBins)
+		capacity <<= 1;
+	m_uiHashMask = capacity-1;
+	m_vBinKeys.assign(capacity, EMPTY_SLOT);
+	m_vBinBegin.resize(capacity);
+	m_vBinEnd.resize(capacity);
+	for(size_t k = 0; k < n; k++)
+	{
+		if(k != 0 && keys[k].first == keys[k-1].first)
+			continue;
+		unsigned int slot = FindSlot(keys[k].first);
+		m_vBinKeys[slot] = keys[k].first;
+		m_vBinBegin[slot] = int(k);
+		size_t end = k+1;
+		while(end < n && keys[end].first == keys[k].first)
+			end++;
+		m_vBinEnd[slot] = int(end);
+	}
+}
+
+int UniformGrid::Accumulate(const pcl::PointXYZ &p, float fRadius, Eigen::Vector3f &sum, Eigen::Matrix3f &sumOuter) const
+{
+	float fRadius2 = fRadius*fRadius;
+	int i0 = int(floor(p.x/m_fBinSize));
+	int j0 = int(floor(p.y/m_fBinSize));
+	int k0 = int(floor(p.z/m_fBinSize));
+	int count = 0;
+	sum.setZero();
+	sumOuter.setZero();
+	for(int i = i0-1; i <= i0+1; i++)
+	{
+		for(int j = j0-1; j <= j0+1; j++)
+		{
+			for(int k = k0-1; k <= k0+1; k++)
+			{
+				unsigned int slot = FindSlot(GetBinKey(i, j, k));
+				if(m_vBinKeys[slot] == EMPTY_SLOT)
+					continue;
+				for(int q = m_vBinBegin[slot]; q < m_vBinEnd[slot]; q++)
+				{
+					// Relative to p to keep the float covariance accurate
+					Eigen::Vector3f d(m_vPoints[q].x-p.x, m_vPoints[q].y-p.y, m_vPoints[q].z-p.z);
+					if(d.squaredNorm() > fRadius2)
+						continue;
+					sum += d;
+					sumOuter += d*d.transpose();
+					count++;
+				}
+			}
+		}
+	}
+	return count;
+}
+
+class NormalEstimationBody : public cv::ParallelLoopBody
+{
+	const UniformGrid &m_Grid;
+	const pcl::PointCloud<pcl::PointXYZ> &m_Cloud;
+	const std::vector<size_t> &m_vIndices;
+	const float m_fRadius;
+	const int m_MinNeighbours;
+	std::vector<Eigen::Vector3f> &m_vNormals;
+	std::vector<unsigned char> &m_vHasNormal;
+
+public:
+	NormalEstimationBody(const UniformGrid &grid, const pcl::PointCloud<pcl::PointXYZ> &cloud, const std::vector<size_t> &indices,
+		float fRadius, int minNeighbours, std::vector<Eigen::Vector3f> &normals, std::vector<unsigned char> &hasNormal) :
+		m_Grid(grid), m_Cloud(cloud), m_vIndices(indices), m_fRadius(fRadius), m_MinNeighbours(minNeighbours),
+		m_vNormals(normals), m_vHasNormal(hasNormal)	{}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver;
+		for(int r = range.start; r < range.end; r++)
+		{
+			size_t idx = m_vIndices[r];
+			Eigen::Vector3f sum;
+			Eigen::Matrix3f sumOuter;
+			int count = m_Grid.Accumulate(m_Cloud[idx], m_fRadius, sum, sumOuter);
+			if(count < m_MinNeighbours || count < 3)
+				continue;
+			Eigen::Vector3f mean = sum/float(count);
+			Eigen::Matrix3f covariance = sumOuter/float(count)-mean*mean.transpose();
+			// The normal is the direction of least variance
+			solver.computeDirect(covariance);
+			Eigen::Vector3f normal = solver.eigenvectors().col(0);
+			if(normal[2] < 0)
+				normal = -normal;
+			m_vNormals[idx] = normal;
+			m_vHasNormal[idx] = 1;
+		}
+	}
+};
+
+void NormalEstimation::Compute(const pcl::PointCloud<pcl::PointXYZ> &cloud, const std::vector<size_t> &indices, float fRadius,
+	int minNeighbours, std::vector<Eigen::Vector3f> &normals, std::vector<unsigned char> &hasNormal)
+{
+	normals.resize(cloud.size());
+	hasNormal.assign(cloud.size(), 0);
+	if(indices.empty())
+		return;
+	m_Grid.Build(cloud, indices, fRadius);
+	cv::parallel_for_(cv::Range(0, int(indices.size())),
+		NormalEstimationBody(m_Grid, cloud, indices, fRadius, minNeighbours, normals, hasNormal));
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <Eigen/Core>
+#include <vector>
+
+// Spatial hash of a point cloud in cubic bins whose side is the search radius.
+// All the neighbours of a point within that radius are in the 27 bins around it,
+// which makes fixed radius searches much cheaper than with a kd-tree.
+class UniformGrid
+{
+protected:
+	float m_fBinSize;
+	// Points sorted by bin, so that the points of a bin are contiguous
+	std::vector<pcl::PointXYZ> m_vPoints;
+	// Index in the original cloud of each point in m_vPoints
+	std::vector<size_t> m_vIndices;
+	// Open addressing hash table: bin key -> [begin, end[ in m_vPoints
+	std::vector<long long> m_vBinKeys;
+	std::vector<int> m_vBinBegin;
+	std::vector<int> m_vBinEnd;
+	unsigned int m_uiHashMask;
+
+	long long GetBinKey(float x, float y, float z) const;
+	long long GetBinKey(int i, int j, int k) const;
+	// Returns the slot of key in the hash table, or the empty slot where it should go
+	unsigned int FindSlot(long long key) const;
+
+public:
+	UniformGrid();
+
+	// Builds the grid from the points of cloud listed in indices
+	void Build(const pcl::PointCloud<pcl::PointXYZ> &cloud, const std::vector<size_t> &indices, float fRadius);
+	// Sums the points within fRadius of p and their outer products
+	int Accumulate(const pcl::PointXYZ &p, float fRadius, Eigen::Vector3f &sum, Eigen::Matrix3f &sumOuter) const;
+};
+
+// Estimates the normal of each point from the covariance of its neighbours (PCA).
+class NormalEstimation
+{
+protected:
+	UniformGrid m_Grid;
+
+public:
+	// Computes the normals of the points of cloud listed in indices, in parallel.
+	// The normals are indexed like the cloud and oriented towards +z. Points with fewer than
+	// minNeighbours neighbours within fRadius get no normal (hasNormal is 0).
+	void Compute(const pcl::PointCloud<pcl::PointXYZ> &cloud, const std::vector<size_t> &indices, float fRadius,
+		int minNeighbours, std::vector<Eigen::Vector3f> &normals, std::vector<unsigned char> &hasNormal);
+};
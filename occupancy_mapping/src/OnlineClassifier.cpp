@@ -0,0 +1,71 @@
+/*
+ * Online traversability classifier: random Fourier features + SGD logistic regression
+ */
+
+#include "OnlineClassifier.h"
+#include <math.h>
+#include <random>
+
+OnlineClassifier::OnlineClassifier(int numFeatures, double gamma, double learningRate, double regularisation,
+	float fHeightScale, float fVarianceScale, unsigned int seed) :
+	m_NumFeatures(numFeatures), m_fHeightScale(fHeightScale), m_fVarianceScale(fVarianceScale),
+	m_dLearningRate(learningRate), m_dRegularisation(regularisation),
+	m_vProjections(2*numFeatures), m_vPhases(numFeatures), m_vWeights(numFeatures, 0.0),
+	m_dBias(0.0), m_NumUpdates(0)
+{
+	// The Fourier transform of exp(-gamma*|d|^2) is a gaussian of variance 2*gamma
+	std::mt19937 generator(seed);
+	std::normal_distribution<float> projection(0.0f, float(sqrt(2.0*gamma)));
+	std::uniform_real_distribution<float> phase(0.0f, float(2.0*M_PI));
+	for(int k = 0; k < numFeatures; k++)
+	{
+		m_vProjections[2*k] = projection(generator);
+		m_vProjections[2*k+1] = projection(generator);
+		m_vPhases[k] = phase(generator);
+	}
+}
+
+void OnlineClassifier::ComputeFeatures(float height, float variance, std::vector<float> &features) const
+{
+	float u = height/m_fHeightScale;
+	float v = variance/m_fVarianceScale;
+	float norm = sqrtf(2.0f/m_NumFeatures);
+	features.resize(m_NumFeatures);
+	for(int k = 0; k < m_NumFeatures; k++)
+		features[k] = norm*cosf(m_vProjections[2*k]*u+m_vProjections[2*k+1]*v+m_vPhases[k]);
+}
+
+float OnlineClassifier::GetDecisionValue(float height, float variance) const
+{
+	std::vector<float> features;
+	ComputeFeatures(height, variance, features);
+	double value = m_dBias;
+	for(int k = 0; k < m_NumFeatures; k++)
+		value += m_vWeights[k]*features[k];
+	return float(value);
+}
+
+void OnlineClassifier::Update(float height, float variance, float label)
+{
+	std::vector<float> features;
+	ComputeFeatures(height, variance, features);
+	double value = m_dBias;
+	for(int k = 0; k < m_NumFeatures; k++)
+		value += m_vWeights[k]*features[k];
+
+	// Gradient of the logistic loss log(1+exp(-label*value))
+	double gradient = -label/(1.0+exp(label*value));
+	// Decreasing step size so that the model settles while still following slow changes
+	double rate = m_dLearningRate/(1.0+m_dLearningRate*m_dRegularisation*m_NumUpdates);
+	for(int k = 0; k < m_NumFeatures; k++)
+		m_vWeights[k] -= rate*(gradient*features[k]+m_dRegularisation*m_vWeights[k]);
+	m_dBias -= rate*gradient;
+	m_NumUpdates++;
+}
+
+void OnlineClassifier::Predict(const cv::Mat &features, cv::Mat &results) const
+{
+	results.create(features.rows, 1, CV_32FC1);
+	for(int k = 0; k < features.rows; k++)
+		results.at<float>(k, 0) = Predict(features.at<float>(k, 0), features.at<float>(k, 1));
+}
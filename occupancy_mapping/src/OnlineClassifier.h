@@ -0,0 +1,43 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+// Traversability classifier on (height, height variance) learnt online.
+// The inputs are mapped to random Fourier features approximating an RBF kernel
+// (Rahimi & Recht, 2007), and a linear logistic model on these features is updated by
+// stochastic gradient descent, one labelled sample at a time. An update costs O(numFeatures),
+// so the model can follow the map at every scan without batch retraining.
+class OnlineClassifier
+{
+protected:
+	const int m_NumFeatures;
+	// Inputs are divided by these scales before the kernel is applied
+	const float m_fHeightScale;
+	const float m_fVarianceScale;
+	const double m_dLearningRate;
+	const double m_dRegularisation;
+	// Random projections (2 per feature) and phases of the Fourier features
+	std::vector<float> m_vProjections;
+	std::vector<float> m_vPhases;
+	// Linear model
+	std::vector<double> m_vWeights;
+	double m_dBias;
+	long m_NumUpdates;
+
+	void ComputeFeatures(float height, float variance, std::vector<float> &features) const;
+
+public:
+	// gamma is the parameter of the approximated kernel exp(-gamma*|u-v|^2), on scaled inputs
+	OnlineClassifier(int numFeatures, double gamma, double learningRate, double regularisation,
+		float fHeightScale, float fVarianceScale, unsigned int seed = 0);
+
+	// One SGD step on a sample labelled +1 (Traversable) or -1 (NonTraversable)
+	void Update(float height, float variance, float label);
+	float GetDecisionValue(float height, float variance) const;
+	// Same labels as CvSVM::predict (+1/-1)
+	inline float Predict(float height, float variance) const	{return (GetDecisionValue(height, variance) >= 0.0f) ? 1.0f : -1.0f;}
+	// Predicts every row (height, variance) of features into results (one column)
+	void Predict(const cv::Mat &features, cv::Mat &results) const;
+	long GetNumUpdates() const	{return m_NumUpdates;}
+};
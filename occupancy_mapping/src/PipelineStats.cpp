@@ -0,0 +1,106 @@
+/*
+ * Latency and throughput statistics of the mapping pipeline
+ */
+
+#include "PipelineStats.h"
+#include <algorithm>
+#include <time.h>
+
+static const char* STAGE_NAMES[NumPipelineStages] =
+{
+	"ingestion", "filtering", "ransac", "normals", "map_update", "publish", "svm", "total"
+};
+
+static const char* COUNTER_NAMES[NumPipelineCounters] =
+{
+	"input_points", "filtered_points", "inliers", "ransac_iterations", "skipped_updates"
+};
+
+RollingWindow::RollingWindow(size_t size) : m_vValues(size, 0.0f), m_Next(0), m_Count(0)
+{
+}
+
+float RollingWindow::GetPercentile(double p) const
+{
+	if(m_Count == 0)
+		return 0.0f;
+	std::vector<float> values(m_vValues.begin(), m_vValues.begin()+m_Count);
+	size_t k = std::min(size_t(p*m_Count), m_Count-1);
+	std::nth_element(values.begin(), values.begin()+k, values.end());
+	return values[k];
+}
+
+float RollingWindow::GetMean() const
+{
+	if(m_Count == 0)
+		return 0.0f;
+	double sum = 0.0;
+	for(size_t k = 0; k < m_Count; k++)
+		sum += m_vValues[k];
+	return float(sum/m_Count);
+}
+
+PipelineStats::PipelineStats(size_t windowSize) : m_NumFrames(0)
+{
+	for(int k = 0; k < NumPipelineStages; k++)
+		m_Durations[k] = RollingWindow(windowSize);
+	for(int k = 0; k < NumPipelineCounters; k++)
+		m_Counts[k] = RollingWindow(windowSize);
+}
+
+double PipelineStats::Now()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+const char* PipelineStats::GetStageName(PipelineStage stage)
+{
+	return STAGE_NAMES[stage];
+}
+
+const char* PipelineStats::GetCounterName(PipelineCounter counter)
+{
+	return COUNTER_NAMES[counter];
+}
+
+void PipelineStats::AddDuration(PipelineStage stage, double seconds)
+{
+	boost::mutex::scoped_lock lock(m_Mutex);
+	m_Durations[stage].Add(float(seconds));
+}
+
+void PipelineStats::AddCount(PipelineCounter counter, double value)
+{
+	boost::mutex::scoped_lock lock(m_Mutex);
+	m_Counts[counter].Add(float(value));
+}
+
+void PipelineStats::EndFrame()
+{
+	boost::mutex::scoped_lock lock(m_Mutex);
+	m_NumFrames++;
+}
+
+void PipelineStats::GetDurationPercentiles(PipelineStage stage, float &p50, float &p95, float &p99) const
+{
+	boost::mutex::scoped_lock lock(m_Mutex);
+	p50 = 1000.0f*m_Durations[stage].GetPercentile(0.50);
+	p95 = 1000.0f*m_Durations[stage].GetPercentile(0.95);
+	p99 = 1000.0f*m_Durations[stage].GetPercentile(0.99);
+}
+
+float PipelineStats::GetMeanCount(PipelineCounter counter) const
+{
+	boost::mutex::scoped_lock lock(m_Mutex);
+	return m_Counts[counter].GetMean();
+}
+
+unsigned int PipelineStats::TakeNumFrames()
+{
+	boost::mutex::scoped_lock lock(m_Mutex);
+	unsigned int numFrames = m_NumFrames;
+	m_NumFrames = 0;
+	return numFrames;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <boost/thread/mutex.hpp>
+#include <string>
+#include <vector>
+
+// Stages of the mapping pipeline which are timed
+enum PipelineStage
+{
+	StageIngestion = 0,	// Conversion and transformation of the point cloud
+	StageFiltering,
+	StageRansac,
+	StageNormals,
+	StageMapUpdate,
+	StagePublish,
+	StageSVM,
+	StageTotal,
+	NumPipelineStages
+};
+
+// Quantities counted at each frame
+enum PipelineCounter
+{
+	CounterInputPoints = 0,
+	CounterFilteredPoints,
+	CounterInliers,
+	CounterRansacIterations,
+	CounterSkippedUpdates,	// Map updates dropped on saturated or converged elements
+	NumPipelineCounters
+};
+
+// Rolling window of the last values of a measure
+class RollingWindow
+{
+protected:
+	std::vector<float> m_vValues;
+	size_t m_Next;
+	size_t m_Count;
+
+public:
+	RollingWindow(size_t size = 256);
+
+	inline void Add(float value)
+	{
+		m_vValues[m_Next] = value;
+		m_Next = (m_Next+1)%m_vValues.size();
+		if(m_Count < m_vValues.size())
+			m_Count++;
+	}
+	size_t GetCount() const	{return m_Count;}
+	// p-th percentile (p in [0, 1]) of the values in the window
+	float GetPercentile(double p) const;
+	float GetMean() const;
+};
+
+// Per stage durations and per frame counts of the mapping pipeline over the last frames.
+// Recording is a clock read and a ring buffer write, cheap enough to be left on; the
+// percentiles are only sorted out when a summary is requested.
+class PipelineStats
+{
+protected:
+	mutable boost::mutex m_Mutex;
+	RollingWindow m_Durations[NumPipelineStages];
+	RollingWindow m_Counts[NumPipelineCounters];
+	// Frames since the last call to TakeNumFrames
+	unsigned int m_NumFrames;
+
+public:
+	PipelineStats(size_t windowSize = 256);
+
+	// Monotonic time in seconds
+	static double Now();
+	static const char* GetStageName(PipelineStage stage);
+	static const char* GetCounterName(PipelineCounter counter);
+
+	void AddDuration(PipelineStage stage, double seconds);
+	void AddCount(PipelineCounter counter, double value);
+	void EndFrame();
+
+	// Percentiles of the durations of a stage, in milliseconds
+	void GetDurationPercentiles(PipelineStage stage, float &p50, float &p95, float &p99) const;
+	float GetMeanCount(PipelineCounter counter) const;
+	// Returns the number of frames since the last call
+	unsigned int TakeNumFrames();
+};
+
+// Records the time spent between successive laps of one frame
+class StageTimer
+{
+protected:
+	PipelineStats &m_Stats;
+	double m_dStart;
+	double m_dLast;
+
+public:
+	StageTimer(PipelineStats &stats) : m_Stats(stats)
+	{
+		m_dStart = m_dLast = PipelineStats::Now();
+	}
+
+	PipelineStats& GetStats()	{return m_Stats;}
+
+	// Records the time since the previous lap as the duration of stage
+	void Lap(PipelineStage stage)
+	{
+		double now = PipelineStats::Now();
+		m_Stats.AddDuration(stage, now-m_dLast);
+		m_dLast = now;
+	}
+
+	// Starts the next lap now, leaving out of it the time the frame waited between two threads.
+	// That time still counts in the whole frame.
+	void Resume()
+	{
+		m_dLast = PipelineStats::Now();
+	}
+
+	// Records the whole frame
+	void End()
+	{
+		m_Stats.AddDuration(StageTotal, PipelineStats::Now()-m_dStart);
+		m_Stats.EndFrame();
+	}
+};
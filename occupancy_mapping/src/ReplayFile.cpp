@@ -0,0 +1,87 @@
+/*
+ * Recording and replay of the scans fed to the mapping
+ */
+
+#include "ReplayFile.h"
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+static const char REPLAY_MAGIC[4] = {'O', 'M', 'R', 'P'};
+static const uint32_t REPLAY_VERSION = 1;
+static const std::streamoff REPLAY_HEADER_SIZE = sizeof(REPLAY_MAGIC)+sizeof(REPLAY_VERSION);
+
+Eigen::Affine3f ReplayFrame::GetTransform(const float pose[7])
+{
+	Eigen::Affine3f transform = Eigen::Affine3f::Identity();
+	transform.translate(Eigen::Vector3f(pose[0], pose[1], pose[2]));
+	transform.rotate(Eigen::Quaternionf(pose[6], pose[3], pose[4], pose[5]));
+	return transform;
+}
+
+bool ReplayWriter::Open(const std::string &path)
+{
+	m_File.open(path.c_str(), std::ios_base::binary | std::ios_base::trunc);
+	if(!m_File.is_open())
+		return false;
+	m_File.write(REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+	m_File.write((const char*)&REPLAY_VERSION, sizeof(REPLAY_VERSION));
+	return m_File.good();
+}
+
+bool ReplayWriter::Write(const ReplayFrame &frame)
+{
+	uint32_t numPoints = uint32_t(frame.cloud.size());
+	std::vector<float> points(3*numPoints);
+	for(uint32_t i = 0; i < numPoints; i++)
+	{
+		points[3*i] = frame.cloud[i].x;
+		points[3*i+1] = frame.cloud[i].y;
+		points[3*i+2] = frame.cloud[i].z;
+	}
+	m_File.write((const char*)&frame.stamp, sizeof(frame.stamp));
+	m_File.write((const char*)frame.sensorToBase, sizeof(frame.sensorToBase));
+	m_File.write((const char*)frame.sensorToWorld, sizeof(frame.sensorToWorld));
+	m_File.write((const char*)&numPoints, sizeof(numPoints));
+	if(numPoints > 0)
+		m_File.write((const char*)&points[0], points.size()*sizeof(float));
+	return m_File.good();
+}
+
+bool ReplayReader::Open(const std::string &path)
+{
+	m_File.open(path.c_str(), std::ios_base::binary);
+	if(!m_File.is_open())
+		return false;
+	char magic[4];
+	uint32_t version = 0;
+	m_File.read(magic, sizeof(magic));
+	m_File.read((char*)&version, sizeof(version));
+	return m_File.good() && memcmp(magic, REPLAY_MAGIC, sizeof(magic)) == 0 && version == REPLAY_VERSION;
+}
+
+bool ReplayReader::Read(ReplayFrame &frame)
+{
+	uint32_t numPoints = 0;
+	m_File.read((char*)&frame.stamp, sizeof(frame.stamp));
+	m_File.read((char*)frame.sensorToBase, sizeof(frame.sensorToBase));
+	m_File.read((char*)frame.sensorToWorld, sizeof(frame.sensorToWorld));
+	m_File.read((char*)&numPoints, sizeof(numPoints));
+	if(!m_File.good())
+		return false;
+	std::vector<float> points(3*size_t(numPoints));
+	if(numPoints > 0)
+		m_File.read((char*)&points[0], points.size()*sizeof(float));
+	if(!m_File.good())
+		return false;
+	frame.cloud.resize(numPoints);
+	for(uint32_t i = 0; i < numPoints; i++)
+		frame.cloud[i] = pcl::PointXYZ(points[3*i], points[3*i+1], points[3*i+2]);
+	return true;
+}
+
+void ReplayReader::Rewind()
+{
+	m_File.clear();
+	m_File.seekg(REPLAY_HEADER_SIZE);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <Eigen/Geometry>
+#include <fstream>
+#include <string>
+
+// One recorded scan: the cloud in the sensor frame and the pose of the sensor in the base and
+// world frames, each pose being a translation followed by a quaternion (x, y, z, qx, qy, qz, qw)
+struct ReplayFrame
+{
+	double stamp;
+	float sensorToBase[7];
+	float sensorToWorld[7];
+	pcl::PointCloud<pcl::PointXYZ> cloud;
+
+	static Eigen::Affine3f GetTransform(const float pose[7]);
+};
+
+// Binary recording of scans: a "OMRP" magic and a version number, then the frames one after the
+// other (stamp, poses, number of points and the points as float triplets), in native byte order.
+class ReplayWriter
+{
+protected:
+	std::ofstream m_File;
+
+public:
+	bool Open(const std::string &path);
+	bool IsOpen() const	{return m_File.is_open();}
+	bool Write(const ReplayFrame &frame);
+	void Close()	{m_File.close();}
+};
+
+class ReplayReader
+{
+protected:
+	std::ifstream m_File;
+
+public:
+	bool Open(const std::string &path);
+	// Reads the next frame. Returns false at the end of the file or if it is truncated.
+	bool Read(ReplayFrame &frame);
+	// Goes back to the first frame
+	void Rewind();
+};
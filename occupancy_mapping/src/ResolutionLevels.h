@@ -0,0 +1,73 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <math.h>
+
+// Level of detail of the map blocks, from their distance to the robot. A block at level L holds
+// elements standing for 2^L x 2^L full resolution elements, the elements along the far borders
+// of the block standing for fewer when the block size is not a multiple of 2^L.
+// The blocks within the fine radius of the robot are at full resolution, those within twice the
+// radius at level 1, and so on up to the maximum level. A block is created at the level of its
+// distance and refined when the robot comes closer, never coarsened again.
+class ResolutionLevels
+{
+protected:
+	const double m_dCellSize;
+	const unsigned int m_uiCellSize;
+	double m_dFineRadius;
+	int m_iMaxLevel;
+	// Position of the robot, the blocks being at full resolution until it is known
+	bool m_bHasFocus;
+	double m_dFocusX;
+	double m_dFocusY;
+
+public:
+	ResolutionLevels(double dCellSize, unsigned int uiCellSize) :
+		m_dCellSize(dCellSize), m_uiCellSize(uiCellSize), m_dFineRadius(0.0), m_iMaxLevel(0),
+		m_bHasFocus(false), m_dFocusX(0.0), m_dFocusY(0.0)	{}
+
+	// A radius of 0 keeps every block at full resolution. The levels stop once an element
+	// would stand for the whole block.
+	void Set(double dFineRadius, int iMaxLevel)
+	{
+		m_dFineRadius = dFineRadius;
+		m_iMaxLevel = 0;
+		while(m_iMaxLevel < iMaxLevel && (1U << (m_iMaxLevel+1)) <= m_uiCellSize)
+			m_iMaxLevel++;
+	}
+	void SetFocus(double x, double y)	{m_bHasFocus = true; m_dFocusX = x; m_dFocusY = y;}
+	bool IsEnabled() const	{return m_dFineRadius > 0.0 && m_iMaxLevel > 0;}
+
+	// Level of the block (i, j) with the robot at the focus
+	int GetLevel(int i, int j) const
+	{
+		if(!m_bHasFocus || !IsEnabled())
+			return 0;
+		// Distance from the robot to the closest point of the block
+		double dx = std::max(std::max(i*m_dCellSize-m_dFocusX, m_dFocusX-(i+1)*m_dCellSize), 0.0);
+		double dy = std::max(std::max(j*m_dCellSize-m_dFocusY, m_dFocusY-(j+1)*m_dCellSize), 0.0);
+		double distance = hypot(dx, dy);
+		int level = 0;
+		for(double radius = m_dFineRadius; distance > radius && level < m_iMaxLevel; radius *= 2)
+			level++;
+		return level;
+	}
+
+	// Elements per side of a block at the level
+	static inline int GetSize(unsigned int uiCellSize, int level)	{return (int(uiCellSize)+(1 << level)-1) >> level;}
+	// Full resolution elements per side covered by the element k of a block side at the level
+	static inline int GetCoverage(unsigned int uiCellSize, int level, int k)	{return std::min(1 << level, int(uiCellSize)-(k << level));}
+
+	// Copies a block matrix at the level into uiCellSize x uiCellSize full resolution values
+	template<class T>
+	static void Expand(const cv::Mat &matrix, int level, unsigned int uiCellSize, T *pOut)
+	{
+		for(int m = 0; m < int(uiCellSize); m++)
+		{
+			const T *pRow = matrix.ptr<T>(m >> level);
+			for(int n = 0; n < int(uiCellSize); n++)
+				pOut[m*uiCellSize+n] = pRow[n >> level];
+		}
+	}
+};
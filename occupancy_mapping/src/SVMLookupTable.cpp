@@ -0,0 +1,141 @@
+/*
+ * Lookup table approximation of the traversability SVM
+ */
+
+#include "SVMLookupTable.h"
+#include <float.h>
+#include <math.h>
+
+using namespace std;
+
+// Evaluates the exact decision function on rows of the grid
+class DecisionFunctionBody : public cv::ParallelLoopBody
+{
+	const CvSVM &m_SVM;
+	const int m_Size;
+	const float m_fMinHeight;
+	const float m_fMinVariance;
+	const float m_fHeightStep;
+	const float m_fVarianceStep;
+	// Offset of the evaluated points in grid steps: 0 for the nodes, 0.5 for the cell middles
+	const float m_fOffset;
+	std::vector<float> &m_vValues;
+	std::vector<float> &m_vLabels;
+
+public:
+	DecisionFunctionBody(const CvSVM &svm, int size, float fMinHeight, float fMinVariance, float fHeightStep,
+		float fVarianceStep, float fOffset, std::vector<float> &values, std::vector<float> &labels) :
+		m_SVM(svm), m_Size(size), m_fMinHeight(fMinHeight), m_fMinVariance(fMinVariance),
+		m_fHeightStep(fHeightStep), m_fVarianceStep(fVarianceStep), m_fOffset(fOffset),
+		m_vValues(values), m_vLabels(labels)	{}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		cv::Mat sample(1, 2, CV_32FC1);
+		for(int i = range.start; i < range.end; i++)
+		{
+			for(int j = 0; j < m_Size; j++)
+			{
+				sample.at<float>(0, 0) = m_fMinHeight+(i+m_fOffset)*m_fHeightStep;
+				sample.at<float>(0, 1) = m_fMinVariance+(j+m_fOffset)*m_fVarianceStep;
+				m_vValues[i*m_Size+j] = m_SVM.predict(sample, true);
+				m_vLabels[i*m_Size+j] = m_SVM.predict(sample);
+			}
+		}
+	}
+};
+
+SVMLookupTable::SVMLookupTable() : m_Size(0),
+	m_fMinHeight(0.0f), m_fMaxHeight(0.0f), m_fMinVariance(0.0f), m_fMaxVariance(0.0f),
+	m_fHeightStep(1.0f), m_fVarianceStep(1.0f), m_fMaxError(0.0f), m_fMismatchRate(0.0f)
+{
+}
+
+void SVMLookupTable::Build(const CvSVM &svm, float fMinHeight, float fMaxHeight, float fMinVariance, float fMaxVariance, int size)
+{
+	m_Size = std::max(size, 2);
+	m_fMinHeight = fMinHeight;
+	m_fMaxHeight = std::max(fMaxHeight, fMinHeight+FLT_EPSILON);
+	m_fMinVariance = fMinVariance;
+	m_fMaxVariance = std::max(fMaxVariance, fMinVariance+FLT_EPSILON);
+	m_fHeightStep = (m_fMaxHeight-m_fMinHeight)/(m_Size-1);
+	m_fVarianceStep = (m_fMaxVariance-m_fMinVariance)/(m_Size-1);
+
+	std::vector<float> labels(m_Size*m_Size);
+	m_vTable.resize(m_Size*m_Size);
+	cv::parallel_for_(cv::Range(0, m_Size), DecisionFunctionBody(svm, m_Size, m_fMinHeight, m_fMinVariance,
+		m_fHeightStep, m_fVarianceStep, 0.0f, m_vTable, labels));
+
+	// The sign of the decision value relative to the labels depends on the order of the classes
+	// in the training set: orient it with the node where the SVM is the most confident
+	size_t best = 0;
+	for(size_t k = 1; k < m_vTable.size(); k++)
+	{
+		if(fabs(m_vTable[k]) > fabs(m_vTable[best]))
+			best = k;
+	}
+	float sign = ((m_vTable[best] >= 0.0f) == (labels[best] > 0.0f)) ? 1.0f : -1.0f;
+	for(size_t k = 0; k < m_vTable.size(); k++)
+		m_vTable[k] *= sign;
+
+	// Measure the approximation at the middle of the grid cells, where it is the worst
+	std::vector<float> values(m_Size*m_Size);
+	cv::parallel_for_(cv::Range(0, m_Size-1), DecisionFunctionBody(svm, m_Size, m_fMinHeight, m_fMinVariance,
+		m_fHeightStep, m_fVarianceStep, 0.5f, values, labels));
+	m_fMaxError = 0.0f;
+	int numMismatches = 0;
+	for(int i = 0; i < m_Size-1; i++)
+	{
+		for(int j = 0; j < m_Size-1; j++)
+		{
+			float height = m_fMinHeight+(i+0.5f)*m_fHeightStep;
+			float variance = m_fMinVariance+(j+0.5f)*m_fVarianceStep;
+			float error = GetDecisionValue(height, variance)-sign*values[i*m_Size+j];
+			m_fMaxError = std::max(m_fMaxError, float(fabs(error)));
+			if(Predict(height, variance) != labels[i*m_Size+j])
+				numMismatches++;
+		}
+	}
+	m_fMismatchRate = float(numMismatches)/((m_Size-1)*(m_Size-1));
+}
+
+void SVMLookupTable::Build(const CvSVM &svm, const cv::Mat &features, int size)
+{
+	// Without features there is no range to cover, so the SVM is used as is
+	if(features.rows == 0)
+	{
+		m_vTable.clear();
+		return;
+	}
+	float fMinHeight = FLT_MAX, fMaxHeight = -FLT_MAX;
+	float fMinVariance = FLT_MAX, fMaxVariance = -FLT_MAX;
+	for(int k = 0; k < features.rows; k++)
+	{
+		fMinHeight = std::min(fMinHeight, features.at<float>(k, 0));
+		fMaxHeight = std::max(fMaxHeight, features.at<float>(k, 0));
+		fMinVariance = std::min(fMinVariance, features.at<float>(k, 1));
+		fMaxVariance = std::max(fMaxVariance, features.at<float>(k, 1));
+	}
+	Build(svm, fMinHeight, fMaxHeight, fMinVariance, fMaxVariance, size);
+}
+
+float SVMLookupTable::GetDecisionValue(float height, float variance) const
+{
+	// Continuous grid coordinates, clamped to the grid
+	float u = std::min(std::max((height-m_fMinHeight)/m_fHeightStep, 0.0f), float(m_Size-1));
+	float v = std::min(std::max((variance-m_fMinVariance)/m_fVarianceStep, 0.0f), float(m_Size-1));
+	int i = std::min(int(u), m_Size-2);
+	int j = std::min(int(v), m_Size-2);
+	float du = u-i;
+	float dv = v-j;
+	const float *row0 = &m_vTable[i*m_Size+j];
+	const float *row1 = row0+m_Size;
+	return (1.0f-du)*((1.0f-dv)*row0[0]+dv*row0[1])+du*((1.0f-dv)*row1[0]+dv*row1[1]);
+}
+
+void SVMLookupTable::Predict(const cv::Mat &features, cv::Mat &results) const
+{
+	results.create(features.rows, 1, CV_32FC1);
+	for(int k = 0; k < features.rows; k++)
+		results.at<float>(k, 0) = Predict(features.at<float>(k, 0), features.at<float>(k, 1));
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/ml/ml.hpp>
+#include <vector>
+
+// Decision function of a two feature SVM (height, height variance) rasterised on a regular grid.
+// Once built, a prediction is a bilinear interpolation in the table instead of a kernel
+// evaluation against every support vector.
+class SVMLookupTable
+{
+protected:
+	int m_Size;
+	float m_fMinHeight;
+	float m_fMaxHeight;
+	float m_fMinVariance;
+	float m_fMaxVariance;
+	// Distance between two grid nodes along each feature
+	float m_fHeightStep;
+	float m_fVarianceStep;
+	// Decision values at the grid nodes, oriented so that a positive value means label +1
+	std::vector<float> m_vTable;
+	// Approximation error measured at the middle of the grid cells
+	float m_fMaxError;
+	float m_fMismatchRate;
+
+public:
+	SVMLookupTable();
+
+	// Evaluates the decision function of svm on a size x size grid over the given feature ranges
+	void Build(const CvSVM &svm, float fMinHeight, float fMaxHeight, float fMinVariance, float fMaxVariance, int size);
+	// Builds over the range of the features (one sample per row: height, variance), and leaves
+	// the table unbuilt when there is no feature
+	void Build(const CvSVM &svm, const cv::Mat &features, int size);
+	bool IsBuilt() const	{return !m_vTable.empty();}
+
+	// Interpolated decision value, features outside the grid being clamped to it
+	float GetDecisionValue(float height, float variance) const;
+	// Same labels as CvSVM::predict (+1/-1)
+	inline float Predict(float height, float variance) const	{return (GetDecisionValue(height, variance) >= 0.0f) ? 1.0f : -1.0f;}
+	// Predicts every row (height, variance) of features into results (one column)
+	void Predict(const cv::Mat &features, cv::Mat &results) const;
+
+	// Largest difference between the interpolated and the exact decision values
+	float GetMaxError() const	{return m_fMaxError;}
+	// Fraction of the tested points where the interpolated label differs from the SVM
+	float GetMismatchRate() const	{return m_fMismatchRate;}
+};
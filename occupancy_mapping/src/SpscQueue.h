@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+
+// Bounded queue between two threads, one pushing and one popping, without any lock.
+// The queue owns the items it holds. When it is full, the oldest item is dropped to make room
+// for the new one: a stage which falls behind works on the most recent frames rather than on
+// a backlog. Both threads advance the tail with a compare-and-swap, so that the producer can
+// drop an item the consumer was about to pop.
+template<class T>
+class SpscQueue
+{
+protected:
+	std::vector<std::atomic<T*> > m_vSlots;
+	const size_t m_Mask;
+	// Next slot written by the producer, only modified by the producer
+	std::atomic<size_t> m_Head;
+	// Next slot read by the consumer
+	std::atomic<size_t> m_Tail;
+	// Items dropped since the last call to TakeNumDropped
+	std::atomic<unsigned int> m_NumDropped;
+
+	static size_t RoundCapacity(size_t capacity)
+	{
+		size_t size = 1;
+		while(size < capacity)
+			size *= 2;
+		return size;
+	}
+
+public:
+	// The capacity is rounded up to a power of two
+	SpscQueue(size_t capacity) : m_vSlots(RoundCapacity(capacity)), m_Mask(RoundCapacity(capacity)-1),
+		m_Head(0), m_Tail(0), m_NumDropped(0)
+	{
+		for(size_t k = 0; k < m_vSlots.size(); k++)
+			m_vSlots[k].store(nullptr, std::memory_order_relaxed);
+	}
+
+	// No thread may use the queue anymore
+	~SpscQueue()
+	{
+		T *pItem;
+		while(Pop(pItem))
+			delete pItem;
+	}
+
+	// Producer side. Never fails, dropping the oldest item if the queue is full.
+	void Push(T *pItem)
+	{
+		size_t head = m_Head.load(std::memory_order_relaxed);
+		size_t tail = m_Tail.load(std::memory_order_acquire);
+		if(head-tail > m_Mask)
+		{
+			// The consumer may pop that item meanwhile, in which case there is room anyway
+			if(m_Tail.compare_exchange_strong(tail, tail+1, std::memory_order_acq_rel))
+			{
+				delete m_vSlots[tail & m_Mask].load(std::memory_order_relaxed);
+				m_NumDropped++;
+			}
+		}
+		m_vSlots[head & m_Mask].store(pItem, std::memory_order_relaxed);
+		m_Head.store(head+1, std::memory_order_release);
+	}
+
+	// Consumer side. Returns false if the queue is empty, the caller owning pItem otherwise.
+	bool Pop(T *&pItem)
+	{
+		size_t tail = m_Tail.load(std::memory_order_acquire);
+		while(tail != m_Head.load(std::memory_order_acquire))
+		{
+			// The slot is only overwritten once the producer dropped it, which fails the swap
+			T *pCandidate = m_vSlots[tail & m_Mask].load(std::memory_order_relaxed);
+			if(m_Tail.compare_exchange_weak(tail, tail+1, std::memory_order_acq_rel))
+			{
+				pItem = pCandidate;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	size_t GetCapacity() const	{return m_vSlots.size();}
+	// Returns the number of items dropped since the last call
+	unsigned int TakeNumDropped()	{return m_NumDropped.exchange(0);}
+};
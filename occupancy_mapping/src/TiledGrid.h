@@ -0,0 +1,254 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <limits.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <math.h>
+
+#include "Cell.h"
+#include "DEMFileWriter.h"
+
+// Tiled 2D grid, generic in what each element holds and how a measurement changes it.
+// The grid is split in blocks of uiCellSize x uiCellSize elements, each covering a square of
+// dCellSize meters and created on the first measurement falling in it, like the Cartography
+// and the DEM. The layer itself is described by a policy:
+//
+//	struct Policy
+//	{
+//		typedef ... Cell;	// Element of the grid
+//		typedef ... Input;	// Measurement
+//		static const int NumChannels = ...;	// Values composed per element
+//		static Cell Empty();	// Element never measured
+//		static void Update(Cell &cell, const Input &input);
+//		static const char* GetChannelName(int c);
+//		static float GetChannel(const Cell &cell, int c);
+//	};
+//
+// The policy functions are resolved at compile time, so the update kernels are inlined.
+template<class Policy>
+class TiledGrid
+{
+public:
+	typedef typename Policy::Cell Cell;
+	typedef typename Policy::Input Input;
+
+protected:
+	struct Block
+	{
+		// Coordinates (m,n) of the block matrix
+		int m;
+		int n;
+		std::vector<Cell> cells;
+	};
+
+	// Copies blocks into the composed channels, one block per iteration
+	class BlockComposition : public cv::ParallelLoopBody
+	{
+		const std::vector<const Block*> &m_vBlocks;
+		std::vector<cv::Mat> &m_vChannels;
+		const int m_FirstChannel;
+		const int m_MinCellRow;
+		const int m_MinCellColumn;
+		const int m_CellSize;
+
+	public:
+		BlockComposition(const std::vector<const Block*> &blocks, std::vector<cv::Mat> &channels, int firstChannel,
+			int minCellRow, int minCellColumn, int cellSize) :
+			m_vBlocks(blocks), m_vChannels(channels), m_FirstChannel(firstChannel),
+			m_MinCellRow(minCellRow), m_MinCellColumn(minCellColumn), m_CellSize(cellSize)	{}
+
+		virtual void operator()(const cv::Range &range) const
+		{
+			for(int k = range.start; k < range.end; k++)
+			{
+				const Block *pBlock = m_vBlocks[k];
+				int m0 = (pBlock->m-m_MinCellRow)*m_CellSize;
+				int n0 = (pBlock->n-m_MinCellColumn)*m_CellSize;
+				for(int c = 0; c < Policy::NumChannels; c++)
+				{
+					cv::Mat &channel = m_vChannels[m_FirstChannel+c];
+					for(int i = 0; i < m_CellSize; i++)
+					{
+						float *pRow = channel.ptr<float>(m0+i)+n0;
+						const Cell *pCells = &pBlock->cells[i*m_CellSize];
+						for(int j = 0; j < m_CellSize; j++)
+							pRow[j] = Policy::GetChannel(pCells[j], c);
+					}
+				}
+			}
+		}
+	};
+
+	std::map<int, Block*> m_Blocks;
+	const double m_dCellSize;
+	const unsigned int m_uiCellSize;
+	int m_MaxCellRow;
+	int m_MinCellRow;
+	int m_MaxCellColumn;
+	int m_MinCellColumn;
+	// Block of the last update, successive measurements usually falling in the same block
+	Block *m_pLastBlock;
+
+	// Bijection between Z^2 and N
+	static int GetBlockKey(int i, int j)
+	{
+		int f_i = (i < 0) ? -2*i-1 : 2*i;
+		int f_j = (j < 0) ? -2*j-1 : 2*j;
+		return ((f_i+f_j)*(f_i+f_j)+f_i+3*f_j)/2;
+	}
+
+	Block* GetBlock(int i, int j)
+	{
+		if(m_pLastBlock && m_pLastBlock->m == i && m_pLastBlock->n == j)
+			return m_pLastBlock;
+		Block *&pBlock = m_Blocks[GetBlockKey(i, j)];
+		if(!pBlock)
+		{
+			m_MaxCellRow = std::max(m_MaxCellRow, i);
+			m_MinCellRow = std::min(m_MinCellRow, i);
+			m_MaxCellColumn = std::max(m_MaxCellColumn, j);
+			m_MinCellColumn = std::min(m_MinCellColumn, j);
+			pBlock = new Block;
+			pBlock->m = i;
+			pBlock->n = j;
+			pBlock->cells.assign(m_uiCellSize*m_uiCellSize, Policy::Empty());
+		}
+		m_pLastBlock = pBlock;
+		return pBlock;
+	}
+
+	const Block* FindBlock(int i, int j) const
+	{
+		auto it = m_Blocks.find(GetBlockKey(i, j));
+		return (it == m_Blocks.end()) ? nullptr : it->second;
+	}
+
+public:
+	TiledGrid(double dCellSize, unsigned int uiCellSize) :
+		m_dCellSize(dCellSize), m_uiCellSize(uiCellSize),
+		m_MaxCellRow(INT_MIN), m_MinCellRow(INT_MAX),
+		m_MaxCellColumn(INT_MIN), m_MinCellColumn(INT_MAX),
+		m_pLastBlock(nullptr)
+	{
+	}
+
+	~TiledGrid()
+	{
+		for(auto it = m_Blocks.begin(); it != m_Blocks.end(); it++)
+			delete(it->second);
+	}
+
+	// Converts a world coordinate to the index of the matrix element containing it
+	inline int ConvertWorldCoordToIndex(double d) const	{return int(floor(d*m_uiCellSize/m_dCellSize));}
+	double GetResolution() const	{return m_dCellSize/m_uiCellSize;}
+	size_t GetNumBlocks() const	{return m_Blocks.size();}
+	bool IsEmpty() const	{return m_Blocks.empty();}
+	// Index over the whole map of the element (0, 0) of the composed channels
+	cv::Point2i GetOrigin() const	{return cv::Point2i(m_MinCellRow*int(m_uiCellSize), m_MinCellColumn*int(m_uiCellSize));}
+
+	inline void Update(double x, double y, const Input &input)
+	{
+		UpdateCell(ConvertWorldCoordToIndex(x), ConvertWorldCoordToIndex(y), input);
+	}
+
+	// Adds a measurement to the element (x, y), x and y being indices over the whole map
+	inline void UpdateCell(int x, int y, const Input &input)
+	{
+		int i = FloorDiv(x, m_uiCellSize);
+		int j = FloorDiv(y, m_uiCellSize);
+		Block *pBlock = GetBlock(i, j);
+		Policy::Update(pBlock->cells[(x-i*int(m_uiCellSize))*m_uiCellSize+(y-j*int(m_uiCellSize))], input);
+	}
+
+	// Element (x, y), x and y being indices over the whole map, nullptr if its block does not exist
+	const Cell* GetCell(int x, int y) const
+	{
+		int i = FloorDiv(x, m_uiCellSize);
+		int j = FloorDiv(y, m_uiCellSize);
+		const Block *pBlock = FindBlock(i, j);
+		if(!pBlock)
+			return nullptr;
+		return &pBlock->cells[(x-i*int(m_uiCellSize))*m_uiCellSize+(y-j*int(m_uiCellSize))];
+	}
+
+	// Element containing (x, y), Policy::Empty() if it was never measured
+	Cell Lookup(double x, double y) const
+	{
+		const Cell *pCell = GetCell(ConvertWorldCoordToIndex(x), ConvertWorldCoordToIndex(y));
+		return pCell ? *pCell : Policy::Empty();
+	}
+
+	// Composes every channel of the policy into a CV_32FC1 matrix covering the bounding box of the
+	// blocks, in parallel over the blocks. Returns false if the grid is empty.
+	bool Compose(std::vector<cv::Mat> &channels) const
+	{
+		channels.resize(Policy::NumChannels);
+		return ComposeInto(channels, 0);
+	}
+
+	// Appends the channels to an export. Grids exported together must cover the same blocks.
+	// Returns false if the grid is empty or does not match the layers already in data.
+	bool Compose(DEMFileData &data) const
+	{
+		double resolution = GetResolution();
+		double originX = GetOrigin().x*resolution;
+		double originY = GetOrigin().y*resolution;
+		if(!data.layers.empty())
+		{
+			int rows = (m_MaxCellRow-m_MinCellRow+1)*int(m_uiCellSize);
+			int cols = (m_MaxCellColumn-m_MinCellColumn+1)*int(m_uiCellSize);
+			if(data.resolution != resolution || data.originX != originX || data.originY != originY
+				|| data.layers[0].rows != rows || data.layers[0].cols != cols)
+				return false;
+		}
+		data.resolution = resolution;
+		data.originX = originX;
+		data.originY = originY;
+		size_t first = data.layers.size();
+		data.layers.resize(first+Policy::NumChannels);
+		for(int c = 0; c < Policy::NumChannels; c++)
+			data.names.push_back(Policy::GetChannelName(c));
+		if(!ComposeInto(data.layers, int(first)))
+		{
+			data.layers.resize(first);
+			data.names.resize(first);
+			return false;
+		}
+		return true;
+	}
+
+	// Writes the channels as a binary export (see DEMFile.h)
+	bool Export(const std::string &path) const
+	{
+		DEMFileData data;
+		if(!Compose(data))
+			return false;
+		return DEMFileWriter::Write(path, data);
+	}
+
+protected:
+	bool ComposeInto(std::vector<cv::Mat> &channels, int firstChannel) const
+	{
+		if(m_Blocks.empty())
+			return false;
+		int rows = (m_MaxCellRow-m_MinCellRow+1)*int(m_uiCellSize);
+		int cols = (m_MaxCellColumn-m_MinCellColumn+1)*int(m_uiCellSize);
+		// The elements outside of the blocks hold the values of an empty element
+		Cell empty = Policy::Empty();
+		for(int c = 0; c < Policy::NumChannels; c++)
+		{
+			channels[firstChannel+c].create(rows, cols, CV_32FC1);
+			channels[firstChannel+c] = cv::Scalar(Policy::GetChannel(empty, c));
+		}
+
+		std::vector<const Block*> blocks;
+		blocks.reserve(m_Blocks.size());
+		for(auto it = m_Blocks.begin(); it != m_Blocks.end(); it++)
+			blocks.push_back(it->second);
+		cv::parallel_for_(cv::Range(0, int(blocks.size())),
+			BlockComposition(blocks, channels, firstChannel, m_MinCellRow, m_MinCellColumn, int(m_uiCellSize)));
+		return true;
+	}
+};
@@ -0,0 +1,314 @@
+/*
+ * Sparse 3D occupancy map in spatially hashed voxel blocks
+ */
+
+#include "VoxelMap.h"
+#include "Cell.h"
+#include <algorithm>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+// Each block or voxel coordinate is stored on 21 bits, centered on 0
+#define KEY_COORD_BITS		21
+#define KEY_COORD_OFFSET	(1 << (KEY_COORD_BITS-1))
+#define KEY_COORD_MASK		((1LL << KEY_COORD_BITS)-1)
+#define EMPTY_SLOT			LLONG_MIN
+#define INITIAL_CAPACITY	1024
+
+using namespace std;
+
+static inline long long PackKey(int i, int j, int k)
+{
+	return (((long long)(i+KEY_COORD_OFFSET) & KEY_COORD_MASK) << (2*KEY_COORD_BITS))
+		| (((long long)(j+KEY_COORD_OFFSET) & KEY_COORD_MASK) << KEY_COORD_BITS)
+		| ((long long)(k+KEY_COORD_OFFSET) & KEY_COORD_MASK);
+}
+
+static inline void UnpackKey(long long key, int &i, int &j, int &k)
+{
+	i = int((key >> (2*KEY_COORD_BITS)) & KEY_COORD_MASK)-KEY_COORD_OFFSET;
+	j = int((key >> KEY_COORD_BITS) & KEY_COORD_MASK)-KEY_COORD_OFFSET;
+	k = int(key & KEY_COORD_MASK)-KEY_COORD_OFFSET;
+}
+
+// Index of the voxel (x, y, z) in its block
+static inline int GetVoxelIndex(int x, int y, int z, int i, int j, int k)
+{
+	return ((x-i*VOXEL_BLOCK_SIZE)*VOXEL_BLOCK_SIZE+(y-j*VOXEL_BLOCK_SIZE))*VOXEL_BLOCK_SIZE+(z-k*VOXEL_BLOCK_SIZE);
+}
+
+VoxelMap::VoxelMap(double dVoxelSize) :
+	m_fVoxelSize(float(dVoxelSize)),
+	// Hit and miss probabilities of 0.7 and 0.4, clamped to [0.12, 0.97]
+	m_fHitLogOdd(0.85f), m_fMissLogOdd(-0.4f), m_fMinLogOdd(-2.0f), m_fMaxLogOdd(3.5f),
+	m_uiHashMask(INITIAL_CAPACITY-1), m_NumBlocks(0)
+{
+	m_vBlockKeys.assign(INITIAL_CAPACITY, EMPTY_SLOT);
+	m_vBlockSlots.assign(INITIAL_CAPACITY, nullptr);
+}
+
+VoxelMap::~VoxelMap()
+{
+	for(size_t s = 0; s < m_vBlockSlots.size(); s++)
+		delete m_vBlockSlots[s];
+}
+
+void VoxelMap::SetLogOdds(float fHit, float fMiss, float fMin, float fMax)
+{
+	m_fHitLogOdd = fHit;
+	m_fMissLogOdd = fMiss;
+	m_fMinLogOdd = fMin;
+	m_fMaxLogOdd = fMax;
+}
+
+unsigned int VoxelMap::FindSlot(long long key) const
+{
+	// Fibonacci hashing, then linear probing
+	unsigned int slot = (unsigned int)(((unsigned long long)key*0x9E3779B97F4A7C15ULL) >> 32) & m_uiHashMask;
+	while(m_vBlockKeys[slot] != EMPTY_SLOT && m_vBlockKeys[slot] != key)
+		slot = (slot+1) & m_uiHashMask;
+	return slot;
+}
+
+void VoxelMap::Grow()
+{
+	vector<long long> vKeys(2*m_vBlockKeys.size(), EMPTY_SLOT);
+	vector<VoxelBlock*> vSlots(vKeys.size(), nullptr);
+	vKeys.swap(m_vBlockKeys);
+	vSlots.swap(m_vBlockSlots);
+	m_uiHashMask = (unsigned int)(m_vBlockKeys.size()-1);
+	for(size_t s = 0; s < vKeys.size(); s++)
+	{
+		if(vKeys[s] == EMPTY_SLOT)
+			continue;
+		unsigned int slot = FindSlot(vKeys[s]);
+		m_vBlockKeys[slot] = vKeys[s];
+		m_vBlockSlots[slot] = vSlots[s];
+	}
+}
+
+VoxelBlock* VoxelMap::GetBlock(int i, int j, int k, bool bCreate)
+{
+	long long key = PackKey(i, j, k);
+	unsigned int slot = FindSlot(key);
+	if(m_vBlockKeys[slot] == key)
+		return m_vBlockSlots[slot];
+	if(!bCreate)
+		return nullptr;
+
+	// Keep the load factor of the hash table under 1/2
+	if(2*(m_NumBlocks+1) > m_vBlockKeys.size())
+	{
+		Grow();
+		slot = FindSlot(key);
+	}
+	VoxelBlock *pBlock = new VoxelBlock;
+	memset(pBlock->logOdds, 0, sizeof(pBlock->logOdds));
+	m_vBlockKeys[slot] = key;
+	m_vBlockSlots[slot] = pBlock;
+	m_NumBlocks++;
+	return pBlock;
+}
+
+const VoxelBlock* VoxelMap::GetBlock(int i, int j, int k) const
+{
+	long long key = PackKey(i, j, k);
+	unsigned int slot = FindSlot(key);
+	if(m_vBlockKeys[slot] == key)
+		return m_vBlockSlots[slot];
+	return nullptr;
+}
+
+float VoxelMap::GetVoxel(int x, int y, int z) const
+{
+	int i = FloorDiv(x, VOXEL_BLOCK_SIZE);
+	int j = FloorDiv(y, VOXEL_BLOCK_SIZE);
+	int k = FloorDiv(z, VOXEL_BLOCK_SIZE);
+	const VoxelBlock *pBlock = GetBlock(i, j, k);
+	if(!pBlock)
+		return 0.0f;
+	return pBlock->logOdds[GetVoxelIndex(x, y, z, i, j, k)];
+}
+
+void VoxelMap::TraceRay(const Eigen::Vector3f &origin, const Eigen::Vector3f &end, int x, int y, int z)
+{
+	// Amanatides & Woo voxel traversal, in voxel units
+	Eigen::Vector3f start = origin/m_fVoxelSize;
+	Eigen::Vector3f dir = end/m_fVoxelSize-start;
+	int voxel[3] = {int(floor(start[0])), int(floor(start[1])), int(floor(start[2]))};
+	const int target[3] = {x, y, z};
+	int step[3];
+	float tMax[3];
+	float tDelta[3];
+	int numSteps = 0;
+	for(int a = 0; a < 3; a++)
+	{
+		numSteps += abs(target[a]-voxel[a]);
+		if(dir[a] > 0)
+		{
+			step[a] = 1;
+			tDelta[a] = 1.0f/dir[a];
+			tMax[a] = (voxel[a]+1-start[a])*tDelta[a];
+		}
+		else if(dir[a] < 0)
+		{
+			step[a] = -1;
+			tDelta[a] = -1.0f/dir[a];
+			tMax[a] = (start[a]-voxel[a])*tDelta[a];
+		}
+		else
+		{
+			step[a] = 0;
+			tDelta[a] = tMax[a] = HUGE_VALF;
+		}
+	}
+
+	// The existence of the current block is only looked up when the ray enters a new block
+	int block[3] = {INT_MIN, INT_MIN, INT_MIN};
+	bool bBlockExists = false;
+	for(int s = 0; s < numSteps; s++)
+	{
+		int i = FloorDiv(voxel[0], VOXEL_BLOCK_SIZE);
+		int j = FloorDiv(voxel[1], VOXEL_BLOCK_SIZE);
+		int k = FloorDiv(voxel[2], VOXEL_BLOCK_SIZE);
+		if(i != block[0] || j != block[1] || k != block[2])
+		{
+			block[0] = i;
+			block[1] = j;
+			block[2] = k;
+			bBlockExists = (GetBlock(i, j, k) != nullptr);
+		}
+		if(bBlockExists)
+			m_vMisses.push_back(PackKey(voxel[0], voxel[1], voxel[2]));
+
+		int a = (tMax[0] < tMax[1]) ? ((tMax[0] < tMax[2]) ? 0 : 2) : ((tMax[1] < tMax[2]) ? 1 : 2);
+		voxel[a] += step[a];
+		tMax[a] += tDelta[a];
+		if(voxel[0] == x && voxel[1] == y && voxel[2] == z)
+			break;
+	}
+}
+
+void VoxelMap::AddLogOdd(long long key, float logOdd, bool bCreate)
+{
+	int x, y, z;
+	UnpackKey(key, x, y, z);
+	int i = FloorDiv(x, VOXEL_BLOCK_SIZE);
+	int j = FloorDiv(y, VOXEL_BLOCK_SIZE);
+	int k = FloorDiv(z, VOXEL_BLOCK_SIZE);
+	VoxelBlock *pBlock = GetBlock(i, j, k, bCreate);
+	if(!pBlock)
+		return;
+	float &value = pBlock->logOdds[GetVoxelIndex(x, y, z, i, j, k)];
+	value = std::min(m_fMaxLogOdd, std::max(m_fMinLogOdd, value+logOdd));
+}
+
+void VoxelMap::Update(const pcl::PointCloud<pcl::PointXYZ> &cloud, const Eigen::Vector3f &origin)
+{
+	m_vHits.clear();
+	m_vMisses.clear();
+	for(size_t n = 0; n < cloud.size(); n++)
+	{
+		const pcl::PointXYZ &p = cloud[n];
+		if(!isfinite(p.x) || !isfinite(p.y) || !isfinite(p.z))
+			continue;
+		int x = int(floor(p.x/m_fVoxelSize));
+		int y = int(floor(p.y/m_fVoxelSize));
+		int z = int(floor(p.z/m_fVoxelSize));
+		m_vHits.push_back(PackKey(x, y, z));
+		TraceRay(origin, Eigen::Vector3f(p.x, p.y, p.z), x, y, z);
+	}
+
+	// Each voxel is updated once per scan, whatever the number of rays ending in or crossing it
+	sort(m_vHits.begin(), m_vHits.end());
+	m_vHits.erase(unique(m_vHits.begin(), m_vHits.end()), m_vHits.end());
+	sort(m_vMisses.begin(), m_vMisses.end());
+	m_vMisses.erase(unique(m_vMisses.begin(), m_vMisses.end()), m_vMisses.end());
+
+	// The voxels both hit and crossed are only hit
+	size_t h = 0;
+	for(size_t m = 0; m < m_vMisses.size(); m++)
+	{
+		while(h < m_vHits.size() && m_vHits[h] < m_vMisses[m])
+			h++;
+		if(h < m_vHits.size() && m_vHits[h] == m_vMisses[m])
+			continue;
+		AddLogOdd(m_vMisses[m], m_fMissLogOdd, false);
+	}
+	for(size_t n = 0; n < m_vHits.size(); n++)
+		AddLogOdd(m_vHits[n], m_fHitLogOdd, true);
+
+	// The keys are sorted by x, then y, so the voxels of a column follow each other
+	m_vColumns.clear();
+	const std::vector<long long> *pKeys[2] = {&m_vHits, &m_vMisses};
+	for(int v = 0; v < 2; v++)
+	{
+		for(size_t n = 0; n < pKeys[v]->size(); n++)
+		{
+			int x, y, z;
+			UnpackKey((*pKeys[v])[n], x, y, z);
+			long long column = PackIndices(x, y);
+			if(m_vColumns.empty() || m_vColumns.back() != column)
+				m_vColumns.push_back(column);
+		}
+	}
+	sort(m_vColumns.begin(), m_vColumns.end());
+	m_vColumns.erase(unique(m_vColumns.begin(), m_vColumns.end()), m_vColumns.end());
+}
+
+float VoxelMap::GetLogOdd(double x, double y, double z) const
+{
+	return GetVoxel(int(floor(x/m_fVoxelSize)), int(floor(y/m_fVoxelSize)), int(floor(z/m_fVoxelSize)));
+}
+
+bool VoxelMap::GetClearance(double x, double y, double zMin, double zMax, double &ground, double &clearance) const
+{
+	int vx = int(floor(x/m_fVoxelSize));
+	int vy = int(floor(y/m_fVoxelSize));
+	int zBegin = int(floor(zMin/m_fVoxelSize));
+	int zEnd = int(floor(zMax/m_fVoxelSize));
+	int i = FloorDiv(vx, VOXEL_BLOCK_SIZE);
+	int j = FloorDiv(vy, VOXEL_BLOCK_SIZE);
+
+	// The column is walked upwards, looking up each block once and skipping the missing ones
+	bool bGround = false;
+	int groundTop = 0;
+	const VoxelBlock *pBlock = nullptr;
+	int k = INT_MIN;
+	for(int z = zBegin; z <= zEnd; z++)
+	{
+		if(FloorDiv(z, VOXEL_BLOCK_SIZE) != k)
+		{
+			k = FloorDiv(z, VOXEL_BLOCK_SIZE);
+			pBlock = GetBlock(i, j, k);
+		}
+		if(!pBlock)
+		{
+			z = (k+1)*VOXEL_BLOCK_SIZE-1;
+			continue;
+		}
+		if(pBlock->logOdds[GetVoxelIndex(vx, vy, z, i, j, k)] <= 0.0f)
+			continue;
+		if(!bGround || z == groundTop)
+		{
+			// Lowest run of occupied voxels
+			bGround = true;
+			groundTop = z+1;
+			continue;
+		}
+		ground = groundTop*m_fVoxelSize;
+		clearance = z*m_fVoxelSize-ground;
+		return true;
+	}
+	if(!bGround)
+		return false;
+	ground = groundTop*m_fVoxelSize;
+	clearance = std::max(0.0, zMax-ground);
+	return true;
+}
+
+size_t VoxelMap::GetMemoryUsage() const
+{
+	return m_NumBlocks*sizeof(VoxelBlock)+m_vBlockKeys.size()*(sizeof(long long)+sizeof(VoxelBlock*));
+}
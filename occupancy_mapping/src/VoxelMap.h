@@ -0,0 +1,82 @@
+#pragma once
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <Eigen/Core>
+#include <vector>
+
+// Number of voxels per side of a voxel block
+#define VOXEL_BLOCK_SIZE	8
+
+// Fixed-size cube of voxels, allocated as a whole the first time one of its voxels is hit
+struct VoxelBlock
+{
+	// Occupancy log odd of each voxel, 0 being unknown, indexed by (x*VOXEL_BLOCK_SIZE+y)*VOXEL_BLOCK_SIZE+z
+	float logOdds[VOXEL_BLOCK_SIZE*VOXEL_BLOCK_SIZE*VOXEL_BLOCK_SIZE];
+};
+
+// Sparse 3D occupancy map, for the overhanging structures the 2.5D maps cannot represent.
+// The voxel blocks are found through a spatial hash, and only the blocks holding a hit are
+// allocated: the rays only clear the voxels of existing blocks, so that the memory follows the
+// observed surfaces rather than the traversed volume.
+class VoxelMap
+{
+protected:
+	const float m_fVoxelSize;
+	// Log odds added by a hit and a miss, and clamping of the voxels
+	float m_fHitLogOdd;
+	float m_fMissLogOdd;
+	float m_fMinLogOdd;
+	float m_fMaxLogOdd;
+
+	// Open addressing hash table: block key -> block
+	std::vector<long long> m_vBlockKeys;
+	std::vector<VoxelBlock*> m_vBlockSlots;
+	unsigned int m_uiHashMask;
+	size_t m_NumBlocks;
+
+	// Voxel keys of the hits and misses of the current batch
+	std::vector<long long> m_vHits;
+	std::vector<long long> m_vMisses;
+	// Columns of the voxels of the current batch, as sorted PackIndices keys
+	std::vector<long long> m_vColumns;
+
+	// Returns the slot of key in the hash table, or the empty slot where it should go
+	unsigned int FindSlot(long long key) const;
+	// Doubles the capacity of the hash table
+	void Grow();
+	// Returns the block (i, j, k), or nullptr if it does not exist and bCreate is false
+	VoxelBlock* GetBlock(int i, int j, int k, bool bCreate);
+	const VoxelBlock* GetBlock(int i, int j, int k) const;
+	float GetVoxel(int x, int y, int z) const;
+	// Appends the voxels crossed by the ray from origin to the voxel (x, y, z), which is excluded,
+	// and which lie in existing blocks
+	void TraceRay(const Eigen::Vector3f &origin, const Eigen::Vector3f &end, int x, int y, int z);
+	void AddLogOdd(long long key, float logOdd, bool bCreate);
+
+public:
+	VoxelMap(double dVoxelSize);
+	~VoxelMap();
+
+	void SetLogOdds(float fHit, float fMiss, float fMin, float fMax);
+
+	// Integrates a scan, origin being the position of the sensor: the voxels holding the points of
+	// cloud are hit, the voxels crossed by the rays are missed. Each voxel is updated once per
+	// scan, a hit prevailing over a miss.
+	void Update(const pcl::PointCloud<pcl::PointXYZ> &cloud, const Eigen::Vector3f &origin);
+
+	// Occupancy log odd of the voxel holding (x, y, z), 0 if unknown
+	float GetLogOdd(double x, double y, double z) const;
+	// Free height in the column (x, y), between zMin and zMax: ground is the top of the lowest run
+	// of occupied voxels, and clearance the free height above it, up to the next occupied voxel or
+	// zMax. Returns false if no voxel of the column is occupied.
+	bool GetClearance(double x, double y, double zMin, double zMax, double &ground, double &clearance) const;
+	// Columns (x, y) of the voxels hit or crossed by the last Update, as sorted PackIndices keys of
+	// voxel indices, so that what is derived from the columns is only refreshed where they changed
+	const std::vector<long long>& GetUpdatedColumns() const	{return m_vColumns;}
+
+	double GetVoxelSize() const	{return m_fVoxelSize;}
+	size_t GetNumBlocks() const	{return m_NumBlocks;}
+	// Memory used by the blocks and the hash table, in bytes
+	size_t GetMemoryUsage() const;
+};
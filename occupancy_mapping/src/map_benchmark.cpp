@@ -0,0 +1,238 @@
+/*
+ * Microbenchmarks of the map data structures
+ * Times the updates and the composition of the Cartography and the DEM for several map sizes
+ * (number of blocks), block sizes (elements per side) and access patterns:
+ * - localised: successive updates fall in the same block, blocks being visited in turn
+ * - scattered: each update falls in a random block
+ *
+ * Usage: map_benchmark [max blocks]
+ */
+
+#include <opencv2/core/core.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+
+#include "Cartography.h"
+#include "DEM.h"
+#include "MapLayers.h"
+#include "PipelineStats.h"
+
+// Size of a block in meters
+#define BLOCK_SIZE	1.0
+// Number of updates timed per configuration
+#define NUM_UPDATES	1000000
+// Successive updates falling in the same block in the localised pattern
+#define UPDATES_PER_BLOCK	64
+// Configurations whose maps would exceed this number of elements are skipped
+#define MAX_ELEMENTS	20000000
+// PublishToFile writes the four DEM layers to /tmp, only timed on the small maps
+#define MAX_FILE_ELEMENTS	1000000
+
+enum AccessPattern
+{
+	Localised = 0,
+	Scattered
+};
+
+static const char* PATTERN_NAMES[] = {"localised", "scattered"};
+
+struct BenchmarkConfig
+{
+	int numBlocks;
+	unsigned int uiBlockSize;
+	AccessPattern pattern;
+};
+
+// Random coordinate in [0, 1[
+static double Random()
+{
+	return rand()/(RAND_MAX+1.0);
+}
+
+// World position of the block k, the blocks filling a square row by row
+static void GetBlockOrigin(int k, int side, double &x, double &y)
+{
+	x = (k/side)*BLOCK_SIZE;
+	y = (k%side)*BLOCK_SIZE;
+}
+
+// Positions of the updates, over numBlocks blocks
+static void GenerateUpdates(const BenchmarkConfig &config, int count, std::vector<cv::Point2d> &points)
+{
+	int side = int(ceil(sqrt(double(config.numBlocks))));
+	points.resize(count);
+	for(int u = 0; u < count; u++)
+	{
+		int k;
+		if(config.pattern == Localised)
+			k = (u/UPDATES_PER_BLOCK)%config.numBlocks;
+		else
+			k = rand()%config.numBlocks;
+		double x, y;
+		GetBlockOrigin(k, side, x, y);
+		points[u] = cv::Point2d(x+Random()*BLOCK_SIZE, y+Random()*BLOCK_SIZE);
+	}
+}
+
+// Creates every block of the map
+static void FillMaps(const BenchmarkConfig &config, Cartography &cartography, DEM &dem,
+	TiledGrid<IntensityPolicy> &grid)
+{
+	int side = int(ceil(sqrt(double(config.numBlocks))));
+	for(int k = 0; k < config.numBlocks; k++)
+	{
+		double x, y;
+		GetBlockOrigin(k, side, x, y);
+		cartography.Update(x+0.5*BLOCK_SIZE, y+0.5*BLOCK_SIZE, 0.0);
+		dem.Update(x+0.5*BLOCK_SIZE, y+0.5*BLOCK_SIZE, 0.0);
+		grid.Update(x+0.5*BLOCK_SIZE, y+0.5*BLOCK_SIZE, 0.0f);
+	}
+	cartography.ClearStateChanges();
+}
+
+static void PrintResult(const char *name, const BenchmarkConfig &config, double value, const char *unit)
+{
+	printf("%-26s %8d %6u %10s %12.3f %s\n", name, config.numBlocks, config.uiBlockSize,
+		PATTERN_NAMES[config.pattern], value, unit);
+}
+
+static void RunBenchmark(const BenchmarkConfig &config)
+{
+	Cartography cartography(BLOCK_SIZE, config.uiBlockSize);
+	DEM dem(BLOCK_SIZE, config.uiBlockSize);
+	TiledGrid<IntensityPolicy> grid(BLOCK_SIZE, config.uiBlockSize);
+	FillMaps(config, cartography, dem, grid);
+
+	std::vector<cv::Point2d> points;
+	GenerateUpdates(config, NUM_UPDATES, points);
+	std::vector<double> data(points.size());
+	for(size_t u = 0; u < data.size(); u++)
+		data[u] = Random()-0.5;
+
+	double start = PipelineStats::Now();
+	for(size_t u = 0; u < points.size(); u++)
+		cartography.Update(points[u].x, points[u].y, data[u]);
+	PrintResult("Cartography::Update", config, 1e9*(PipelineStats::Now()-start)/points.size(), "ns");
+	cartography.ClearStateChanges();
+
+	start = PipelineStats::Now();
+	for(size_t u = 0; u < points.size(); u++)
+		dem.Update(points[u].x, points[u].y, data[u]);
+	PrintResult("DEM::Update", config, 1e9*(PipelineStats::Now()-start)/points.size(), "ns");
+
+	// Robot loitering over mapped ground: the same elements observed again once saturated or converged
+	Cartography saturated(BLOCK_SIZE, config.uiBlockSize);
+	DEM converged(BLOCK_SIZE, config.uiBlockSize);
+	converged.SetConvergence(1, 0.02);
+	for(size_t u = 0; u < points.size(); u++)
+	{
+		saturated.Update(points[u].x, points[u].y, 1000.0);
+		converged.Update(points[u].x, points[u].y, 0.0);
+	}
+	saturated.ClearStateChanges();
+	start = PipelineStats::Now();
+	for(size_t u = 0; u < points.size(); u++)
+		saturated.Update(points[u].x, points[u].y, 3.0);
+	PrintResult("Cartography::Update sat.", config, 1e9*(PipelineStats::Now()-start)/points.size(), "ns");
+
+	start = PipelineStats::Now();
+	for(size_t u = 0; u < points.size(); u++)
+		converged.Update(points[u].x, points[u].y, 0.0);
+	PrintResult("DEM::Update converged", config, 1e9*(PipelineStats::Now()-start)/points.size(), "ns");
+
+	// Robot far from the map: every block held at the coarsest level
+	Cartography coarseCartography(BLOCK_SIZE, config.uiBlockSize);
+	DEM coarseDEM(BLOCK_SIZE, config.uiBlockSize);
+	coarseCartography.SetAdaptiveResolution(BLOCK_SIZE, 2);
+	coarseDEM.SetAdaptiveResolution(BLOCK_SIZE, 2);
+	coarseCartography.SetFocus(-1000.0, -1000.0);
+	coarseDEM.SetFocus(-1000.0, -1000.0);
+	start = PipelineStats::Now();
+	for(size_t u = 0; u < points.size(); u++)
+		coarseCartography.Update(points[u].x, points[u].y, data[u]);
+	PrintResult("Cartography::Update coarse", config, 1e9*(PipelineStats::Now()-start)/points.size(), "ns");
+	coarseCartography.ClearStateChanges();
+
+	start = PipelineStats::Now();
+	for(size_t u = 0; u < points.size(); u++)
+		coarseDEM.Update(points[u].x, points[u].y, data[u]);
+	PrintResult("DEM::Update coarse", config, 1e9*(PipelineStats::Now()-start)/points.size(), "ns");
+
+	// Same updates through the generic tiled grid
+	start = PipelineStats::Now();
+	for(size_t u = 0; u < points.size(); u++)
+		grid.Update(points[u].x, points[u].y, float(data[u]));
+	PrintResult("TiledGrid::Update", config, 1e9*(PipelineStats::Now()-start)/points.size(), "ns");
+
+	// The first composition allocates the final matrices, the next ones reuse them
+	const int numRepetitions = 5;
+	cv::Mat image;
+	cartography.Compose();
+	start = PipelineStats::Now();
+	for(int r = 0; r < numRepetitions; r++)
+		cartography.Compose();
+	PrintResult("Cartography::Compose", config, 1e3*(PipelineStats::Now()-start)/numRepetitions, "ms");
+
+	start = PipelineStats::Now();
+	for(int r = 0; r < numRepetitions; r++)
+		cartography.ComposeImage(image);
+	PrintResult("Cartography::ComposeImage", config, 1e3*(PipelineStats::Now()-start)/numRepetitions, "ms");
+
+	dem.Compose();
+	start = PipelineStats::Now();
+	for(int r = 0; r < numRepetitions; r++)
+		dem.Compose();
+	PrintResult("DEM::Compose", config, 1e3*(PipelineStats::Now()-start)/numRepetitions, "ms");
+
+	start = PipelineStats::Now();
+	for(int r = 0; r < numRepetitions; r++)
+		dem.ComposeImage(image);
+	PrintResult("DEM::ComposeImage", config, 1e3*(PipelineStats::Now()-start)/numRepetitions, "ms");
+
+	std::vector<cv::Mat> channels;
+	grid.Compose(channels);
+	start = PipelineStats::Now();
+	for(int r = 0; r < numRepetitions; r++)
+		grid.Compose(channels);
+	PrintResult("TiledGrid::Compose", config, 1e3*(PipelineStats::Now()-start)/numRepetitions, "ms");
+
+	if(double(config.numBlocks)*config.uiBlockSize*config.uiBlockSize <= MAX_FILE_ELEMENTS)
+	{
+		start = PipelineStats::Now();
+		dem.PublishToFile();
+		PrintResult("DEM::PublishToFile", config, 1e3*(PipelineStats::Now()-start), "ms");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int maxBlocks = (argc > 1) ? atoi(argv[1]) : 100000;
+	const int numBlocks[] = {10, 100, 1000, 10000, 100000};
+	const unsigned int blockSizes[] = {5, 10, 20};
+
+	printf("%-26s %8s %6s %10s %12s\n", "benchmark", "blocks", "size", "pattern", "time");
+	for(size_t b = 0; b < sizeof(numBlocks)/sizeof(numBlocks[0]); b++)
+	{
+		if(numBlocks[b] > maxBlocks)
+			break;
+		for(size_t s = 0; s < sizeof(blockSizes)/sizeof(blockSizes[0]); s++)
+		{
+			for(int p = Localised; p <= Scattered; p++)
+			{
+				BenchmarkConfig config = {numBlocks[b], blockSizes[s], AccessPattern(p)};
+				if(double(config.numBlocks)*config.uiBlockSize*config.uiBlockSize > MAX_ELEMENTS)
+				{
+					printf("%-26s %8d %6u %10s %12s\n", "(skipped, too large)", config.numBlocks,
+						config.uiBlockSize, PATTERN_NAMES[p], "-");
+					continue;
+				}
+				// Same positions for every run of a configuration
+				srand(0);
+				RunBenchmark(config);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,310 @@
+/*
+ * Offline rebuild of the maps from the journal of the node (journal_file parameter)
+ * The journaled observations are turned into map updates with the given parameters, binned by
+ * map block, and each block is rebuilt on its own, in parallel. The blocks are then fused into
+ * the maps, which are written as binary exports (see DEMFile.h): the DEM to the output path
+ * and the log odds of the Cartography next to it, with a .log_odds suffix.
+ * At most max_updates updates are held in memory: a larger journal is read once to count the
+ * updates of each block, then once per group of blocks within the limit, each group being
+ * rebuilt and fused before the next one is read.
+ * Only the parameters applied after the front end can change: belief_mod, alpha, beta,
+ * step_function_parameter, z_threshold, free_space_belief, converged_measurements and
+ * convergence_tolerance. The 3D and statistics layers are not rebuilt.
+ *
+ * Usage: map_rebuild <journal file> <output file> [name=value ...] [max_updates=N]
+ */
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <map>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "MapJournal.h"
+#include "MappingPipeline.h"
+#include "PipelineStats.h"
+
+// Update of one element of a block, in the order of the journal
+struct ElementUpdate
+{
+	// Indices of the element over the whole map
+	int x;
+	int y;
+	float logOdd;
+	// Height measured in the element, NaN for an element crossed by a ray
+	float height;
+};
+
+// Rebuilds the blocks one by one, each in maps of its own
+class BlockRebuild : public cv::ParallelLoopBody
+{
+	const MappingParameters &m_Params;
+	const std::vector<std::vector<ElementUpdate> > &m_vUpdates;
+	std::vector<MapTileData> &m_vTiles;
+
+public:
+	BlockRebuild(const MappingParameters &params, const std::vector<std::vector<ElementUpdate> > &updates,
+		std::vector<MapTileData> &tiles) :
+		m_Params(params), m_vUpdates(updates), m_vTiles(tiles)	{}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		double resolution = m_Params.cellSize/m_Params.cellResolution;
+		for(int k = range.start; k < range.end; k++)
+		{
+			Cartography cartography(m_Params.cellSize, m_Params.cellResolution);
+			DEM dem(m_Params.cellSize, m_Params.cellResolution);
+			dem.SetConvergence(m_Params.convergedMeasurements, m_Params.convergenceTolerance);
+			const std::vector<ElementUpdate> &updates = m_vUpdates[k];
+			for(size_t u = 0; u < updates.size(); u++)
+			{
+				cartography.UpdateCell(updates[u].x, updates[u].y, updates[u].logOdd);
+				// The DEM is addressed in meters, the center of the element falling in it
+				if(!isnan(updates[u].height))
+					dem.Update((updates[u].x+0.5)*resolution, (updates[u].y+0.5)*resolution, updates[u].height);
+			}
+			std::map<long long, MapTileData> tiles;
+			cartography.ExportBlocks(tiles);
+			dem.ExportBlocks(tiles);
+			if(!tiles.empty())
+				m_vTiles[k] = tiles.begin()->second;
+		}
+	}
+};
+
+// Reads the next frame of the journal and turns it into element updates. Within a frame the
+// points come before the free space, like in MappingPipeline::ApplyUpdate. The keys are the
+// PackIndices of the blocks of the updates.
+static bool ReadFrameUpdates(JournalReader &reader, const MappingParameters &params, const Cartography &rays,
+	JournalFrame &frame, std::vector<ElementUpdate> &updates, std::vector<long long> &keys)
+{
+	if(!reader.Read(frame))
+		return false;
+	std::vector<long long> freeKeys;
+	if(params.freeSpaceBelief != 0.0)
+	{
+		std::vector<cv::Point2f> hits(frame.observations.size());
+		for(size_t i = 0; i < frame.observations.size(); i++)
+			hits[i] = cv::Point2f(frame.observations[i].x, frame.observations[i].y);
+		rays.GetFreeSpace(frame.origin[0], frame.origin[1], hits, freeKeys);
+	}
+	int N = int(params.cellResolution);
+	updates.resize(frame.observations.size()+freeKeys.size());
+	keys.resize(updates.size());
+	for(size_t u = 0; u < updates.size(); u++)
+	{
+		ElementUpdate &update = updates[u];
+		if(u < frame.observations.size())
+		{
+			const JournalObservation &observation = frame.observations[u];
+			pcl::PointXYZ p(observation.x, observation.y, observation.z);
+			update.x = int(floor(double(observation.x)*N/params.cellSize));
+			update.y = int(floor(double(observation.y)*N/params.cellSize));
+			update.logOdd = float(ScanFrontEnd::GetLogOdd(params, p, observation.GetState(params.zThreshold)));
+			update.height = observation.z;
+		}
+		else
+		{
+			UnpackIndices(freeKeys[u-frame.observations.size()], update.x, update.y);
+			update.logOdd = float(params.freeSpaceBelief);
+			update.height = NAN;
+		}
+		keys[u] = PackIndices(FloorDiv(update.x, N), FloorDiv(update.y, N));
+	}
+	return true;
+}
+
+// Bins the updates of a frame by block, the blocks missing from blockIndices being skipped.
+// Successive updates usually fall in the same block.
+static void BinUpdates(const std::vector<ElementUpdate> &frameUpdates, const std::vector<long long> &keys,
+	const std::map<long long, size_t> &blockIndices, std::vector<std::vector<ElementUpdate> > &updates)
+{
+	long long lastKey = 0;
+	auto last = blockIndices.end();
+	for(size_t u = 0; u < frameUpdates.size(); u++)
+	{
+		if(u == 0 || keys[u] != lastKey)
+		{
+			last = blockIndices.find(keys[u]);
+			lastKey = keys[u];
+		}
+		if(last != blockIndices.end())
+			updates[last->second].push_back(frameUpdates[u]);
+	}
+}
+
+static bool SetParameter(MappingParameters &params, const char *arg)
+{
+	const char *pEqual = strchr(arg, '=');
+	if(!pEqual)
+		return false;
+	std::string name(arg, pEqual);
+	double value = atof(pEqual+1);
+	if(name == "belief_mod")
+		params.beliefMod = value;
+	else if(name == "alpha")
+		params.alpha = value;
+	else if(name == "beta")
+		params.beta = value;
+	else if(name == "step_function_parameter")
+		params.stepFunctionParameter = value;
+	else if(name == "z_threshold")
+		params.zThreshold = value;
+	else if(name == "free_space_belief")
+		params.freeSpaceBelief = value;
+	else if(name == "converged_measurements")
+		params.convergedMeasurements = int(value);
+	else if(name == "convergence_tolerance")
+		params.convergenceTolerance = value;
+	else
+		return false;
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc < 3)
+	{
+		fprintf(stderr, "Usage: %s <journal file> <output file> [name=value ...] [max_updates=N]\n", argv[0]);
+		return 1;
+	}
+	JournalReader reader;
+	if(!reader.Open(argv[1]))
+	{
+		fprintf(stderr, "Cannot read the journal %s\n", argv[1]);
+		return 1;
+	}
+	MappingParameters params;
+	params.cellSize = reader.GetCellSize();
+	params.cellResolution = reader.GetCellResolution();
+	// 16 bytes per update, so 256 MB by default
+	size_t maxUpdates = size_t(1) << 24;
+	for(int a = 3; a < argc; a++)
+	{
+		if(strncmp(argv[a], "max_updates=", 12) == 0)
+			maxUpdates = std::max(atol(argv[a]+12), 1L);
+		else if(!SetParameter(params, argv[a]))
+		{
+			fprintf(stderr, "Unknown parameter %s\n", argv[a]);
+			return 1;
+		}
+	}
+
+	// First pass: the updates of each block are counted, and kept as long as they fit in the limit,
+	// in which case there is no other pass
+	double start = PipelineStats::Now();
+	Cartography rays(params.cellSize, params.cellResolution);
+	std::map<long long, size_t> blockCounts;
+	std::map<long long, size_t> blockIndices;
+	std::vector<std::vector<ElementUpdate> > updates;
+	bool bInMemory = true;
+	size_t numUpdates = 0;
+	JournalFrame frame;
+	std::vector<ElementUpdate> frameUpdates;
+	std::vector<long long> keys;
+	unsigned int numFrames = 0;
+	size_t numObservations = 0;
+	while(ReadFrameUpdates(reader, params, rays, frame, frameUpdates, keys))
+	{
+		for(size_t u = 0; u < keys.size(); u++)
+		{
+			size_t &count = blockCounts[keys[u]];
+			if(count == 0 && bInMemory)
+			{
+				blockIndices[keys[u]] = updates.size();
+				updates.push_back(std::vector<ElementUpdate>());
+			}
+			count++;
+		}
+		numUpdates += frameUpdates.size();
+		if(bInMemory && numUpdates > maxUpdates)
+		{
+			bInMemory = false;
+			blockIndices.clear();
+			std::vector<std::vector<ElementUpdate> >().swap(updates);
+		}
+		if(bInMemory)
+			BinUpdates(frameUpdates, keys, blockIndices, updates);
+		numFrames++;
+		numObservations += frame.observations.size();
+	}
+	double readTime = PipelineStats::Now()-start;
+	if(numFrames == 0)
+	{
+		fprintf(stderr, "No frame in %s\n", argv[1]);
+		return 1;
+	}
+
+	// Groups of blocks within the limit, a block over it making a group of its own
+	std::vector<std::map<long long, size_t> > groups;
+	if(bInMemory)
+		groups.push_back(blockIndices);
+	else
+	{
+		size_t groupUpdates = 0;
+		for(auto it = blockCounts.begin(); it != blockCounts.end(); it++)
+		{
+			if(groups.empty() || groupUpdates+it->second > maxUpdates)
+			{
+				groups.push_back(std::map<long long, size_t>());
+				groupUpdates = 0;
+			}
+			size_t index = groups.back().size();
+			groups.back()[it->first] = index;
+			groupUpdates += it->second;
+		}
+	}
+
+	// Each group is rebuilt and fused before the next one is read. The blocks of the groups are
+	// disjoint, so fusing them one group after the other gives the same maps as all at once.
+	// The fusion also derives the slope, roughness and distances.
+	MappingPipeline pipeline(params);
+	double rebuildTime = 0.0;
+	double fuseTime = 0.0;
+	for(size_t g = 0; g < groups.size(); g++)
+	{
+		if(!bInMemory)
+		{
+			start = PipelineStats::Now();
+			JournalReader groupReader;
+			if(!groupReader.Open(argv[1]))
+			{
+				fprintf(stderr, "Cannot read the journal %s\n", argv[1]);
+				return 1;
+			}
+			updates.assign(groups[g].size(), std::vector<ElementUpdate>());
+			for(auto it = groups[g].begin(); it != groups[g].end(); it++)
+				updates[it->second].reserve(blockCounts[it->first]);
+			while(ReadFrameUpdates(groupReader, params, rays, frame, frameUpdates, keys))
+				BinUpdates(frameUpdates, keys, groups[g], updates);
+			readTime += PipelineStats::Now()-start;
+		}
+
+		start = PipelineStats::Now();
+		std::vector<MapTileData> tiles(updates.size());
+		cv::parallel_for_(cv::Range(0, int(updates.size())), BlockRebuild(params, updates, tiles));
+		std::vector<std::vector<ElementUpdate> >().swap(updates);
+		rebuildTime += PipelineStats::Now()-start;
+
+		start = PipelineStats::Now();
+		pipeline.FuseTiles(tiles);
+		fuseTime += PipelineStats::Now()-start;
+	}
+
+	std::string demPath = argv[2];
+	std::string logOddsPath = demPath+".log_odds";
+	if(!pipeline.GetDEM()->PublishToFile(demPath) || !pipeline.GetCartography()->PublishToFile(logOddsPath))
+	{
+		fprintf(stderr, "Cannot write the maps to %s\n", argv[2]);
+		return 1;
+	}
+
+	printf("%u frames, %lu observations, %lu blocks, %lu pass(es)\n", numFrames, (unsigned long)numObservations,
+		(unsigned long)blockCounts.size(), (unsigned long)(bInMemory ? 1 : groups.size()+1));
+	printf("read %.3f s, rebuild %.3f s, fusion %.3f s\n", readTime, rebuildTime, fuseTime);
+	printf("DEM written to %s, log odds to %s\n", demPath.c_str(), logOddsPath.c_str());
+	return 0;
+}
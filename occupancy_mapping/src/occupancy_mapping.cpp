@@ -1,175 +1,390 @@
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <visualization_msgs/Marker.h>
 #include <sensor_msgs/Joy.h>
 #include <sensor_msgs/PointCloud2.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <image_transport/image_transport.h>
+#include <cv_bridge/cv_bridge.h>
 #include <pcl_ros/point_cloud.h>
 #include <pcl_ros/transforms.h>
 #include <pcl/point_types.h>
-#include <pcl/features/normal_3d.h>
 #include <tf/tf.h>
 #include <tf/transform_listener.h>
 
 #include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <opencv2/ml/ml.hpp>
 #include <Eigen/Core>
 #include <Eigen/Cholesky>
 
-#include <sys/time.h>
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <sstream>
+#include <atomic>
 
 #include "Cartography.h"
 #include "Cell.h"
 #include "DEM.h"
+#include "DistanceMap.h"
+#include "MapQuery.h"
+#include "SVMLookupTable.h"
+#include "OnlineClassifier.h"
+#include <occupancy_mapping/QueryMap.h>
+#include <occupancy_mapping/MapTiles.h>
+#include "MappingPipeline.h"
+#include "PipelineStats.h"
+#include "ReplayFile.h"
+#include "DEMFileWriter.h"
+#include "SpscQueue.h"
+#include "MapJournal.h"
 
 const double PI=3.141592653589793238462;
 static const char * svm_output = "/tmp/svm_model.xml";
 
+// Trained SVM and its lookup table. Never modified once published, so that it can be
+// swapped while the mapping is predicting with the previous one.
+struct TraversabilityModel
+{
+	CvSVM svm;
+	// Rasterised decision function of the SVM, used instead of the SVM when built
+	SVMLookupTable lut;
+
+	void Predict(const cv::Mat &features, cv::Mat &results) const
+	{
+		if (lut.IsBuilt()) {
+			lut.Predict(features, results);
+		} else {
+			// The batch prediction is split across the cores by OpenCV
+			CvMat samplesMat = features;
+			CvMat resultsMat = results;
+			svm.predict(&samplesMat, &resultsMat);
+		}
+	}
+};
+
 class FloorPlaneMapping {
 protected:
 	ros::NodeHandle nh_;
-	ros::Subscriber scan_sub_;
 	ros::Subscriber joy_sub_;
 	ros::Publisher pcl_pub_;
 	ros::Publisher marker_pub_;
+	ros::Publisher diagnostics_pub_;
+	image_transport::ImageTransport it_;
+	image_transport::Publisher map_pub_;
+	image_transport::Publisher dem_pub_;
+	image_transport::Publisher distance_pub_;
+	ros::ServiceServer query_srv_;
+	ros::WallTimer diagnostics_timer_;
+	ros::WallTimer export_timer_;
+	// The joystick and the map queries on queues of their own, served by spinner threads when
+	// async_spinning is set, so that loading the SVM holds neither the queries nor the timers
+	bool async_spinning;
+	ros::CallbackQueue joyQueue_;
+	ros::CallbackQueue queryQueue_;
+	ros::AsyncSpinner joySpinner_;
+	ros::AsyncSpinner querySpinner_;
 
 	tf::TransformListener listener_;
 
 	std::string base_frame_;
 	std::string world_frame_;
 
-	int n_samples;
-	double max_range_;
-	double tolerance;
-	double traverse_threshold; // Angle threshold to determine if traversable
-	double normal_estimation_radius; // Normal estimation radius in meters
-	double step_function_parameter;
-	double ALPHA;
-	double BETA;
-	double Z_THRESHOLD;
-	double belief_mod;
-
-	pcl::PointCloud<pcl::PointXYZ> basePC;
-	pcl::PointCloud<pcl::PointXYZ> worldPC;  // Point cloud in the world frame
-	pcl::PointCloud<pcl::PointXYZ> obstaclePC; // Point cloud of obstacles
-	pcl::PointCloud<pcl::PointXYZ> testPC;
+	MappingParameters mapping_params;
+
+	// Scan going through the stages of the pipeline, owned by one stage at a time
+	struct ScanFrame {
+		unsigned int sensorId;
+		ros::Time stamp;
+		pcl::PointCloud<pcl::PointXYZ> sensorPC;
+		pcl::PointCloud<pcl::PointXYZ> basePC;
+		pcl::PointCloud<pcl::PointXYZ> worldPC;  // Point cloud in the world frame
+		Eigen::Vector3f origin;                   // Position of the sensor
+		// Results of the segmentation
+		ScanUpdate update;
+		std::vector<size_t> filteredIndices;
+		double plane[3];
+		pcl::PointCloud<pcl::PointXYZ> obstaclePC; // Point cloud of obstacles
+		StageTimer timer;
+
+		ScanFrame(PipelineStats &stats) : timer(stats) {}
+	};
+
+	// Depth sensor: its scans are ingested on its own callback queue and thread, then segmented
+	// on another one, before going through the mapping and publication threads shared by all
+	// the sensors. The stages hand the frames over through lock-free queues.
+	struct SensorInput {
+		unsigned int id;
+		ros::CallbackQueue queue;
+		ros::Subscriber sub;
+		boost::thread worker;
+		boost::thread segmentation;
+		ScanFrontEnd frontEnd;
+		SpscQueue<ScanFrame> segmentationQueue; // Ingestion -> segmentation
+		SpscQueue<ScanFrame> mappingQueue;      // Segmentation -> mapping
+
+		SensorInput(const MappingParameters &params, size_t queueSize) :
+			frontEnd(params), segmentationQueue(queueSize), mappingQueue(queueSize) {}
+	};
+	std::vector<SensorInput*> sensors_;
+	std::atomic<bool> stopSensors_;
+	// Mapping -> publication
+	SpscQueue<ScanFrame> *publicationQueue_;
+	int stage_queue_size; // Frames held between two stages, the oldest being dropped beyond
+	boost::thread mappingThread_;
+	boost::thread publicationThread_;
+	std::atomic<bool> stopPipeline_;
 
+	// Filtering, floor plane, normals and map updates
+	MappingPipeline *m_pPipeline;
+	// Maps of the pipeline
 	Cartography *m_pCartography;
 	DEM *m_pDME;
+	DistanceMap *m_pDistanceMap;
+	// Serves the map queries from the last published maps
+	MapQuery m_MapQuery;
+	// Scans recorded for offline replays, when record_file is set
+	ReplayWriter recorder_;
+	boost::mutex recorderMutex_;
+	// Map updates journaled for the offline rebuilds, when journal_file is set, written by the mapping thread
+	JournalWriter journal_;
+	// Binary DEM exports, when dem_export_file is set
+	std::string dem_export_file;
+	DEMFileWriter demWriter_;
+	DEMFileWriter statisticsWriter_;
+	// Held while the maps are modified, by the scans or the fusion of the tiles of other robots
+	boost::mutex mapMutex_;
+
+	// Map sharing between robots
+	bool share_map;
+	std::string robot_id; // Tiles sent by this robot are ignored when received back
+	ros::Publisher tiles_pub_;
+	ros::Subscriber tiles_sub_;
+	ros::WallTimer share_timer_;
+	// Tiles received from the other robots, fused on fusionThread_
+	std::deque<occupancy_mapping::MapTilesConstPtr> fusionQueue_;
+	boost::mutex fusionQueueMutex_;
+	boost::condition_variable fusionCondition_;
+	boost::thread fusionThread_;
+	bool stopFusion_;
 
 	// SVM
-	CvSVM svm;
+	boost::shared_ptr<const TraversabilityModel> svmModel; // Accessed with boost::atomic_load/store
 	CvSVMParams params;
-	bool isSVMOn;
+	std::atomic<bool> isSVMOn; // Toggled by the joystick, read by the mapping thread
+	int svm_lut_size; // Number of nodes per feature of the lookup table, 0 to use the SVM directly
+	int svm_training_budget; // Maximum number of cells used to train the SVM
+	boost::thread trainingThread_;
+	std::atomic<bool> isTraining;
+	// Online classifier, used instead of the SVM when use_online_classifier is set
+	OnlineClassifier *m_pOnlineClassifier;
+	bool use_online_classifier;
+	int online_max_updates; // Maximum number of cells learnt per scan
+
+	// Latency of each stage of pc_Callback and size of the data going through it
+	PipelineStats m_PipelineStats;
 
 protected:
 	/*
 	 * CALLBACK:
 	 * PointCloud
+	 * Ingestion stage, on the thread of the sensor
 	 */
-	void pc_Callback(const sensor_msgs::PointCloud2ConstPtr msg){
+	void pc_Callback(const sensor_msgs::PointCloud2ConstPtr msg, SensorInput *sensor){
+		ScanFrame *frame = new ScanFrame(m_PipelineStats);
+		frame->sensorId = sensor->id;
+		frame->stamp = msg->header.stamp;
 		/**
 		 * Transformation of the point clouds
 		 */
-		pcl::PointCloud<pcl::PointXYZ> temp;
+		pcl::PointCloud<pcl::PointXYZ> &temp = frame->sensorPC;
 
 		pcl::fromROSMsg(*msg, temp);
-		// Make sure the point cloud is in the base-frame
-		listener_.waitForTransform(base_frame_, msg->header.frame_id,
-				msg->header.stamp, ros::Duration(1.0));
-		pcl_ros::transformPointCloud(base_frame_, msg->header.stamp, temp,
-				msg->header.frame_id, basePC, listener_);
-
-		// cloudPtr -> point cloud in the world frame
-		listener_.waitForTransform(world_frame_, msg->header.frame_id,
-				msg->header.stamp, ros::Duration(1.0));
-		pcl_ros::transformPointCloud(world_frame_, msg->header.stamp, temp,
-				msg->header.frame_id, worldPC, listener_);
+		// Poses of the sensor in the base and world frames, looked up once for the clouds, the
+		// origin of the rays and the recording. A scan whose transforms are late is dropped.
+		tf::StampedTransform sensorToBase, sensorToWorld;
+		try {
+			if (!listener_.waitForTransform(base_frame_, msg->header.frame_id,
+						msg->header.stamp, ros::Duration(1.0))
+					|| !listener_.waitForTransform(world_frame_, msg->header.frame_id,
+						msg->header.stamp, ros::Duration(1.0))) {
+				ROS_WARN("No transform for the scan of sensor %u, dropped", sensor->id);
+				delete frame;
+				return;
+			}
+			listener_.lookupTransform(base_frame_, msg->header.frame_id,
+					msg->header.stamp, sensorToBase);
+			listener_.lookupTransform(world_frame_, msg->header.frame_id,
+					msg->header.stamp, sensorToWorld);
+		} catch (tf::TransformException &e) {
+			ROS_WARN("No transform for the scan of sensor %u, dropped: %s", sensor->id, e.what());
+			delete frame;
+			return;
+		}
+		pcl_ros::transformPointCloud(temp, frame->basePC, sensorToBase);
+		frame->basePC.header.frame_id = base_frame_;
+		pcl_ros::transformPointCloud(temp, frame->worldPC, sensorToWorld);
+		frame->worldPC.header.frame_id = world_frame_;
 
-		/**
-		 * Filter the points in the point cloud
-		 */
-		unsigned int n = temp.size();
-		std::vector<size_t> pidx;
-		// First count the useful points
-		for (unsigned int i = 0; i < n; i++) {
-			float x = temp[i].x;
-			float y = temp[i].y;
-			float d = hypot(x, y);
-			if (d < 1e-2) {
-				// Bogus point, ignore
+		// Position of the sensor, origin of the rays
+		frame->origin << sensorToWorld.getOrigin().x(), sensorToWorld.getOrigin().y(),
+				sensorToWorld.getOrigin().z();
+		RecordScan(msg, temp, sensorToBase, sensorToWorld);
+		frame->timer.Lap(StageIngestion);
+		sensor->segmentationQueue.Push(frame);
+	}
+
+	/**
+	 * Sensor thread
+	 * Runs the callbacks of one sensor
+	 */
+	void SensorWorker(SensorInput *sensor) {
+		while (!stopSensors_ && nh_.ok())
+			sensor->queue.callAvailable(ros::WallDuration(0.1));
+	}
+
+	// Backs off while the queues of a stage are empty: yields first, then sleeps, so that an
+	// idle stage neither spins nor delays the next frame by much
+	static void WaitForFrame(unsigned int &idleRounds) {
+		if (++idleRounds < 64)
+			boost::this_thread::yield();
+		else
+			boost::this_thread::sleep(boost::posix_time::microseconds(500));
+	}
+
+	/**
+	 * Segmentation thread
+	 * Filtering, RANSAC and normal estimation of the scans of one sensor
+	 */
+	void SegmentationWorker(SensorInput *sensor) {
+		unsigned int idleRounds = 0;
+		while (!stopPipeline_) {
+			ScanFrame *frame;
+			if (!sensor->segmentationQueue.Pop(frame)) {
+				WaitForFrame(idleRounds);
 				continue;
 			}
-			x = basePC[i].x;
-			y = basePC[i].y;
-			d = hypot(x, y);
-			if (d > max_range_) {
-				// too far, ignore
+			idleRounds = 0;
+			frame->timer.Resume();
+			sensor->frontEnd.Process(frame->sensorPC, frame->basePC, frame->worldPC,
+					frame->origin.x(), frame->origin.y(), frame->origin.z(),
+					frame->update, &frame->timer);
+			// The front end is reused by the next scan of the sensor
+			frame->filteredIndices = sensor->frontEnd.GetFilteredIndices();
+			std::copy(sensor->frontEnd.GetPlane(), sensor->frontEnd.GetPlane() + 3, frame->plane);
+			sensor->mappingQueue.Push(frame);
+		}
+	}
+
+	/**
+	 * Mapping thread
+	 * Applies the segmented scans of all the sensors to the maps, one at a time, and classifies
+	 * their points
+	 */
+	void MappingWorker() {
+		unsigned int idleRounds = 0;
+		while (!stopPipeline_) {
+			bool isIdle = true;
+			// One frame per sensor and per round, so that no sensor starves the others
+			for (size_t s = 0; s < sensors_.size(); ++s) {
+				ScanFrame *frame;
+				if (!sensors_[s]->mappingQueue.Pop(frame))
+					continue;
+				isIdle = false;
+				frame->timer.Resume();
+				{
+					boost::mutex::scoped_lock lock(mapMutex_);
+					m_pPipeline->ApplyUpdate(frame->update);
+					frame->timer.Lap(StageMapUpdate);
+					m_PipelineStats.AddCount(CounterSkippedUpdates, m_pPipeline->GetNumSkippedUpdates());
+
+					/*
+					 * ==========================
+					 * SVM
+					 * ==========================
+					 */
+					// Cells whose belief became confident in this scan feed the online classifier
+					if (use_online_classifier)
+						UpdateOnlineClassifier(m_pCartography->GetStateChanges());
+					frame->obstaclePC.header.frame_id = world_frame_;
+					if (isSVMOn)
+						ExtractObstacles(frame->worldPC, frame->filteredIndices, frame->obstaclePC);
+					frame->timer.Lap(StageSVM);
+				}
+				if (journal_.IsOpen())
+					JournalScan(*frame);
+				publicationQueue_->Push(frame);
+			}
+			if (isIdle)
+				WaitForFrame(idleRounds);
+			else
+				idleRounds = 0;
+		}
+	}
+
+	/**
+	 * Publication thread
+	 * Publishes the maps after the last mapped scan, older scans being skipped if it falls behind
+	 */
+	void PublicationWorker() {
+		unsigned int idleRounds = 0;
+		while (!stopPipeline_) {
+			ScanFrame *frame;
+			if (!publicationQueue_->Pop(frame)) {
+				WaitForFrame(idleRounds);
 				continue;
 			}
-			pidx.push_back(i);
-		}
-		
-		/*
-		 * ==========================
-		 * RANSAC
-		 * ==========================
-		 */		
-		n = pidx.size();
-		size_t best = 0;
-		double X[3] = { 0, 0, 0 };
-
-		Eigen::Vector3f normalVector;
-		std::vector<size_t> inliersIndex; // index for inliers of the plane
-		std::vector<size_t> outliersIndex; // index for outliers
-//		ROS_INFO("%d useful points out of %d", (int)n, (int)temp.size());
-		for (unsigned int i = 0; i < (unsigned) n_samples; i++) 
-		{
-			if (n == 0)
-				break;
-			Eigen::Vector3f samplePoints[3];
-			// Initialize the random seed
-			// srand(time(NULL));
-			// Pick up 3 random points
-			for (int j = 0; j < 3; j++) 
+			idleRounds = 0;
+			frame->timer.Resume();
+			PublishFloorPlane(frame->stamp, frame->plane, frame->sensorId);
+			// Only composing the maps needs the lock. The composed matrices are shared with the
+			// snapshot rather than copied, and the images are colored from them once unlocked.
+			boost::shared_ptr<MapSnapshot> snapshot(new MapSnapshot);
+			cv::Mat mapImage, demImage, distanceImage;
+			bool hasMap, hasDEM, hasDistance;
 			{
-				int index = getRandomIndex((int) n);
-				samplePoints[j] << basePC[pidx[index]].x, basePC[pidx[index]].y, basePC[pidx[index]].z;
-			}
-			// Calculate the plane ax+by+cz+d=0
-			Eigen::Vector3f p = samplePoints[1] - samplePoints[0];
-			Eigen::Vector3f q = samplePoints[2] - samplePoints[1];
-			normalVector = p.cross(q);
-			normalVector.normalize(); // Normalize the vector
-			double d = -samplePoints[1].dot(normalVector);
-
-			// Evaluation
-			size_t score = 0;
-			std::vector<size_t> tempInliersIndex;
-			std::vector<size_t> tempOutliersIndex;
-			for (int i = 0; i < n; i++) {
-				// Calculate the score for this model
-				if (calcDistance(basePC[pidx[i]], normalVector, d)
-					<= tolerance)
-				{
-						tempInliersIndex.push_back(i);
-						score++;
+				boost::mutex::scoped_lock lock(mapMutex_);
+				hasMap = m_pCartography->Compose();
+				hasDEM = m_pDME->Compose();
+				if (hasMap) {
+					snapshot->logOdds = m_pCartography->ShareMat();
+					snapshot->logOddsOrigin = m_pCartography->getMatOrigin();
 				}
-				else
-					tempOutliersIndex.push_back(i);
-
-				// Update if a better model is found
-				if (score > best)
-				{
-					best = score;
-					inliersIndex = tempInliersIndex;
-					outliersIndex = tempOutliersIndex;
-					X[0] = normalVector[0] / -normalVector[2];
-					X[1] = normalVector[1] / -normalVector[2];
-					X[2] = d / -normalVector[2];
+				if (hasDEM) {
+					m_pDME->ShareMats(snapshot->height, snapshot->variance);
+					snapshot->demOrigin = m_pDME->getMatOrigin();
 				}
+				snapshot->resolution = m_pCartography->getResolution();
+				m_pPipeline->ComposeClearance(snapshot->clearance, snapshot->clearanceOrigin);
+				// Over the extent of the occupancy image, so that both line up
+				hasDistance = hasMap && m_pDistanceMap->ComposeImage(distanceImage,
+					snapshot->logOddsOrigin, snapshot->logOdds.rows, snapshot->logOdds.cols);
+			}
+			if (hasMap && hasDEM)
+				m_MapQuery.SetSnapshot(snapshot);
+			if (hasMap) {
+				Cartography::ColorImage(snapshot->logOdds, mapImage);
+				PublishImage(map_pub_, mapImage, "rgba8");
 			}
+			if (hasDEM) {
+				DEM::ColorImage(snapshot->height, demImage);
+				PublishImage(dem_pub_, demImage, "rgba8");
+			}
+			if (hasDistance)
+				PublishImage(distance_pub_, distanceImage, "32FC1");
+			// Publish the points which belong to obstacles
+			if (isSVMOn)
+				pcl_pub_.publish(frame->obstaclePC);
+			frame->timer.Lap(StagePublish);
+			frame->timer.End();
+			delete frame;
 		}
+	}
 
-		// Floor plane marker
+	// Floor plane z = X[0]*x+X[1]*y+X[2] as a flat cylinder in the base frame, one per sensor
+	void PublishFloorPlane(const ros::Time &stamp, const double X[3], unsigned int id)
+	{
 		Eigen::Vector3f O, u, v, w;
 		w << X[0], X[1], -1.0;
 		w /= w.norm();
@@ -184,10 +399,10 @@ protected:
 		R.getRotation(Q);
 
 		visualization_msgs::Marker m;
-		m.header.stamp = msg->header.stamp;
+		m.header.stamp = stamp;
 		m.header.frame_id = base_frame_;
 		m.ns = "floor_plane";
-		m.id = 1;
+		m.id = id + 1;
 		m.type = visualization_msgs::Marker::CYLINDER;
 		m.action = visualization_msgs::Marker::ADD;
 		m.pose.position.x = O(0);
@@ -203,98 +418,61 @@ protected:
 		m.color.b = 1.0;
 
 		marker_pub_.publish(m);
-		/*
-		 * ==========================
-		 * End of RANSAC
-		 * ==========================
-		 */
-
-		/*
-		 * ==========================
-		 * Mapping
-		 * ==========================
-		 */
-		Eigen::Vector3f zVector;
-		double angle;
-		zVector << 0, 0, 1;
-		// Get the angle between the normalVector and the Z axis
-		angle = acos(normalVector.dot(zVector) / (normalVector.norm() * zVector.norm()));
-		// Set the threshold
-		if(fabs(angle) > PI/2)
-			angle=PI-fabs(angle);
-
-		// Update the state
-		testPC.clear();
-		CellState inlierState;
-		CellState outlierState;
-		CellState outlierAltState = Unknown;
-		if (fabs(angle) <= traverse_threshold) {
-			inlierState = Traversable;
-			outlierState = NonTraversable;
-		}else{
-			inlierState = NonTraversable;
-			outlierState = Unknown;
-		}
-
-		// Update inliers
-		int pidx_size = inliersIndex.size();
-		for (int i = 0; i < pidx_size; ++i) {
-			float x = worldPC[inliersIndex[i]].x;
-			float y = worldPC[inliersIndex[i]].y;
-			float z = worldPC[inliersIndex[i]].z;
-			testPC.push_back(worldPC[inliersIndex[i]]);
-			UpdateCartographAndDME(x, y, z, inlierState);
-		}
-
-		// Update outliers
-		pidx_size = outliersIndex.size();
-		for (int i = 0; i < pidx_size; ++i) {
-			float x = worldPC[outliersIndex[i]].x;
-			float y = worldPC[outliersIndex[i]].y;
-			float z = worldPC[outliersIndex[i]].z;
-			float z_base = basePC[outliersIndex[i]].z; // z in the base frame
-			if (z_base > Z_THRESHOLD)
-				UpdateCartographAndDME(x, y, z, outlierState);
-			else
-				UpdateCartographAndDME(x, y, z, outlierAltState);
-		}
-
-//		pcl_pub_.publish(testPC);
-		// Publish the results
-		m_pCartography->PublishImage();
-		m_pDME->PublishImage();
+	}
 
-		/*
-		 * ==========================
-		 * End of Mapping
-		 * ==========================
-		 */
+	void PublishImage(image_transport::Publisher &pub, const cv::Mat &image, const char *encoding)
+	{
+		cv_bridge::CvImage out_msg;
+		out_msg.encoding = encoding;
+		out_msg.image    = image;
+		pub.publish(out_msg.toImageMsg());
+	}
 
-		/*
-		 * ==========================
-		 * SVM
-		 * ==========================
-		 */
-		obstaclePC.clear();
-		cv::Mat inputMat(2,1,CV_32FC1);
-		if(isSVMOn){
-			for (int i=0;i<n;++i){
-				inputMat.at<float>(0,0) = worldPC[pidx[i]].z;
-				inputMat.at<float>(1,1) = 0.01; // Test
-				float result = svm.predict(inputMat);
-				if(result == -1){
-					obstaclePC.push_back(worldPC[pidx[i]]);
-				}
+	// Appends the scan to the replay file, with the poses of the sensor, if recording
+	void RecordScan(const sensor_msgs::PointCloud2ConstPtr &msg,
+			const pcl::PointCloud<pcl::PointXYZ> &sensorPC,
+			const tf::StampedTransform &sensorToBase,
+			const tf::StampedTransform &sensorToWorld)
+	{
+		// The sensors record from their own threads
+		boost::mutex::scoped_lock lock(recorderMutex_);
+		if (!recorder_.IsOpen())
+			return;
+		ReplayFrame frame;
+		frame.stamp = msg->header.stamp.toSec();
+		GetPose(sensorToBase, frame.sensorToBase);
+		GetPose(sensorToWorld, frame.sensorToWorld);
+		frame.cloud = sensorPC;
+		if (!recorder_.Write(frame)) {
+			ROS_ERROR("Failed to record the scan, recording stopped");
+			recorder_.Close();
+		}
+	}
 
-			}
-			// Publish the points which belong to obstacles
-			pcl_pub_.publish(obstaclePC);
+	// Appends the observations of the scan to the journal, in the order of the map updates
+	void JournalScan(ScanFrame &frame)
+	{
+		JournalFrame journalFrame;
+		journalFrame.stamp = frame.stamp.toSec();
+		journalFrame.origin[0] = frame.origin.x();
+		journalFrame.origin[1] = frame.origin.y();
+		journalFrame.origin[2] = frame.origin.z();
+		journalFrame.observations.swap(frame.update.observations);
+		if (!journal_.Append(journalFrame)) {
+			ROS_ERROR("Failed to journal the map updates, journal closed");
+			journal_.Close();
 		}
-		/*
-		 * ==========================
-	     * End of SVM
-	     * ==========================
-	     */
+	}
+
+	static void GetPose(const tf::Transform &transform, float pose[7])
+	{
+		pose[0] = transform.getOrigin().x();
+		pose[1] = transform.getOrigin().y();
+		pose[2] = transform.getOrigin().z();
+		pose[3] = transform.getRotation().x();
+		pose[4] = transform.getRotation().y();
+		pose[5] = transform.getRotation().z();
+		pose[6] = transform.getRotation().w();
 	}
 
 	/**
@@ -306,38 +484,32 @@ protected:
 		if(joy->buttons[0]==1){
 			// Begin training the SVM
 			ROS_INFO("BUTTON \"A\" PRESSED\n Training SVM");
-			// Reshape and transpose the matrix
-		    cv::Mat heightMat = m_pDME->getMat()->reshape(0,1).t();
-		    cv::Mat varMat = m_pDME->getVarMat()->reshape(0,1).t();
-		    cv::Mat cartoMat = m_pCartography->getMat()->reshape(0,1).t();
-
-		    // Training Data
-		    cv::Mat trainingData(heightMat.rows,heightMat.cols+varMat.cols,CV_32FC1);
-		    heightMat.col(0).copyTo(trainingData.col(0));
-		    varMat.col(0).copyTo(trainingData.col(1));
-		    // Convert labels
-		    cv::Mat labels(cartoMat.rows,cartoMat.cols,CV_32FC1);
-		    // Set label values
-		    ROS_INFO("%d",labels.rows);
-		    for(int i=0;i<labels.rows;++i){
-		    	float label;
-		    	if(cartoMat.at<float>(i,0)>0.5) // Traversable
-		    		label = 1;
-		    	else
-		    		label = -1;
-		    	labels.at<float>(i,0)=label;
-		    }
-		    svm.train(trainingData,labels,cv::Mat(),cv::Mat(),params);
-		    // Save the model
-		    svm.save(svm_output);
-		    ROS_INFO("SVM saved to %s",svm_output);
+			boost::shared_ptr<const MapSnapshot> snapshot = m_MapQuery.GetSnapshot();
+			if (isTraining) {
+				ROS_INFO("SVM training already in progress");
+			} else if (!snapshot) {
+				ROS_INFO("No map to train the SVM on yet");
+			} else {
+				// The training runs on the last published maps, which are never modified,
+				// so the mapping goes on meanwhile
+				if (trainingThread_.joinable())
+					trainingThread_.join();
+				isTraining = true;
+				trainingThread_ = boost::thread(&FloorPlaneMapping::TrainSVM, this, snapshot, params);
+			}
 		}
 		// Button "X"
 		if(joy->buttons[2]==1){
 			if(!isSVMOn){
 				isSVMOn = true;
 				ROS_INFO("SVM on");
-				svm.load(svm_output);
+				// Only read the model back from the disk when none was trained since the start
+				if (!use_online_classifier && !boost::atomic_load(&svmModel)) {
+					TraversabilityModel *model = new TraversabilityModel;
+					model->svm.load(svm_output);
+					BuildSVMLookupTable(*model, GetObservedDEMFeatures(m_MapQuery.GetSnapshot()));
+					boost::atomic_store(&svmModel, boost::shared_ptr<const TraversabilityModel>(model));
+				}
 			}
 		}
 		// Button "Y"
@@ -349,104 +521,601 @@ protected:
 		}
 	}
 
-	void UpdateCartographAndDME(float x, float y, float z, int state)
+	// Height and variance of the DEM cells of the snapshot which were measured, one cell per row.
+	// Read from the snapshot rather than the DEM, which the mapping thread modifies meanwhile.
+	cv::Mat GetObservedDEMFeatures(const boost::shared_ptr<const MapSnapshot> &snapshot)
+	{
+		if (!snapshot)
+			return cv::Mat(0, 2, CV_32FC1);
+		const cv::Mat &heightMat = snapshot->height;
+		const cv::Mat &varMat = snapshot->variance;
+		std::vector<cv::Point2f> observed;
+		for (int i = 0; i < heightMat.rows; ++i) {
+			for (int j = 0; j < heightMat.cols; ++j) {
+				if (heightMat.at<float>(i, j) != FLT_MIN)
+					observed.push_back(cv::Point2f(heightMat.at<float>(i, j),
+							varMat.at<float>(i, j)));
+			}
+		}
+		cv::Mat features(observed.size(), 2, CV_32FC1);
+		for (size_t k = 0; k < observed.size(); ++k) {
+			features.at<float>(k, 0) = observed[k].x;
+			features.at<float>(k, 1) = observed[k].y;
+		}
+		return features;
+	}
+
+	// Rasterises the SVM of the model over the range of the features
+	void BuildSVMLookupTable(TraversabilityModel &model, const cv::Mat &features)
 	{
-		double logOdd = 0.0;
-		double distanceToRobot = hypot(x, y);
-		if(state == Traversable)
-			logOdd = belief_mod;
-		else if(state == NonTraversable)
-			logOdd = -belief_mod;
+		if (svm_lut_size <= 0)
+			return;
+		model.lut.Build(model.svm, features, svm_lut_size);
+		if (!model.lut.IsBuilt()) {
+			ROS_INFO("No measured cell to build the SVM lookup table over, using the SVM");
+			return;
+		}
+		ROS_INFO("SVM lookup table %dx%d: max decision error %f, %.2f%% labels differ",
+				svm_lut_size, svm_lut_size, model.lut.GetMaxError(),
+				100.0 * model.lut.GetMismatchRate());
+	}
+
+	/**
+	 * SVM training thread
+	 * Trains a new model on the measured cells of the snapshot and swaps it in once done
+	 */
+	void TrainSVM(boost::shared_ptr<const MapSnapshot> snapshot, CvSVMParams trainingParams)
+	{
+		const cv::Mat &heightMat = snapshot->height;
+		const cv::Mat &varMat = snapshot->variance;
+		const cv::Mat &cartoMat = snapshot->logOdds;
+		// The DEM and the Cartography may not cover the same area
+		int rowOffset = snapshot->demOrigin.x - snapshot->logOddsOrigin.x;
+		int columnOffset = snapshot->demOrigin.y - snapshot->logOddsOrigin.y;
+
+		// Only the cells where a height was measured
+		std::vector<cv::Point> observed;
+		for (int i = 0; i < heightMat.rows; ++i) {
+			for (int j = 0; j < heightMat.cols; ++j) {
+				int m = i + rowOffset;
+				int n = j + columnOffset;
+				if (heightMat.at<float>(i, j) != FLT_MIN && m >= 0 && n >= 0
+						&& m < cartoMat.rows && n < cartoMat.cols)
+					observed.push_back(cv::Point(i, j));
+			}
+		}
+		// Random subset within the budget (partial Fisher-Yates shuffle)
+		size_t numSamples = std::min(observed.size(), (size_t) std::max(svm_training_budget, 0));
+		for (size_t k = 0; k < numSamples; ++k)
+			std::swap(observed[k], observed[k + getRandomIndex(observed.size() - k)]);
+		if (numSamples == 0) {
+			ROS_INFO("No measured cell to train the SVM on");
+			isTraining = false;
+			return;
+		}
+
+		// Training Data
+		cv::Mat trainingData(numSamples, 2, CV_32FC1);
+		cv::Mat labels(numSamples, 1, CV_32FC1);
+		for (size_t k = 0; k < numSamples; ++k) {
+			int i = observed[k].x;
+			int j = observed[k].y;
+			trainingData.at<float>(k, 0) = heightMat.at<float>(i, j);
+			trainingData.at<float>(k, 1) = varMat.at<float>(i, j);
+			if (cartoMat.at<float>(i + rowOffset, j + columnOffset) > 0.5) // Traversable
+				labels.at<float>(k, 0) = 1;
+			else
+				labels.at<float>(k, 0) = -1;
+		}
+		ROS_INFO("Training the SVM on %d cells", (int) numSamples);
+
+		TraversabilityModel *model = new TraversabilityModel;
+		model->svm.train(trainingData, labels, cv::Mat(), cv::Mat(), trainingParams);
+		// Save the model
+		model->svm.save(svm_output);
+		ROS_INFO("SVM saved to %s", svm_output);
+		BuildSVMLookupTable(*model, trainingData);
+		boost::atomic_store(&svmModel, boost::shared_ptr<const TraversabilityModel>(model));
+		isTraining = false;
+	}
+
+	// One SGD step of the online classifier per cell which became Traversable or NonTraversable,
+	// at most online_max_updates per scan
+	void UpdateOnlineClassifier(const std::vector<CellStateChange> &changes)
+	{
+		std::vector<size_t> confident;
+		for (size_t k = 0; k < changes.size(); ++k) {
+			if (changes[k].to != Unknown)
+				confident.push_back(k);
+		}
+		// Random subset within the budget (partial Fisher-Yates shuffle)
+		size_t numUpdates = std::min(confident.size(), (size_t) std::max(online_max_updates, 0));
+		for (size_t k = 0; k < numUpdates; ++k)
+			std::swap(confident[k], confident[k + getRandomIndex(confident.size() - k)]);
+
+		double resolution = m_pCartography->getResolution();
+		for (size_t k = 0; k < numUpdates; ++k) {
+			const CellStateChange &change = changes[confident[k]];
+			float height, variance, slope, roughness;
+			if (!m_pDME->Lookup((change.x + 0.5) * resolution, (change.y + 0.5) * resolution,
+					height, variance, slope, roughness))
+				continue;
+			m_pOnlineClassifier->Update(height, variance, (change.to == Traversable) ? 1 : -1);
+		}
+	}
+
+	// Classifies the cells hit by the points and fills obstaclePC with the points falling in
+	// NonTraversable cells. The classifiers learn from DEM cells, so they are evaluated once
+	// per cell on the DEM height and variance, in a single batch.
+	void ExtractObstacles(const pcl::PointCloud<pcl::PointXYZ> &worldPC, const std::vector<size_t> &pidx,
+			pcl::PointCloud<pcl::PointXYZ> &obstaclePC)
+	{
+		boost::shared_ptr<const TraversabilityModel> model = boost::atomic_load(&svmModel);
+		if (!model && !use_online_classifier)
+			return;
+		double resolution = m_pDME->getResolution();
+		std::vector<long long> pointCells(pidx.size());
+		for (size_t i = 0; i < pidx.size(); ++i)
+			pointCells[i] = PackIndices(int(floor(worldPC[pidx[i]].x / resolution)),
+					int(floor(worldPC[pidx[i]].y / resolution)));
+		std::vector<long long> cells(pointCells);
+		std::sort(cells.begin(), cells.end());
+		cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+		if (cells.empty())
+			return;
+
+		// One row of features per cell
+		cv::Mat features(cells.size(), 2, CV_32FC1);
+		for (size_t k = 0; k < cells.size(); ++k) {
+			int cx, cy;
+			UnpackIndices(cells[k], cx, cy);
+			float height = 0, variance = 0, slope, roughness;
+			m_pDME->Lookup((cx + 0.5) * resolution, (cy + 0.5) * resolution,
+					height, variance, slope, roughness);
+			features.at<float>(k, 0) = height;
+			features.at<float>(k, 1) = variance;
+		}
+		cv::Mat results(cells.size(), 1, CV_32FC1);
+		if (use_online_classifier)
+			m_pOnlineClassifier->Predict(features, results);
 		else
-			logOdd = 0;
-		// Step function such that f(0+)=1 and f(+infinite)->0+, f(0-)=-1 and f(-infinite)->0-
-		// The function chosen is f(x)=tanh(ALPHA*param/x^BETA)
-		double d=logOdd*tanh(ALPHA*step_function_parameter/pow(distanceToRobot, BETA));
-		m_pCartography->Update(x,y,d);
-		m_pDME->Update(x,y,z);
+			model->Predict(features, results);
+
+		for (size_t i = 0; i < pidx.size(); ++i) {
+			size_t k = std::lower_bound(cells.begin(), cells.end(), pointCells[i]) - cells.begin();
+			if (results.at<float>(k, 0) == -1)
+				obstaclePC.push_back(worldPC[pidx[i]]);
+		}
+	}
+
+	/**
+	 * TIMER
+	 * Sends the tiles changed by this robot since the previous call
+	 */
+	void share_Callback(const ros::WallTimerEvent &event) {
+		std::vector<MapTileData> tiles;
+		{
+			boost::mutex::scoped_lock lock(mapMutex_);
+			m_pPipeline->ExportTiles(tiles);
+		}
+		if (tiles.empty())
+			return;
+
+		occupancy_mapping::MapTiles msg;
+		msg.header.stamp = ros::Time::now();
+		msg.header.frame_id = world_frame_;
+		msg.robot_id = robot_id;
+		msg.cell_size = mapping_params.cellSize;
+		msg.cell_resolution = mapping_params.cellResolution;
+		msg.tiles.resize(tiles.size());
+		for (size_t k = 0; k < tiles.size(); ++k) {
+			msg.tiles[k].i = tiles[k].i;
+			msg.tiles[k].j = tiles[k].j;
+			msg.tiles[k].log_odds = tiles[k].logOdds;
+			msg.tiles[k].height = tiles[k].height;
+			msg.tiles[k].variance = tiles[k].variance;
+			msg.tiles[k].num_measurements = tiles[k].numMeasurements;
+		}
+		tiles_pub_.publish(msg);
 	}
+
+	/**
+	 * CALLBACK
+	 * Tiles of the other robots, queued for the fusion thread
+	 */
+	void tiles_Callback(const occupancy_mapping::MapTilesConstPtr &msg) {
+		if (msg->robot_id == robot_id)
+			return;
+		if (msg->cell_size != mapping_params.cellSize
+				|| msg->cell_resolution != mapping_params.cellResolution) {
+			ROS_WARN("Ignoring the tiles of %s, whose blocks differ from ours",
+					msg->robot_id.c_str());
+			return;
+		}
+		boost::mutex::scoped_lock lock(fusionQueueMutex_);
+		fusionQueue_.push_back(msg);
+		fusionCondition_.notify_one();
+	}
+
+	/**
+	 * Fusion thread
+	 * Adds the tiles received from the other robots to the maps, between two scans
+	 */
+	void FuseTiles() {
+		while (true) {
+			occupancy_mapping::MapTilesConstPtr msg;
+			{
+				boost::mutex::scoped_lock lock(fusionQueueMutex_);
+				while (fusionQueue_.empty() && !stopFusion_)
+					fusionCondition_.wait(lock);
+				if (stopFusion_)
+					return;
+				msg = fusionQueue_.front();
+				fusionQueue_.pop_front();
+			}
+
+			std::vector<MapTileData> tiles(msg->tiles.size());
+			for (size_t k = 0; k < tiles.size(); ++k) {
+				tiles[k].i = msg->tiles[k].i;
+				tiles[k].j = msg->tiles[k].j;
+				tiles[k].logOdds = msg->tiles[k].log_odds;
+				tiles[k].height = msg->tiles[k].height;
+				tiles[k].variance = msg->tiles[k].variance;
+				tiles[k].numMeasurements = msg->tiles[k].num_measurements;
+			}
+			boost::mutex::scoped_lock lock(mapMutex_);
+			m_pPipeline->FuseTiles(tiles);
+		}
+	}
+
+	/**
+	 * TIMER
+	 * Exports the DEM of the last snapshot, written in the background
+	 */
+	void export_Callback(const ros::WallTimerEvent &event) {
+		// The snapshot is immutable, so the writer can use its matrices without copying them
+		boost::shared_ptr<const MapSnapshot> snapshot = m_MapQuery.GetSnapshot();
+		if (!snapshot)
+			return;
+		DEMFileData data;
+		data.resolution = snapshot->resolution;
+		data.originX = snapshot->demOrigin.x * snapshot->resolution;
+		data.originY = snapshot->demOrigin.y * snapshot->resolution;
+		data.names.push_back("height");
+		data.layers.push_back(snapshot->height);
+		data.names.push_back("variance");
+		data.layers.push_back(snapshot->variance);
+		if (!demWriter_.WriteAsync(dem_export_file, data))
+			ROS_WARN("The previous DEM export is still being written, skipping this one");
+
+		// The statistics layers are composed into new matrices, which the writer then owns
+		if (mapping_params.statisticsLayers && !statisticsWriter_.IsBusy()) {
+			DEMFileData statistics;
+			bool composed;
+			{
+				boost::mutex::scoped_lock lock(mapMutex_);
+				composed = m_pPipeline->ComposeStatistics(statistics);
+			}
+			if (composed)
+				statisticsWriter_.WriteAsync(dem_export_file + ".stats", statistics);
+		}
+	}
+
+	/**
+	 * TIMER
+	 * Pipeline diagnostics, latencies in milliseconds over the last frames
+	 */
+	void diagnostics_Callback(const ros::WallTimerEvent &event) {
+		diagnostic_msgs::DiagnosticStatus status;
+		status.level = diagnostic_msgs::DiagnosticStatus::OK;
+		status.name = "occupancy_mapping: pipeline";
+		status.hardware_id = "occupancy_mapping";
+		unsigned int numFrames = m_PipelineStats.TakeNumFrames();
+		double period = (event.current_real - event.last_real).toSec();
+		if (numFrames == 0)
+			status.message = "No point cloud received";
+		else
+			status.message = "Processing point clouds";
+		addDiagnosticValue(status, "frames_per_second",
+				(period > 0) ? numFrames / period : 0.0);
+		// Frames dropped by the stages which fell behind
+		unsigned int numDropped = publicationQueue_->TakeNumDropped();
+		for (size_t s = 0; s < sensors_.size(); ++s)
+			numDropped += sensors_[s]->segmentationQueue.TakeNumDropped()
+					+ sensors_[s]->mappingQueue.TakeNumDropped();
+		addDiagnosticValue(status, "dropped_frames", numDropped);
+		for (int s = 0; s < NumPipelineStages; s++) {
+			PipelineStage stage = (PipelineStage) s;
+			float p50, p95, p99;
+			m_PipelineStats.GetDurationPercentiles(stage, p50, p95, p99);
+			std::string name = PipelineStats::GetStageName(stage);
+			addDiagnosticValue(status, name + "_p50_ms", p50);
+			addDiagnosticValue(status, name + "_p95_ms", p95);
+			addDiagnosticValue(status, name + "_p99_ms", p99);
+		}
+		for (int c = 0; c < NumPipelineCounters; c++) {
+			PipelineCounter counter = (PipelineCounter) c;
+			addDiagnosticValue(status, PipelineStats::GetCounterName(counter),
+					m_PipelineStats.GetMeanCount(counter));
+		}
+
+		diagnostic_msgs::DiagnosticArray array;
+		array.header.stamp = ros::Time::now();
+		array.status.push_back(status);
+		diagnostics_pub_.publish(array);
+	}
+
+	void addDiagnosticValue(diagnostic_msgs::DiagnosticStatus &status,
+			const std::string &key, double value) {
+		diagnostic_msgs::KeyValue keyValue;
+		keyValue.key = key;
+		std::ostringstream stream;
+		stream << value;
+		keyValue.value = stream.str();
+		status.values.push_back(keyValue);
+	}
+
+	/**
+	 * SERVICE
+	 * Map query
+	 */
+	bool query_Callback(occupancy_mapping::QueryMap::Request &req,
+			occupancy_mapping::QueryMap::Response &res) {
+		std::vector<cv::Point2d> points;
+		std::vector<MapSample> samples;
+		bool found;
+		if (!req.x.empty()) {
+			if (req.x.size() != req.y.size())
+				return false;
+			points.resize(req.x.size());
+			for (size_t i = 0; i < points.size(); ++i)
+				points[i] = cv::Point2d(req.x[i], req.y[i]);
+			found = m_MapQuery.Query(points, samples);
+		} else {
+			found = m_MapQuery.QueryBox(req.min_x, req.max_x, req.min_y,
+					req.max_y, points, samples);
+		}
+		if (!found)
+			return false;
+
+		size_t n = samples.size();
+		res.x.resize(n);
+		res.y.resize(n);
+		res.log_odds.resize(n);
+		res.probability.resize(n);
+		res.height.resize(n);
+		res.variance.resize(n);
+		res.known.resize(n);
+		for (size_t i = 0; i < n; ++i) {
+			res.x[i] = points[i].x;
+			res.y[i] = points[i].y;
+			res.log_odds[i] = samples[i].logOdds;
+			res.probability[i] = samples[i].probability;
+			res.height[i] = samples[i].height;
+			res.variance[i] = samples[i].variance;
+			res.known[i] = samples[i].bKnown;
+		}
+
+		// Only with the 3D layer, which does not change once the node runs
+		if (m_pPipeline->GetVoxelMap()) {
+			res.clearance.resize(n);
+			for (size_t i = 0; i < n; ++i)
+				res.clearance[i] = samples[i].clearance;
+		}
+		return true;
+	}
+
 public:
 	FloorPlaneMapping() :
-			nh_("~"),svm()
+			nh_("~"),it_(nh_),joySpinner_(1, &joyQueue_),querySpinner_(1, &queryQueue_),
+			isTraining(false)
 	{
 		nh_.param("base_frame", base_frame_, std::string("/body"));
 		nh_.param("world_frame", world_frame_, std::string("/world"));
-		nh_.param("max_range", max_range_, 5.0);
-		nh_.param("normal_estimation_radius",normal_estimation_radius,0.03);
-		nh_.param("traverse_threshold",traverse_threshold, 0.3);
-		nh_.param("step_function_parameter",step_function_parameter, 2.0);
-		nh_.param("n_samples", n_samples, 1000);
-		nh_.param("tolerance", tolerance, 1.0);
-		nh_.param("alpha", ALPHA, 1.0);
-		nh_.param("beta", BETA, 2.0);
-		nh_.param("z_threshold", Z_THRESHOLD, 0.4);
-		nh_.param("belief_mod", belief_mod, 3.0);
+		nh_.param("max_range", mapping_params.maxRange, 5.0);
+		nh_.param("normal_estimation_radius",mapping_params.normalEstimationRadius,0.03);
+		nh_.param("min_normal_neighbours",mapping_params.minNormalNeighbours,5);
+		nh_.param("traverse_threshold",mapping_params.traverseThreshold, 0.3);
+		nh_.param("step_function_parameter",mapping_params.stepFunctionParameter, 2.0);
+		nh_.param("n_samples", mapping_params.numSamples, 1000);
+		nh_.param("tolerance", mapping_params.tolerance, 1.0);
+		nh_.param("max_planes", mapping_params.maxPlanes, 1);
+		nh_.param("min_plane_support", mapping_params.minPlaneSupport, 50);
+		nh_.param("plane_adjacency", mapping_params.planeAdjacency, 0.1);
+		nh_.param("alpha", mapping_params.alpha, 1.0);
+		nh_.param("beta", mapping_params.beta, 2.0);
+		nh_.param("z_threshold", mapping_params.zThreshold, 0.4);
+		nh_.param("belief_mod", mapping_params.beliefMod, 3.0);
+		nh_.param("svm_lut_size", svm_lut_size, 128);
+		nh_.param("svm_training_budget", svm_training_budget, 5000);
+		nh_.param("use_online_classifier", use_online_classifier, false);
+		nh_.param("online_max_updates", online_max_updates, 500);
+		int online_num_features;
+		double online_gamma, online_learning_rate, online_regularisation;
+		double online_height_scale, online_variance_scale;
+		nh_.param("online_num_features", online_num_features, 64);
+		nh_.param("online_gamma", online_gamma, 0.5);
+		nh_.param("online_learning_rate", online_learning_rate, 0.5);
+		nh_.param("online_regularisation", online_regularisation, 1e-4);
+		nh_.param("online_height_scale", online_height_scale, 0.1);
+		nh_.param("online_variance_scale", online_variance_scale, 0.01);
+		m_pOnlineClassifier = new OnlineClassifier(online_num_features, online_gamma,
+				online_learning_rate, online_regularisation, online_height_scale,
+				online_variance_scale);
+		nh_.param("free_space_belief", mapping_params.freeSpaceBelief, 0.5);
+		nh_.param("state_threshold", mapping_params.stateThreshold, 1.0);
+		nh_.param("max_obstacle_distance", mapping_params.maxObstacleDistance, 2.0);
+		nh_.param("voxel_size", mapping_params.voxelSize, 0.0);
+		nh_.param("clearance_min_height", mapping_params.clearanceMinHeight, -1.0);
+		nh_.param("clearance_max_height", mapping_params.clearanceMaxHeight, 3.0);
+		nh_.param("converged_measurements", mapping_params.convergedMeasurements, 1000);
+		nh_.param("convergence_tolerance", mapping_params.convergenceTolerance, 0.02);
+		nh_.param("fine_resolution_radius", mapping_params.fineResolutionRadius, 0.0);
+		nh_.param("max_resolution_level", mapping_params.maxResolutionLevel, 2);
+		nh_.param("statistics_layers", mapping_params.statisticsLayers, false);
+		std::string record_file;
+		nh_.param("record_file", record_file, std::string(""));
+		if (!record_file.empty()) {
+			if (recorder_.Open(record_file))
+				ROS_INFO("Recording the scans to %s", record_file.c_str());
+			else
+				ROS_ERROR("Cannot open %s to record the scans", record_file.c_str());
+		}
+		std::string journal_file;
+		nh_.param("journal_file", journal_file, std::string(""));
+		if (!journal_file.empty()) {
+			if (journal_.Open(journal_file, mapping_params.cellSize, mapping_params.cellResolution))
+				ROS_INFO("Journaling the map updates to %s", journal_file.c_str());
+			else
+				ROS_ERROR("Cannot open %s to journal the map updates", journal_file.c_str());
+		}
+		// Binary DEM exports
+		double dem_export_period;
+		nh_.param("dem_export_file", dem_export_file, std::string(""));
+		nh_.param("dem_export_period", dem_export_period, 5.0);
+		// One thread per depth sensor
+		std::vector<std::string> scan_topics;
+		nh_.getParam("scan_topics", scan_topics);
+		if (scan_topics.empty())
+			scan_topics.push_back("scans");
+		// Frames held between two stages of the pipeline, the oldest being dropped beyond
+		nh_.param("stage_queue_size", stage_queue_size, 2);
+		stage_queue_size = std::max(stage_queue_size, 1);
+		nh_.param("share_map", share_map, false);
+		nh_.param("robot_id", robot_id, nh_.getNamespace());
+		std::string map_tiles_topic;
+		double map_share_period;
+		nh_.param("map_tiles_topic", map_tiles_topic, std::string("/map_tiles"));
+		nh_.param("map_share_period", map_share_period, 1.0);
 
 		ROS_INFO("Running");
 		ROS_INFO("Press \"A\" button to train the svm");
 		ROS_INFO("Press \"X\"/\"Y\" button to turn on/off the svm prediction");
-		assert(n_samples > 0);
+		assert(mapping_params.numSamples > 0);
 
 		// Make sure TF is ready
 		ros::Duration(0.5).sleep();
 
-		// Subscribers
-		scan_sub_ = nh_.subscribe("scans", 1, &FloorPlaneMapping::pc_Callback,
-				this);
+		// SVM Parameters, before any callback or thread may read them
+		isSVMOn = false;
+		params.svm_type = CvSVM::C_SVC;
+		params.kernel_type = CvSVM::RBF; // RBF Kernel: exp(-gamma*|u-v|^2)
+//		params.C = 1;
+//		params.gamma = 0.5;
+		params.term_crit = cvTermCriteria(CV_TERMCRIT_ITER, 500, 1e-6);
 
-		joy_sub_ = nh_.subscribe("/joy",10, &FloorPlaneMapping::joy_Callback,this);
+		// Subscribers, on the global queue unless async_spinning is set
+		nh_.param("async_spinning", async_spinning, true);
+		ros::NodeHandle joyNh(nh_);
+		ros::NodeHandle queryNh(nh_);
+		if (async_spinning) {
+			joyNh.setCallbackQueue(&joyQueue_);
+			queryNh.setCallbackQueue(&queryQueue_);
+		}
+		joy_sub_ = joyNh.subscribe("/joy",10, &FloorPlaneMapping::joy_Callback,this);
+		// Services
+		query_srv_ = queryNh.advertiseService("query_map", &FloorPlaneMapping::query_Callback, this);
 		// Publishers
 		pcl_pub_ = nh_.advertise<pcl::PointCloud<pcl::PointXYZ>>("obstacles",1);
 		marker_pub_ = nh_.advertise<visualization_msgs::Marker>("floor_plane", 1);
+		diagnostics_pub_ = nh_.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
+		diagnostics_timer_ = nh_.createWallTimer(ros::WallDuration(1.0),
+				&FloorPlaneMapping::diagnostics_Callback, this);
+		if (!dem_export_file.empty())
+			export_timer_ = nh_.createWallTimer(ros::WallDuration(dem_export_period),
+					&FloorPlaneMapping::export_Callback, this);
+		map_pub_ = it_.advertise("image", 1);
+		dem_pub_ = it_.advertise("dem", 1);
+		distance_pub_ = it_.advertise("obstacle_distance", 1);
 		// Mapping classes
-		m_pCartography = new Cartography(nh_, 1.0, 10);
-		m_pDME = new DEM(1.0, 10, nh_);
+		m_pPipeline = new MappingPipeline(mapping_params);
+		m_pCartography = m_pPipeline->GetCartography();
+		m_pDME = m_pPipeline->GetDEM();
+		m_pDistanceMap = m_pPipeline->GetDistanceMap();
 
-		// Point Cloud
-		obstaclePC.header.frame_id = world_frame_;
-		testPC.header.frame_id = world_frame_;
+		// Map sharing
+		stopFusion_ = false;
+		if (share_map) {
+			m_pPipeline->SetMapSharing(true);
+			tiles_pub_ = nh_.advertise<occupancy_mapping::MapTiles>(map_tiles_topic, 10);
+			tiles_sub_ = nh_.subscribe(map_tiles_topic, 100, &FloorPlaneMapping::tiles_Callback, this);
+			share_timer_ = nh_.createWallTimer(ros::WallDuration(map_share_period),
+					&FloorPlaneMapping::share_Callback, this);
+			fusionThread_ = boost::thread(&FloorPlaneMapping::FuseTiles, this);
+			ROS_INFO("Sharing the map as %s on %s", robot_id.c_str(), map_tiles_topic.c_str());
+		}
 
-		// SVM Parameters
-		isSVMOn = false;
-		params.svm_type = CvSVM::C_SVC;
-		params.kernel_type = CvSVM::RBF; // RBF Kernel: exp(-gamma*|u-v|^2)
-//		params.C = 1;
-//		params.gamma = 0.5;
-		params.term_crit = cvTermCriteria(CV_TERMCRIT_ITER, 500, 1e-6);
+		// Depth sensors, once the maps exist since their threads start right away
+		stopSensors_ = false;
+		stopPipeline_ = false;
+		publicationQueue_ = new SpscQueue<ScanFrame>(stage_queue_size);
+		for (size_t s = 0; s < scan_topics.size(); ++s) {
+			SensorInput *sensor = new SensorInput(mapping_params, stage_queue_size);
+			sensor->id = s;
+			sensor->frontEnd.SetKeepObservations(journal_.IsOpen());
+			ros::SubscribeOptions options = ros::SubscribeOptions::create<sensor_msgs::PointCloud2>(
+					scan_topics[s], 1, boost::bind(&FloorPlaneMapping::pc_Callback, this, _1, sensor),
+					ros::VoidPtr(), &sensor->queue);
+			sensor->sub = nh_.subscribe(options);
+			sensors_.push_back(sensor);
+		}
+		// The sensor list is fixed before the mapping thread goes through it
+		mappingThread_ = boost::thread(&FloorPlaneMapping::MappingWorker, this);
+		publicationThread_ = boost::thread(&FloorPlaneMapping::PublicationWorker, this);
+		for (size_t s = 0; s < sensors_.size(); ++s) {
+			SensorInput *sensor = sensors_[s];
+			sensor->segmentation = boost::thread(&FloorPlaneMapping::SegmentationWorker, this, sensor);
+			sensor->worker = boost::thread(&FloorPlaneMapping::SensorWorker, this, sensor);
+		}
+		ROS_INFO("Mapping the scans of %d sensor(s)", int(sensors_.size()));
+		if (async_spinning) {
+			joySpinner_.start();
+			querySpinner_.start();
+		}
 	}
 
 	~FloorPlaneMapping()
 	{
-		delete m_pCartography;
-		delete m_pDME;
+		// No joystick callback may start a training thread past this point
+		joySpinner_.stop();
+		querySpinner_.stop();
+		// Stops the ingestion first, then the stages downstream, the queues deleting the frames
+		// left in them
+		stopSensors_ = true;
+		for (size_t s = 0; s < sensors_.size(); ++s) {
+			sensors_[s]->sub.shutdown();
+			sensors_[s]->worker.join();
+		}
+		stopPipeline_ = true;
+		for (size_t s = 0; s < sensors_.size(); ++s)
+			sensors_[s]->segmentation.join();
+		mappingThread_.join();
+		publicationThread_.join();
+		for (size_t s = 0; s < sensors_.size(); ++s)
+			delete sensors_[s];
+		delete publicationQueue_;
+		if (trainingThread_.joinable())
+			trainingThread_.join();
+		{
+			boost::mutex::scoped_lock lock(fusionQueueMutex_);
+			stopFusion_ = true;
+			fusionCondition_.notify_one();
+		}
+		if (fusionThread_.joinable())
+			fusionThread_.join();
+		delete m_pPipeline;
+		delete m_pOnlineClassifier;
 	}
 
 	ros::NodeHandle getNodeHanlder(){
 		return nh_;
 	}
 
-	// Get the elapsed time from start to end
-	long getElapsedTime(timeval& start, timeval& end) {
-		long mtime, seconds, useconds;
-		seconds = end.tv_sec - start.tv_sec;
-		useconds = end.tv_usec - start.tv_usec;
-		mtime = ((seconds) * 1000 + useconds / 1000.0) + 0.5;
-		return mtime;
-	}
-
 	// Get a random index for the cloud point
 	size_t getRandomIndex(unsigned long i) {
 		size_t j = std::min((rand() / (double) RAND_MAX) * i, (double) i - 1);
 		return j;
 	}
-
-	// Calculate the distance between the point and the plane
-	double calcDistance(pcl::PointXYZ& point, Eigen::Vector3f& normalVector,
-			double d) {
-		Eigen::Vector3f t;
-		t << point.x, point.y, point.z;
-		return fabs(t.dot(normalVector) + d);
-	}
 };
 
 int main(int argc, char * argv[])
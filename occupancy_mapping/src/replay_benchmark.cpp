@@ -0,0 +1,92 @@
+/*
+ * Offline benchmark of the mapping pipeline
+ * Replays the scans recorded by the node (record_file parameter) as fast as possible and reports
+ * the frame rate and the latency of each stage. No ROS master, simulator or TF is needed.
+ *
+ * Usage: replay_benchmark <replay file> [repetitions]
+ */
+
+#include <pcl/common/transforms.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "MappingPipeline.h"
+#include "PipelineStats.h"
+#include "ReplayFile.h"
+
+// Number of frames kept for the percentiles
+#define STATS_WINDOW_SIZE	100000
+
+int main(int argc, char *argv[])
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <replay file> [repetitions]\n", argv[0]);
+		return 1;
+	}
+	int repetitions = (argc > 2) ? atoi(argv[2]) : 1;
+
+	ReplayReader reader;
+	if(!reader.Open(argv[1]))
+	{
+		fprintf(stderr, "Cannot read the replay file %s\n", argv[1]);
+		return 1;
+	}
+
+	PipelineStats stats(STATS_WINDOW_SIZE);
+	unsigned int numFrames = 0;
+	double start = PipelineStats::Now();
+	for(int r = 0; r < repetitions; r++)
+	{
+		// Same random samples for the RANSAC at each run
+		srand(0);
+		MappingPipeline pipeline((MappingParameters()));
+		ReplayFrame frame;
+		pcl::PointCloud<pcl::PointXYZ> basePC;
+		pcl::PointCloud<pcl::PointXYZ> worldPC;
+		cv::Mat image;
+		reader.Rewind();
+		while(reader.Read(frame))
+		{
+			StageTimer timer(stats);
+			Eigen::Affine3f sensorToWorld = ReplayFrame::GetTransform(frame.sensorToWorld);
+			pcl::transformPointCloud(frame.cloud, basePC, ReplayFrame::GetTransform(frame.sensorToBase));
+			pcl::transformPointCloud(frame.cloud, worldPC, sensorToWorld);
+			timer.Lap(StageIngestion);
+
+			pipeline.ProcessScan(frame.cloud, basePC, worldPC, sensorToWorld.translation()[0],
+				sensorToWorld.translation()[1], sensorToWorld.translation()[2], &timer);
+
+			// Everything the node does to publish, but the messages
+			cv::Mat demImage, distanceImage;
+			if(pipeline.GetCartography()->ComposeImage(image))
+				pipeline.GetDistanceMap()->ComposeImage(distanceImage, pipeline.GetCartography()->getMatOrigin(),
+					image.rows, image.cols);
+			pipeline.GetDEM()->ComposeImage(demImage);
+			timer.Lap(StagePublish);
+			timer.End();
+			numFrames++;
+		}
+	}
+	double elapsed = PipelineStats::Now()-start;
+
+	if(numFrames == 0)
+	{
+		fprintf(stderr, "No frame in %s\n", argv[1]);
+		return 1;
+	}
+	printf("%u frames in %.3f s: %.1f frames/s\n", numFrames, elapsed, numFrames/elapsed);
+	printf("%-20s %10s %10s %10s\n", "stage", "p50 (ms)", "p95 (ms)", "p99 (ms)");
+	for(int s = 0; s < NumPipelineStages; s++)
+	{
+		// The SVM is not run offline
+		if(s == StageSVM)
+			continue;
+		float p50, p95, p99;
+		stats.GetDurationPercentiles(PipelineStage(s), p50, p95, p99);
+		printf("%-20s %10.3f %10.3f %10.3f\n", PipelineStats::GetStageName(PipelineStage(s)), p50, p95, p99);
+	}
+	for(int c = 0; c < NumPipelineCounters; c++)
+		printf("%-20s %10.1f (mean)\n", PipelineStats::GetCounterName(PipelineCounter(c)), stats.GetMeanCount(PipelineCounter(c)));
+	return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef DEM_CORRELATION_H
+#define DEM_CORRELATION_H
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <particle_filter_base/DEMPyramid.h>
+
+namespace particle_filter_base {
+
+    // Scores a scan at every cell of a DEM at once. The samples are
+    // rasterised into a template around the robot, and the sum of squared
+    // differences with the DEM is expanded into correlations of the template
+    // with the heights, their squares and the mask of the measured cells,
+    // all computed in the Fourier domain. The spectra of the DEM are computed
+    // once per DEM, so a scan costs three forward and three inverse DFTs,
+    // whatever the number of samples.
+    // The score of a cell is the mean squared difference between the heights
+    // of the samples and those of the DEM around the cell, once the height
+    // offset which fits best is removed. Unlike the tolerance test of
+    // DEMPyramid, it does not rely on the height of a single cell.
+    class DEMCorrelation {
+        protected:
+            int rows;
+            int cols;
+            // Largest offset of a sample from the robot, in cells, the DEM
+            // being padded by as much so that the correlations do not wrap
+            int maxOffset;
+            int dftRows;
+            int dftCols;
+            // Spectra of the heights minus their mean, of their squares and
+            // of the mask of the cells with a finite height
+            cv::Mat heightSpectrum;
+            cv::Mat squareSpectrum;
+            cv::Mat maskSpectrum;
+
+        public:
+            DEMCorrelation() : rows(0), cols(0), maxOffset(0), dftRows(0), dftCols(0) {}
+
+            void build(const cv::Mat &dem, int maxOffset);
+
+            bool empty() const {return rows == 0 || cols == 0;}
+
+            // Scores of the scan at every cell, FLT_MAX where less than
+            // minCoverage of the samples fall on measured cells. The samples
+            // further than the largest offset are left out. Returns false
+            // when no sample is left.
+            bool score(const std::vector<HeightSample> &samples, double minCoverage,
+                    cv::Mat &scores) const;
+
+            // Cell of the lowest score. Returns false when no cell is scored.
+            static bool findBest(const cv::Mat &scores, int &m, int &n);
+    };
+
+};
+
+#endif // DEM_CORRELATION_H
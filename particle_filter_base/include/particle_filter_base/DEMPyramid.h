@@ -0,0 +1,65 @@
+#ifndef DEM_PYRAMID_H
+#define DEM_PYRAMID_H
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace particle_filter_base {
+
+    // Height sample of a scan, relative to the robot: offset in DEM cells
+    // from the cell of the robot, and height above the DEM at the robot
+    struct HeightSample {
+        int di;
+        int dj;
+        float dz;
+    };
+
+    // Min/max pyramid of a DEM, for a coarse-to-fine search of the cells
+    // where a scan fits. A cell of level L holds the lowest and highest
+    // heights of the 2^L x 2^L DEM cells it covers, so that a whole block of
+    // positions can be ruled out at once. The blocks which may still fit are
+    // split until the full resolution, where the samples are compared one by
+    // one. Only the blocks which cannot fit are dropped, so the search finds
+    // the same cells as a test of every cell, much faster when the terrain
+    // rules out most of the map at the coarse levels.
+    class DEMPyramid {
+        protected:
+            // Heights of the DEM
+            cv::Mat heights;
+            // Bounds of the heights per level, level 0 being the DEM. The
+            // cells without a finite height are unbounded.
+            std::vector<cv::Mat> minLevels;
+            std::vector<cv::Mat> maxLevels;
+
+            // Whether the scan may fit at one of the positions of the cell
+            // (M, N) of the level
+            bool mayFit(const std::vector<HeightSample> &samples, double tolerance,
+                    int level, int M, int N) const;
+
+        public:
+            DEMPyramid() {}
+
+            // Builds the levels until the coarsest one is at most
+            // topSize x topSize
+            void build(const cv::Mat &dem, int topSize = 8);
+
+            bool empty() const {return heights.empty();}
+            int rows() const {return heights.rows;}
+            int cols() const {return heights.cols;}
+            int numLevels() const {return minLevels.size();}
+
+            // Whether the scan fits with the robot at the cell (m, n): the
+            // first sample must be within the DEM, and every sample within
+            // the DEM at its height above the robot, up to the tolerance
+            bool fits(const std::vector<HeightSample> &samples, double tolerance,
+                    int m, int n) const;
+
+            // Searches the cell where the scan fits, the last one in row
+            // major order when several do. Returns false when none does.
+            bool find(const std::vector<HeightSample> &samples, double tolerance,
+                    int &m, int &n) const;
+    };
+
+};
+
+#endif // DEM_PYRAMID_H
@@ -0,0 +1,150 @@
+#include <float.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cmath>
+#include "particle_filter_base/DEMCorrelation.h"
+
+using namespace particle_filter_base;
+
+void DEMCorrelation::build(const cv::Mat &dem, int maxOffset) {
+    rows = dem.rows;
+    cols = dem.cols;
+    this->maxOffset = std::max(maxOffset, 0);
+    if (empty())
+        return;
+    dftRows = cv::getOptimalDFTSize(rows + this->maxOffset);
+    dftCols = cv::getOptimalDFTSize(cols + this->maxOffset);
+
+    // The score does not depend on the mean height, which is removed for
+    // the accuracy of the squares
+    double sum = 0.0;
+    int count = 0;
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            float h = dem.at<float>(i, j);
+            if (std::isfinite(h)) {
+                sum += h;
+                count++;
+            }
+        }
+    }
+    double mean = (count > 0) ? sum / count : 0.0;
+
+    // Zero beyond the DEM and on the cells without a finite height
+    cv::Mat height = cv::Mat::zeros(dftRows, dftCols, CV_64FC1);
+    cv::Mat square = cv::Mat::zeros(dftRows, dftCols, CV_64FC1);
+    cv::Mat mask = cv::Mat::zeros(dftRows, dftCols, CV_64FC1);
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            float h = dem.at<float>(i, j);
+            if (!std::isfinite(h))
+                continue;
+            height.at<double>(i, j) = h - mean;
+            square.at<double>(i, j) = (h - mean) * (h - mean);
+            mask.at<double>(i, j) = 1.0;
+        }
+    }
+    cv::dft(height, heightSpectrum, cv::DFT_COMPLEX_OUTPUT);
+    cv::dft(square, squareSpectrum, cv::DFT_COMPLEX_OUTPUT);
+    cv::dft(mask, maskSpectrum, cv::DFT_COMPLEX_OUTPUT);
+}
+
+bool DEMCorrelation::score(const std::vector<HeightSample> &samples, double minCoverage,
+        cv::Mat &scores) const {
+    if (empty())
+        return false;
+
+    // Template: number of samples, sum of their heights and of their squared
+    // heights per offset, the negative offsets wrapping around
+    cv::Mat weight = cv::Mat::zeros(dftRows, dftCols, CV_64FC1);
+    cv::Mat weightedHeight = cv::Mat::zeros(dftRows, dftCols, CV_64FC1);
+    cv::Mat weightedSquare = cv::Mat::zeros(dftRows, dftCols, CV_64FC1);
+    int numSamples = 0;
+    for (size_t k = 0; k < samples.size(); k++) {
+        if (abs(samples[k].di) > maxOffset || abs(samples[k].dj) > maxOffset)
+            continue;
+        int u = (samples[k].di + dftRows) % dftRows;
+        int v = (samples[k].dj + dftCols) % dftCols;
+        double dz = samples[k].dz;
+        weight.at<double>(u, v) += 1.0;
+        weightedHeight.at<double>(u, v) += dz;
+        weightedSquare.at<double>(u, v) += dz * dz;
+        numSamples++;
+    }
+    if (numSamples == 0)
+        return false;
+    cv::Mat weightSpectrum, weightedHeightSpectrum, weightedSquareSpectrum;
+    cv::dft(weight, weightSpectrum, cv::DFT_COMPLEX_OUTPUT);
+    cv::dft(weightedHeight, weightedHeightSpectrum, cv::DFT_COMPLEX_OUTPUT);
+    cv::dft(weightedSquare, weightedSquareSpectrum, cv::DFT_COMPLEX_OUTPUT);
+
+    // With d = h - t the difference between the DEM and a sample, summed
+    // over the samples on measured cells:
+    //   count = mask * w
+    //   sum d = h * w - mask * (w t)
+    //   sum d^2 = h^2 * w - 2 h * (w t) + mask * (w t^2)
+    // where * is the correlation, a product by the conjugate in the
+    // Fourier domain
+    cv::Mat countSpectrum(dftRows, dftCols, CV_64FC2);
+    cv::Mat sumSpectrum(dftRows, dftCols, CV_64FC2);
+    cv::Mat squareSumSpectrum(dftRows, dftCols, CV_64FC2);
+    for (int i = 0; i < dftRows; i++) {
+        const double *H = heightSpectrum.ptr<double>(i);
+        const double *H2 = squareSpectrum.ptr<double>(i);
+        const double *M = maskSpectrum.ptr<double>(i);
+        const double *W = weightSpectrum.ptr<double>(i);
+        const double *WT = weightedHeightSpectrum.ptr<double>(i);
+        const double *WT2 = weightedSquareSpectrum.ptr<double>(i);
+        double *count = countSpectrum.ptr<double>(i);
+        double *sum = sumSpectrum.ptr<double>(i);
+        double *squareSum = squareSumSpectrum.ptr<double>(i);
+        for (int j = 0; j < 2 * dftCols; j += 2) {
+            // a * conj(b) = (ar br + ai bi, ai br - ar bi)
+            count[j] = M[j] * W[j] + M[j+1] * W[j+1];
+            count[j+1] = M[j+1] * W[j] - M[j] * W[j+1];
+            sum[j] = H[j] * W[j] + H[j+1] * W[j+1] - (M[j] * WT[j] + M[j+1] * WT[j+1]);
+            sum[j+1] = H[j+1] * W[j] - H[j] * W[j+1] - (M[j+1] * WT[j] - M[j] * WT[j+1]);
+            squareSum[j] = H2[j] * W[j] + H2[j+1] * W[j+1] - 2.0 * (H[j] * WT[j] + H[j+1] * WT[j+1])
+                + M[j] * WT2[j] + M[j+1] * WT2[j+1];
+            squareSum[j+1] = H2[j+1] * W[j] - H2[j] * W[j+1] - 2.0 * (H[j+1] * WT[j] - H[j] * WT[j+1])
+                + M[j+1] * WT2[j] - M[j] * WT2[j+1];
+        }
+    }
+    cv::Mat count, sum, squareSum;
+    int inverseFlags = cv::DFT_INVERSE | cv::DFT_REAL_OUTPUT | cv::DFT_SCALE;
+    cv::dft(countSpectrum, count, inverseFlags);
+    cv::dft(sumSpectrum, sum, inverseFlags);
+    cv::dft(squareSumSpectrum, squareSum, inverseFlags);
+
+    // Variance of the differences, the mean being the best height offset.
+    // The counts are whole numbers up to the rounding of the DFTs.
+    double minCount = std::max(std::ceil(minCoverage * numSamples), 1.0) - 0.5;
+    scores.create(rows, cols, CV_32FC1);
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            double c = count.at<double>(i, j);
+            if (c < minCount) {
+                scores.at<float>(i, j) = FLT_MAX;
+                continue;
+            }
+            double s = sum.at<double>(i, j);
+            double variance = (squareSum.at<double>(i, j) - s * s / c) / c;
+            scores.at<float>(i, j) = std::max(variance, 0.0);
+        }
+    }
+    return true;
+}
+
+bool DEMCorrelation::findBest(const cv::Mat &scores, int &m, int &n) {
+    float best = FLT_MAX;
+    for (int i = 0; i < scores.rows; i++) {
+        for (int j = 0; j < scores.cols; j++) {
+            if (scores.at<float>(i, j) < best) {
+                best = scores.at<float>(i, j);
+                m = i;
+                n = j;
+            }
+        }
+    }
+    return best < FLT_MAX;
+}
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <cmath>
+#include "particle_filter_base/DEMPyramid.h"
+
+using namespace particle_filter_base;
+
+void DEMPyramid::build(const cv::Mat &dem, int topSize) {
+    heights = dem.clone();
+    minLevels.clear();
+    maxLevels.clear();
+    if (heights.empty())
+        return;
+
+    cv::Mat minLevel(heights.rows, heights.cols, CV_32FC1);
+    cv::Mat maxLevel(heights.rows, heights.cols, CV_32FC1);
+    for (int i = 0; i < heights.rows; i++) {
+        for (int j = 0; j < heights.cols; j++) {
+            float h = heights.at<float>(i, j);
+            bool finite = std::isfinite(h);
+            minLevel.at<float>(i, j) = finite ? h : -INFINITY;
+            maxLevel.at<float>(i, j) = finite ? h : INFINITY;
+        }
+    }
+    minLevels.push_back(minLevel);
+    maxLevels.push_back(maxLevel);
+
+    topSize = std::max(topSize, 1);
+    while (minLevels.back().rows > topSize || minLevels.back().cols > topSize) {
+        cv::Mat fineMin = minLevels.back();
+        cv::Mat fineMax = maxLevels.back();
+        int numRows = (fineMin.rows + 1) / 2;
+        int numCols = (fineMin.cols + 1) / 2;
+        cv::Mat coarseMin(numRows, numCols, CV_32FC1);
+        cv::Mat coarseMax(numRows, numCols, CV_32FC1);
+        for (int I = 0; I < numRows; I++) {
+            for (int J = 0; J < numCols; J++) {
+                float lowest = INFINITY;
+                float highest = -INFINITY;
+                for (int i = 2 * I; i < std::min(2 * I + 2, fineMin.rows); i++) {
+                    for (int j = 2 * J; j < std::min(2 * J + 2, fineMin.cols); j++) {
+                        lowest = std::min(lowest, fineMin.at<float>(i, j));
+                        highest = std::max(highest, fineMax.at<float>(i, j));
+                    }
+                }
+                coarseMin.at<float>(I, J) = lowest;
+                coarseMax.at<float>(I, J) = highest;
+            }
+        }
+        minLevels.push_back(coarseMin);
+        maxLevels.push_back(coarseMax);
+    }
+}
+
+bool DEMPyramid::fits(const std::vector<HeightSample> &samples, double tolerance,
+        int m, int n) const {
+    if (samples.empty())
+        return false;
+    int i = m + samples[0].di;
+    int j = n + samples[0].dj;
+    if (i < 0 || j < 0 || i >= heights.rows || j >= heights.cols)
+        return false;
+
+    double reference = heights.at<float>(m, n);
+    for (size_t k = 0; k < samples.size(); k++) {
+        i = m + samples[k].di;
+        j = n + samples[k].dj;
+        if (i < 0 || j < 0 || i >= heights.rows || j >= heights.cols)
+            continue;
+        if (fabs((heights.at<float>(i, j) - reference) - samples[k].dz) > tolerance)
+            return false;
+    }
+    return true;
+}
+
+bool DEMPyramid::mayFit(const std::vector<HeightSample> &samples, double tolerance,
+        int level, int M, int N) const {
+    // Positions of the block, and bounds of the height at the robot
+    int m0 = M << level;
+    int n0 = N << level;
+    int m1 = std::min((M + 1) << level, heights.rows) - 1;
+    int n1 = std::min((N + 1) << level, heights.cols) - 1;
+    const cv::Mat &minLevel = minLevels[level];
+    const cv::Mat &maxLevel = maxLevels[level];
+    double minReference = minLevel.at<float>(M, N);
+    double maxReference = maxLevel.at<float>(M, N);
+
+    for (size_t k = 0; k < samples.size(); k++) {
+        int i0 = m0 + samples[k].di;
+        int j0 = n0 + samples[k].dj;
+        int i1 = m1 + samples[k].di;
+        int j1 = n1 + samples[k].dj;
+        if (i0 < 0 || j0 < 0 || i1 >= heights.rows || j1 >= heights.cols) {
+            // The first sample is required within the DEM
+            if (k == 0 && (i1 < 0 || j1 < 0 || i0 >= heights.rows || j0 >= heights.cols))
+                return false;
+            // Ignored by some of the positions, so no bound
+            continue;
+        }
+        // The sample falls in at most 2 x 2 cells of the level
+        double lowest = INFINITY;
+        double highest = -INFINITY;
+        for (int I = i0 >> level; I <= (i1 >> level); I++) {
+            for (int J = j0 >> level; J <= (j1 >> level); J++) {
+                lowest = std::min(lowest, double(minLevel.at<float>(I, J)));
+                highest = std::max(highest, double(maxLevel.at<float>(I, J)));
+            }
+        }
+        // Computed like in fits, so that the rounding cannot drop a position which fits
+        if ((highest - minReference) - samples[k].dz < -tolerance
+                || (lowest - maxReference) - samples[k].dz > tolerance)
+            return false;
+    }
+    return true;
+}
+
+bool DEMPyramid::find(const std::vector<HeightSample> &samples, double tolerance,
+        int &m, int &n) const {
+    if (empty() || samples.empty())
+        return false;
+
+    // Blocks left to search, popped in reverse row major order since the
+    // last position which fits is kept
+    struct Block {
+        int level;
+        int M;
+        int N;
+    };
+    std::vector<Block> blocks;
+    int top = numLevels() - 1;
+    for (int M = 0; M < minLevels[top].rows; M++) {
+        for (int N = 0; N < minLevels[top].cols; N++) {
+            Block block = {top, M, N};
+            blocks.push_back(block);
+        }
+    }
+
+    bool found = false;
+    while (!blocks.empty()) {
+        Block block = blocks.back();
+        blocks.pop_back();
+        // Nothing to gain from a block entirely before the position found
+        int lastRow = std::min((block.M + 1) << block.level, heights.rows) - 1;
+        int lastCol = std::min((block.N + 1) << block.level, heights.cols) - 1;
+        if (found && (lastRow < m || (lastRow == m && lastCol <= n)))
+            continue;
+
+        if (block.level == 0) {
+            if (fits(samples, tolerance, block.M, block.N)) {
+                m = block.M;
+                n = block.N;
+                found = true;
+            }
+        } else if (mayFit(samples, tolerance, block.level, block.M, block.N)) {
+            int level = block.level - 1;
+            for (int I = 2 * block.M; I < std::min(2 * block.M + 2, minLevels[level].rows); I++) {
+                for (int J = 2 * block.N; J < std::min(2 * block.N + 2, minLevels[level].cols); J++) {
+                    Block child = {level, I, J};
+                    blocks.push_back(child);
+                }
+            }
+        }
+    }
+    return found;
+}
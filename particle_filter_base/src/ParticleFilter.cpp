@@ -2,12 +2,16 @@
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
+#include <float.h>
 
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <tf/tf.h>
 #include <geometry_msgs/Pose.h>
 #include <geometry_msgs/PoseArray.h>
 #include <particle_filter_base/Function.h>
+#include <particle_filter_base/DEMPyramid.h>
+#include <particle_filter_base/DEMCorrelation.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <geometry_msgs/TwistStamped.h>
 #include <pcl_ros/point_cloud.h>
@@ -19,9 +23,11 @@
 #include <cv_bridge/cv_bridge.h>
 #include <image_transport/image_transport.h>
 #include <image_transport/transport_hints.h>
+#include <boost/thread/mutex.hpp>
 
 #include <stdlib.h>
 #include <sys/time.h>
+#include <functional>
 #include <random>
 
 static double mapSize_ = 1.0;
@@ -160,6 +166,25 @@ namespace particle_filter_base {
                 resample();
             }
 
+            // Weights each particle by the likelihood of the observation at
+            // its position. Returns false, leaving the particles as they were,
+            // when none of them is likely.
+            bool update(const std::function<double (double, double)> &likelihood) {
+                std::vector<double> weights(particles.size());
+                double sum = 0.0;
+                for (size_t i = 0; i < particles.size(); i++) {
+                    weights[i] = likelihood(particles[i].getX(), particles[i].getY());
+                    sum += weights[i];
+                }
+                if (!(sum > 0.0))
+                    return false;
+                for (size_t i = 0; i < particles.size(); i++) {
+                    particles[i].setImportance(weights[i]);
+                }
+                resample();
+                return true;
+            }
+
             void resample() {
                 Function cdf, inv_cdf;
                 double sum = 0.0;
@@ -216,7 +241,6 @@ namespace particle_filter_base {
     class ParticleFilterLocalisation {
         protected:
             ros::NodeHandle nh_;
-            image_transport::ImageTransport it_;
             ros::Subscriber twist_sub_;
             ros::Subscriber scan_sub_;
             ros::Publisher pose_pub_;
@@ -233,12 +257,31 @@ namespace particle_filter_base {
 
             pcl::PointCloud<pcl::PointXYZ> lastpc_;
 
+            // The DEM images and the twist are received on queues of their own,
+            // served by spinner threads when async_spinning is set, so that
+            // decoding a DEM does not delay the particle updates on the scans
+            ros::CallbackQueue dem_queue_;
+            ros::CallbackQueue twist_queue_;
+            ros::AsyncSpinner dem_spinner_;
+            ros::AsyncSpinner twist_spinner_;
+
             geometry_msgs::Twist twist;
+            boost::mutex twist_mutex_;
             // OpenCV matrices to receive the Digital Elevation Map (dem) and
-            // its uncertainty/covariance
+            // its uncertainty/covariance, guarded by dem_mutex_ together with
+            // their flags and the pyramid. The callbacks replace them rather
+            // than writing into them, so a copy taken under the mutex stays
+            // valid once it is released.
             bool dem_received, dem_cov_received;
             cv::Mat dem, dem_cov;
+            // Built once per DEM, for the search of the robot position, or
+            // for the scores of the particles with correlation matching
+            boost::shared_ptr<const DEMPyramid> dem_pyramid;
+            boost::shared_ptr<const DEMCorrelation> dem_correlation;
+            boost::mutex dem_mutex_;
             double dem_x_orig, dem_y_orig, dem_scale;
+            bool correlation_matching_;
+            double min_matching_coverage_;
             ParticleFilter pf;
 
             bool demToWorld(const cv::Point2i & P, cv::Point2f & R) {
@@ -269,33 +312,14 @@ namespace particle_filter_base {
 
             inline int ConvertWorldCoordToIndex(double d)
             {
-            	return d*dCellSize_/double(uiCellSize_);
+            	return lround(d*uiCellSize_/dCellSize_);
             }
 
         protected: // ROS Callbacks
-			
-            // Find if mat(m, n) is such that the surrounding points follow the distribution in vConfig
-            bool foundConfiguration(const std::vector<pcl::PointXYZ> &vConfig, cv::Mat &mat, int m, int n)
-            {
-            	int i = m+ConvertWorldCoordToIndex(vConfig[0].x);
-            	int j = n+ConvertWorldCoordToIndex(vConfig[0].y);
-            	if(m+i>mat.size().width || m+i<0 || n+j>mat.size().width || n+j<0)
-            		return false;
 
-            	double reference = mat.at<float>(m, n);
-            	for(auto it=vConfig.begin(); it != vConfig.end(); ++it)
-            	{
-            		i = ConvertWorldCoordToIndex(it->x);
-            		j = ConvertWorldCoordToIndex(it->y);
-            		if(m+i>mat.size().width || m+i<0 || n+j>mat.size().width || n+j<0)
-            			continue;
-            		if(fabs((mat.at<float>(m+i,n+i)-reference)-it->z)>toleranceForDEMParsing)
-            			return false;
-            	}
-            	return true;
-            }
-
-            void DetermineRobotPositionFromDEM(std::vector<pcl::PointXYZ> &vMeasurements, std::pair<double, double> &robotPosition, double yaw)
+            // Measurements relative to the robot, in DEM cells along the world
+            // axes, and in height above the first measurement
+            void GetHeightSamples(std::vector<pcl::PointXYZ> &vMeasurements, double yaw, std::vector<HeightSample> &vSamples)
             {
             	// Rescaling
             	double reference = vMeasurements[0].z;
@@ -307,18 +331,53 @@ namespace particle_filter_base {
             			it->x = cos(yaw)*x-sin(yaw)*y;
             			it->y = sin(yaw)*x+cos(yaw)*y;
             	}
-            	for(int i = 0; i < dem.size().height; i++)
+            	vSamples.resize(vMeasurements.size());
+            	for(size_t k = 0; k < vMeasurements.size(); k++)
             	{
-            		for(int j = 0; j < dem.size().width; j++)
-            		{
-            			if(foundConfiguration(vMeasurements, dem, i, j))
-            			{
-            				robotPosition.first = ConvertIndexToWorldCoord(i);
-            				robotPosition.second = ConvertIndexToWorldCoord(j);
-            			}
-            		}
+            		vSamples[k].di = ConvertWorldCoordToIndex(vMeasurements[k].x);
+            		vSamples[k].dj = ConvertWorldCoordToIndex(vMeasurements[k].y);
+            		vSamples[k].dz = vMeasurements[k].z;
             	}
+            }
 
+            // Searches the DEM cell where the samples fit, coarse to fine
+            // (see DEMPyramid). Returns false when they fit nowhere.
+            bool DetermineRobotPositionFromDEM(const std::vector<HeightSample> &vSamples, const DEMPyramid &pyramid, std::pair<double, double> &robotPosition)
+            {
+            	int i, j;
+            	if(!pyramid.find(vSamples, toleranceForDEMParsing, i, j))
+            		return false;
+            	robotPosition.first = ConvertIndexToWorldCoord(i);
+            	robotPosition.second = ConvertIndexToWorldCoord(j);
+            	return true;
+            }
+
+            // Weights the particles by the score of the samples around their
+            // cell (see DEMCorrelation), the height differences being taken
+            // as Gaussian with toleranceForDEMParsing as deviation. When no
+            // particle stands where the samples fit, the filter is updated
+            // with the best cell instead, like with DetermineRobotPositionFromDEM.
+            // Returns false when the samples cannot be scored anywhere.
+            bool WeightParticlesFromDEM(const std::vector<HeightSample> &vSamples, const DEMCorrelation &correlation)
+            {
+            	cv::Mat scores;
+            	if(!correlation.score(vSamples, min_matching_coverage_, scores))
+            		return false;
+            	double variance = toleranceForDEMParsing*toleranceForDEMParsing;
+            	if(pf.update([&](double x, double y) {
+            		int i = ConvertWorldCoordToIndex(x);
+            		int j = ConvertWorldCoordToIndex(y);
+            		if(i < 0 || j < 0 || i >= scores.rows || j >= scores.cols || scores.at<float>(i, j) == FLT_MAX)
+            			return 0.0;
+            		return exp(-scores.at<float>(i, j)/(2*variance));
+            	}))
+            		return true;
+
+            	int i, j;
+            	if(!DEMCorrelation::findBest(scores, i, j))
+            		return false;
+            	pf.update(std::make_pair(ConvertIndexToWorldCoord(i), ConvertIndexToWorldCoord(j)));
+            	return true;
             }
 
             void pc_callback(const sensor_msgs::PointCloud2ConstPtr msg) {
@@ -347,10 +406,25 @@ namespace particle_filter_base {
 				if (sDeltaT > 10)
 					sDeltaT = 0;
 
+                geometry_msgs::Twist lastTwist;
+                {
+                    boost::mutex::scoped_lock lock(twist_mutex_);
+                    lastTwist = twist;
+                }
+                boost::shared_ptr<const DEMPyramid> pyramid;
+                boost::shared_ptr<const DEMCorrelation> correlation;
+                {
+                    boost::mutex::scoped_lock lock(dem_mutex_);
+                    if (dem_received) {
+                        dem_received = false;
+                        pyramid = dem_pyramid;
+                        correlation = dem_correlation;
+                    }
+                }
+
                 //
-                pf.predict(twist, sDeltaT);
-                if (dem_received ) {
-					dem_received = false;
+                pf.predict(lastTwist, sDeltaT);
+                if ((pyramid && !pyramid->empty()) || (correlation && !correlation->empty())) {
 					// Take K points in the lastpc_
 					std::vector<pcl::PointXYZ> vMeasurements;
 					for(int i=0; i<K_; ++i)
@@ -367,34 +441,54 @@ namespace particle_filter_base {
 					M.setRotation(Q);
 					double roll, pitch, yaw;
 					M.getRPY(roll, pitch, yaw);
-					DetermineRobotPositionFromDEM(vMeasurements, robotPosition, yaw);
-                    pf.update(robotPosition);
+					std::vector<HeightSample> vSamples;
+					GetHeightSamples(vMeasurements, yaw, vSamples);
+					if (correlation)
+						WeightParticlesFromDEM(vSamples, *correlation);
+					else if(DetermineRobotPositionFromDEM(vSamples, *pyramid, robotPosition))
+                        pf.update(robotPosition);
                 }
                 pf.publishPoseArray(header, pose_pub_);
             }
 
             void dem_callback(const sensor_msgs::ImageConstPtr& msg) {
+                // Decoded outside of the mutex, into a matrix owning its data
+                // since the message is released after the callback
+                cv::Mat image = cv_bridge::toCvCopy(msg,"rgba8")->image;
+                // Built here rather than for each scan, the elements of the
+                // image being read as heights
+                cv::Mat heights(image.rows, image.cols, CV_32FC1, image.data, image.step);
+                boost::shared_ptr<DEMPyramid> pyramid;
+                boost::shared_ptr<DEMCorrelation> correlation;
+                if (correlation_matching_) {
+                    correlation.reset(new DEMCorrelation);
+                    correlation->build(heights, ConvertWorldCoordToIndex(max_range_));
+                } else {
+                    pyramid.reset(new DEMPyramid);
+                    pyramid->build(heights);
+                }
+                boost::mutex::scoped_lock lock(dem_mutex_);
+                dem = image;
+                dem_pyramid = pyramid;
+                dem_correlation = correlation;
                 dem_received = true;
-                // In theory, this would require a mutex, but because the
-                // callbacks are called by ROS, we know that only one of them
-                // is running at a time. 
-                dem = cv_bridge::toCvShare(msg,"rgba8")->image;
             }
 
             void dem_cov_callback(const sensor_msgs::ImageConstPtr& msg) {
+                cv::Mat image = cv_bridge::toCvCopy(msg,"rgba8")->image;
+                boost::mutex::scoped_lock lock(dem_mutex_);
+                dem_cov = image;
                 dem_cov_received = true;
-                // In theory, this would require a mutex, but because the
-                // callbacks are called by ROS, we know that only one of them
-                // is running at a time. 
-                dem_cov = cv_bridge::toCvShare(msg,"rgba8")->image;
             }
 
             void twist_callback(const geometry_msgs::TwistStamped& msg){
+                boost::mutex::scoped_lock lock(twist_mutex_);
             	twist = msg.twist;
             }
 
         public:
-            ParticleFilterLocalisation() : nh_("~"), it_(nh_) {
+            ParticleFilterLocalisation() : nh_("~"),
+                dem_spinner_(1, &dem_queue_), twist_spinner_(1, &twist_queue_) {
                 std::string transport = "raw";
                 nh_.param("transport",transport,transport);
                 nh_.param("base_frame",base_frame_,std::string("/body"));
@@ -411,6 +505,15 @@ namespace particle_filter_base {
                 nh_.param("dem_y_orig",dem_y_orig,0.0);
                 nh_.param("dem_scale",dem_scale,1.0);
                 nh_.param("toleranceForDEMParsing",toleranceForDEMParsing,0.05);
+                // "pyramid" searches the cell where the scan fits within the
+                // tolerance, "correlation" weights every particle by a score
+                std::string dem_matching;
+                nh_.param("dem_matching",dem_matching,std::string("pyramid"));
+                correlation_matching_ = (dem_matching == "correlation");
+                // Part of the samples required on the DEM to score a cell
+                nh_.param("min_matching_coverage",min_matching_coverage_,0.5);
+                bool async_spinning;
+                nh_.param("async_spinning",async_spinning,true);
 
 
                 pf.initialise(num_particles_,0.0,initial_spread_, mapSize_);
@@ -420,12 +523,30 @@ namespace particle_filter_base {
                 // Make sure TF is ready
                 ros::Duration(0.5).sleep();
 
-                twist_sub_ = nh_.subscribe("/vrep/twistStatus",1,&ParticleFilterLocalisation::twist_callback,this);
+                // The scans stay on the global queue, spun by the main thread
+                ros::NodeHandle twist_nh(nh_);
+                ros::NodeHandle dem_nh(nh_);
+                if (async_spinning) {
+                    twist_nh.setCallbackQueue(&twist_queue_);
+                    dem_nh.setCallbackQueue(&dem_queue_);
+                }
+                // The image transport subscribes on the queue of its node handle
+                image_transport::ImageTransport it(dem_nh);
+                twist_sub_ = twist_nh.subscribe("/vrep/twistStatus",1,&ParticleFilterLocalisation::twist_callback,this);
                 scan_sub_ = nh_.subscribe("scans",1,&ParticleFilterLocalisation::pc_callback,this);
                 pose_pub_ = nh_.advertise<geometry_msgs::PoseArray>("particles",1);
-                DEM_sub_ = it_.subscribe<ParticleFilterLocalisation>("dem",1, &ParticleFilterLocalisation::dem_callback,this,transport);
-                DEM_cov_sub_ = it_.subscribe<ParticleFilterLocalisation>("dem_covariance",1, &ParticleFilterLocalisation::dem_cov_callback,this,transport);
+                DEM_sub_ = it.subscribe<ParticleFilterLocalisation>("dem",1, &ParticleFilterLocalisation::dem_callback,this,transport);
+                DEM_cov_sub_ = it.subscribe<ParticleFilterLocalisation>("dem_covariance",1, &ParticleFilterLocalisation::dem_cov_callback,this,transport);
+
+                if (async_spinning) {
+                    twist_spinner_.start();
+                    dem_spinner_.start();
+                }
+            }
 
+            ~ParticleFilterLocalisation() {
+                dem_spinner_.stop();
+                twist_spinner_.stop();
             }
 
     };
@@ -1,4 +1,5 @@
 ﻿#include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <visualization_msgs/Marker.h>
 #include <geometry_msgs/Twist.h>
 #include <sensor_msgs/PointCloud2.h>
@@ -17,6 +18,8 @@
 #include <tf/tf.h>
 #include <tf/transform_listener.h>
 
+#include <boost/thread/mutex.hpp>
+
 #include <sys/time.h>
 #include <map>
 #include <vector>
@@ -88,15 +91,21 @@ protected:
 	ros::Subscriber m_FloorProjectorSubscriber;
 	ros::Subscriber m_DepthSensorSubscriber;
 	ros::Subscriber m_MetalDetectorSubscriber;
+	// The depth sensor callback waits for TF, so it gets a queue and a spinner thread of its own
+	// when async_spinning is set, the other callbacks being spun by the main thread
+	ros::CallbackQueue m_DepthSensorQueue;
+	ros::AsyncSpinner m_DepthSensorSpinner;
 	ros::Publisher m_MineMarkerPublisher;
 	ros::Publisher m_ArmTwistPublisher;
 	tf::TransformListener m_Listener;
 
-	ros::Time m_MsgHeaderStamp;
 	std::vector<tf::Vector3> m_vMinesPositions;
 
 	////////
 	// State
+	// Pose written by the depth sensor callback, guarded by m_PoseMutex
+	boost::mutex m_PoseMutex;
+	ros::Time m_MsgHeaderStamp;
 	tf::Vector3 m_WorldSpaceRobotPosition;
 	tf::Vector3 m_WorldSpaceToolPosition;
 	double m_Orientation;
@@ -122,30 +131,37 @@ protected:
 	void DepthSensorCallback(const sensor_msgs::PointCloud2ConstPtr msg)
 	{
 		// Get the current world space tool position
-		m_MsgHeaderStamp = msg->header.stamp;
+		ros::Time stamp = msg->header.stamp;
 		m_Listener.waitForTransform("/world", "VSV/Tool",
-			m_MsgHeaderStamp, ros::Duration(1.0));
+			stamp, ros::Duration(1.0));
 		tf::StampedTransform transform;
 		m_Listener.lookupTransform("/world", "VSV/Tool",
-			m_MsgHeaderStamp, transform);
-		m_WorldSpaceToolPosition = transform * tf::Vector3(0.0, 0.0, 0.0);
+			stamp, transform);
+		tf::Vector3 toolPosition = transform * tf::Vector3(0.0, 0.0, 0.0);
 
 		// Get the current world space robot position
 		m_Listener.waitForTransform("/world", "VSV/base",
-			m_MsgHeaderStamp, ros::Duration(1.0));
+			stamp, ros::Duration(1.0));
 		m_Listener.lookupTransform("/world", "VSV/base",
-			m_MsgHeaderStamp, transform);
-		m_WorldSpaceRobotPosition = transform * tf::Vector3(0.0, 0.0, 0.0);
+			stamp, transform);
+		tf::Vector3 robotPosition = transform * tf::Vector3(0.0, 0.0, 0.0);
 		
 		//ROS_INFO("Base position %f %f %f",
-			//	m_WorldSpaceRobotPosition.x(), m_WorldSpaceRobotPosition.y(), m_WorldSpaceRobotPosition.z());
+			//	robotPosition.x(), robotPosition.y(), robotPosition.z());
 
 		// Get the orientation of the robot
 		auto Q = transform.getRotation();
 		tf::Matrix3x3 M;
 		M.setRotation(Q);
-		double roll, pitch;
-		M.getRPY(roll, pitch, m_Orientation);
+		double roll, pitch, yaw;
+		M.getRPY(roll, pitch, yaw);
+
+		// The pose is only held locked once complete, not during the waits
+		boost::mutex::scoped_lock lock(m_PoseMutex);
+		m_MsgHeaderStamp = stamp;
+		m_WorldSpaceToolPosition = toolPosition;
+		m_WorldSpaceRobotPosition = robotPosition;
+		m_Orientation = yaw;
 	}
 
 	// Detects the change of color in a picture (with a low number of different colors)
@@ -244,26 +260,33 @@ protected:
 
 		if(v.data>0.95)	// Mine detected
 		{
+			tf::Vector3 toolPosition;
+			ros::Time stamp;
+			{
+				boost::mutex::scoped_lock lock(m_PoseMutex);
+				toolPosition = m_WorldSpaceToolPosition;
+				stamp = m_MsgHeaderStamp;
+			}
 			//ROS_INFO("Found a mine");
 			// Check whether a mine at the same position has already been found
 			for(auto it = m_vMinesPositions.begin(); it!= m_vMinesPositions.end(); ++it)
 			{
-				if(squaredDistance2D(it->x(), it->y(), m_WorldSpaceToolPosition.x(), m_WorldSpaceToolPosition.y())<0.04)
+				if(squaredDistance2D(it->x(), it->y(), toolPosition.x(), toolPosition.y())<0.04)
 					return;
 			}
 			//ROS_INFO("Publishing marker");
 
 			visualization_msgs::Marker m;
-			m.header.stamp = m_MsgHeaderStamp;
+			m.header.stamp = stamp;
 			m.header.frame_id = "/world";
 			m.ns = "mine";
 			m.id = sMarkerID++;
-			m_vMinesPositions.push_back(m_WorldSpaceToolPosition);
+			m_vMinesPositions.push_back(toolPosition);
 			m.type = visualization_msgs::Marker::CYLINDER;
 			m.action = visualization_msgs::Marker::ADD;
-			m.pose.position.x = m_WorldSpaceToolPosition.x();
-			m.pose.position.y = m_WorldSpaceToolPosition.y();
-			m.pose.position.z = m_WorldSpaceToolPosition.z();
+			m.pose.position.x = toolPosition.x();
+			m.pose.position.y = toolPosition.y();
+			m.pose.position.z = toolPosition.z();
 			m.scale.x = 0.4;
 			m.scale.y = 0.4;
 			m.scale.z = 0.4;
@@ -279,7 +302,7 @@ protected:
 
 public:
 	MineDetector() :
-		m_NodeHandle("~")
+		m_NodeHandle("~"), m_DepthSensorSpinner(1, &m_DepthSensorQueue)
 	{
 		// Make sure TF is ready
 		ros::Duration(0.5).sleep();
@@ -289,9 +312,21 @@ public:
 		m_FloorProjectorSubscriber = m_NodeHandle.subscribe("/floor_projector/edge", 1, &MineDetector::FloorProjectorCallback, this);
 		m_RobotCommandSubscriber = m_NodeHandle.subscribe<geometry_msgs::Twist>("/vsv_driver/twistCommand",1,&MineDetector::RobotCommandCallback, this);
 		m_MetalDetectorSubscriber = m_NodeHandle.subscribe("/vrep/metalDetector", 1, &MineDetector::MetalDetectorCallback, this);
-		m_DepthSensorSubscriber = m_NodeHandle.subscribe("/vrep/depthSensor", 1, &MineDetector::DepthSensorCallback, this);
+		bool bAsyncSpinning;
+		m_NodeHandle.param("async_spinning", bAsyncSpinning, true);
+		ros::NodeHandle depthSensorHandle(m_NodeHandle);
+		if(bAsyncSpinning)
+			depthSensorHandle.setCallbackQueue(&m_DepthSensorQueue);
+		m_DepthSensorSubscriber = depthSensorHandle.subscribe("/vrep/depthSensor", 1, &MineDetector::DepthSensorCallback, this);
 		m_MineMarkerPublisher = m_NodeHandle.advertise<visualization_msgs::Marker>("mine",1);
 		m_ArmTwistPublisher = m_NodeHandle.advertise<geometry_msgs::Twist>("/arm_ik/twist",1);
+		if(bAsyncSpinning)
+			m_DepthSensorSpinner.start();
+	}
+
+	~MineDetector()
+	{
+		m_DepthSensorSpinner.stop();
 	}
 };
 